@@ -0,0 +1,602 @@
+// Microbenchmarks for the message parsing and dispatch hot paths. Every
+// message is built in memory, so no bus or BlueZ is needed. Results are
+// written as JSON so runs from different releases can be compared.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "bluetooth_manager.h"
+#include "notification_recorder.h"
+
+const std::string PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
+const std::string GATT_CHARACTERISTIC_INTERFACE =
+  "org.bluez.GattCharacteristic1";
+
+#ifdef NDEBUG
+const char* const BUILD_FLAVOR = "release";
+#else
+const char* const BUILD_FLAVOR = "debug";
+#endif
+
+const size_t TREE_SIZES[]    = {10, 100, 1000, 10000};
+const size_t PAYLOAD_SIZES[] = {20, 244, 512};
+
+struct BenchmarkResult
+{
+  std::string name;
+  size_t      size       = 0;  // Objects, devices or payload bytes
+  size_t      items      = 1;  // Work items handled by one operation
+  uint64_t    iterations = 0;
+  double      nsPerOp    = 0;
+};
+
+struct BenchmarkOptions
+{
+  double      minSeconds = 0.2;
+  std::string filter;
+  std::string output;  // Empty for stdout
+};
+
+// Runs body in growing batches until one batch takes at least minSeconds
+static BenchmarkResult measure(const std::string&           name,
+                               size_t                       size,
+                               size_t                       items,
+                               double                       minSeconds,
+                               const std::function<void()>& body)
+{
+  using Clock = std::chrono::steady_clock;
+
+  body();  // Warm caches and lazily built state
+
+  uint64_t iterations = 1;
+  for (;;)
+  {
+    auto start = Clock::now();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+      body();
+    }
+    std::chrono::duration<double> elapsedTime = Clock::now() - start;
+    double                        elapsed     = elapsedTime.count();
+
+    if (elapsed >= minSeconds)
+    {
+      BenchmarkResult result;
+      result.name       = name;
+      result.size       = size;
+      result.items      = items;
+      result.iterations = iterations;
+      result.nsPerOp    = elapsed * 1e9 / static_cast<double>(iterations);
+      return result;
+    }
+
+    // Aim just past the target next time, but at least double
+    double scale = elapsed > 0 ? minSeconds * 1.2 / elapsed : 10.0;
+    iterations   = std::max<uint64_t>(
+      iterations * 2, static_cast<uint64_t>(static_cast<double>(iterations) *
+                                            std::min(scale, 100.0)));
+  }
+}
+
+// Synthetic BlueZ object tree: one adapter, then groups of a device, its
+// GATT service and two characteristics until count objects exist
+class TreeBuilder
+{
+public:
+  explicit TreeBuilder(size_t count) : count_(count)
+  {
+  }
+
+  DBusMessage* buildManagedObjects()
+  {
+    DBusMessage*    reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+    DBusMessageIter iter, objects_iter;
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(
+      &iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects_iter);
+
+    appendObject(&objects_iter,
+                 "/org/bluez/hci0",
+                 "org.bluez.Adapter1",
+                 [](DBusMessageIter* props) {
+                   const char* address = "00:00:00:00:00:01";
+                   DBusHelper::appendDictEntry(
+                     props, "Address", DBUS_TYPE_STRING, &address);
+                 });
+
+    char path[128];
+    for (size_t object = 1; object < count_; object++)
+    {
+      size_t device = (object - 1) / 4;
+      std::snprintf(path,
+                    sizeof(path),
+                    "/org/bluez/hci0/dev_C0_FF_EE_%02zX_%02zX_%02zX",
+                    (device >> 16) & 0xff,
+                    (device >> 8) & 0xff,
+                    device & 0xff);
+      std::string devicePath = path;
+
+      size_t slot = (object - 1) % 4;
+      switch (slot)
+      {
+        case 0:
+          appendDevice(&objects_iter, devicePath, device);
+          break;
+        case 1:
+          appendService(&objects_iter, devicePath);
+          break;
+        default:
+          std::snprintf(path,
+                        sizeof(path),
+                        "/service0010/char%04zx",
+                        0x11 + 2 * (slot - 2));
+          characteristicPaths_.push_back(devicePath + path);
+          appendCharacteristic(&objects_iter, characteristicPaths_.back());
+          break;
+      }
+    }
+
+    dbus_message_iter_close_container(&iter, &objects_iter);
+    return reply;
+  }
+
+  const std::vector<std::string>& characteristicPaths() const
+  {
+    return characteristicPaths_;
+  }
+
+private:
+  size_t                   count_;
+  std::vector<std::string> characteristicPaths_;
+
+  void appendObject(DBusMessageIter*                             objects_iter,
+                    const std::string&                           path,
+                    const char*                                  interface,
+                    const std::function<void(DBusMessageIter*)>& appendProps)
+  {
+    DBusMessageIter object_iter, interfaces_iter, interface_iter, props_iter;
+    const char*     objectPath = path.c_str();
+
+    dbus_message_iter_open_container(
+      objects_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &object_iter);
+    dbus_message_iter_append_basic(
+      &object_iter, DBUS_TYPE_OBJECT_PATH, &objectPath);
+    dbus_message_iter_open_container(
+      &object_iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &interfaces_iter);
+    dbus_message_iter_open_container(
+      &interfaces_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &interface_iter);
+    dbus_message_iter_append_basic(
+      &interface_iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(
+      &interface_iter, DBUS_TYPE_ARRAY, "{sv}", &props_iter);
+
+    appendProps(&props_iter);
+
+    dbus_message_iter_close_container(&interface_iter, &props_iter);
+    dbus_message_iter_close_container(&interfaces_iter, &interface_iter);
+    dbus_message_iter_close_container(&object_iter, &interfaces_iter);
+    dbus_message_iter_close_container(objects_iter, &object_iter);
+  }
+
+  void appendDevice(DBusMessageIter*   objects_iter,
+                    const std::string& path,
+                    size_t             index)
+  {
+    std::string address = path.substr(path.size() - 17);
+    std::replace(address.begin(), address.end(), '_', ':');
+    std::string name = "Bench " + std::to_string(index);
+
+    // Every other device advertises the service the filter looks for
+    std::vector<std::string> uuids = {"0000180f-0000-1000-8000-00805f9b34fb",
+                                      "0000180a-0000-1000-8000-00805f9b34fb"};
+    if (index % 2 == 0)
+      uuids.push_back("15451545-0000-1000-8000-00805f9b34fb");
+
+    appendObject(
+      objects_iter, path, "org.bluez.Device1", [&](DBusMessageIter* props) {
+        const char* addressValue = address.c_str();
+        const char* nameValue    = name.c_str();
+        dbus_bool_t connected    = FALSE;
+        int16_t     rssi         = -60;
+        DBusHelper::appendDictEntry(
+          props, "Address", DBUS_TYPE_STRING, &addressValue);
+        DBusHelper::appendDictEntry(
+          props, "Name", DBUS_TYPE_STRING, &nameValue);
+        DBusHelper::appendDictEntry(props, "UUIDs", uuids);
+        DBusHelper::appendDictEntry(
+          props, "Connected", DBUS_TYPE_BOOLEAN, &connected);
+        DBusHelper::appendDictEntry(
+          props, "ServicesResolved", DBUS_TYPE_BOOLEAN, &connected);
+        DBusHelper::appendDictEntry(props, "RSSI", DBUS_TYPE_INT16, &rssi);
+      });
+  }
+
+  void appendService(DBusMessageIter* objects_iter, const std::string& path)
+  {
+    std::string servicePath = path + "/service0010";
+    appendObject(objects_iter,
+                 servicePath,
+                 "org.bluez.GattService1",
+                 [&](DBusMessageIter* props) {
+                   const char* uuid   = "15451545-0000-1000-8000-00805f9b34fb";
+                   const char* device = path.c_str();
+                   DBusHelper::appendDictEntry(
+                     props, "UUID", DBUS_TYPE_STRING, &uuid);
+                   DBusHelper::appendDictEntry(
+                     props, "Device", DBUS_TYPE_OBJECT_PATH, &device);
+                 });
+  }
+
+  void appendCharacteristic(DBusMessageIter*   objects_iter,
+                            const std::string& path)
+  {
+    std::string servicePath = path.substr(0, path.rfind('/'));
+    appendObject(objects_iter,
+                 path,
+                 GATT_CHARACTERISTIC_INTERFACE.c_str(),
+                 [&](DBusMessageIter* props) {
+                   const char* uuid    = "15451546-0000-1000-8000-00805f9b34fb";
+                   const char* service = servicePath.c_str();
+                   DBusHelper::appendDictEntry(
+                     props, "UUID", DBUS_TYPE_STRING, &uuid);
+                   DBusHelper::appendDictEntry(
+                     props, "Service", DBUS_TYPE_OBJECT_PATH, &service);
+                   DBusHelper::appendDictEntry(
+                     props, "Flags", {"read", "write", "notify"});
+                 });
+  }
+};
+
+static DBusMessage* buildValueChanged(const std::string& path, size_t size)
+{
+  std::vector<uint8_t> value(size, 0x5a);
+  const char*          interface = GATT_CHARACTERISTIC_INTERFACE.c_str();
+
+  DBusMessage* signal = dbus_message_new_signal(
+    path.c_str(), PROPERTIES_INTERFACE.c_str(), "PropertiesChanged");
+
+  DBusMessageIter iter, dict_iter, entry_iter, variant_iter, invalidated_iter;
+  const char*     key = "Value";
+  dbus_message_iter_init_append(signal, &iter);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict_iter);
+  dbus_message_iter_open_container(
+    &dict_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &entry_iter);
+  dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key);
+  dbus_message_iter_open_container(
+    &entry_iter, DBUS_TYPE_VARIANT, "ay", &variant_iter);
+  DBusHelper::appendByteArray(&variant_iter, value.data(), value.size());
+  dbus_message_iter_close_container(&entry_iter, &variant_iter);
+  dbus_message_iter_close_container(&dict_iter, &entry_iter);
+  dbus_message_iter_close_container(&iter, &dict_iter);
+  dbus_message_iter_open_container(
+    &iter, DBUS_TYPE_ARRAY, "s", &invalidated_iter);
+  dbus_message_iter_close_container(&iter, &invalidated_iter);
+  return signal;
+}
+
+// Friend of BluetoothManager, so the private paths a bus message would take
+// can be driven directly
+struct BluetoothManagerBenchmark
+{
+  const BenchmarkOptions&       options;
+  std::vector<BenchmarkResult>& results;
+
+  bool selected(const std::string& name) const
+  {
+    return options.filter.empty() ||
+           name.find(options.filter) != std::string::npos;
+  }
+
+  void add(const BenchmarkResult& result)
+  {
+    std::cerr << std::left << std::setw(32) << result.name << std::right
+              << std::setw(7) << result.size << std::setw(14) << std::fixed
+              << std::setprecision(1) << result.nsPerOp << " ns/op"
+              << std::endl;
+    results.push_back(result);
+  }
+
+  void managedObjects()
+  {
+    const std::string name = "managed_objects_decode";
+    if (!selected(name))
+      return;
+
+    for (size_t size : TREE_SIZES)
+    {
+      TreeBuilder      tree(size);
+      DBusMessage*     reply = tree.buildManagedObjects();
+      BluetoothManager manager;
+
+      add(measure(name, size, size, options.minSeconds, [&]() {
+        manager.applyManagedObjects(reply);
+      }));
+      dbus_message_unref(reply);
+    }
+  }
+
+  void serviceFilter()
+  {
+    const std::string name = "desired_service_filter";
+    if (!selected(name))
+      return;
+
+    for (size_t size : TREE_SIZES)
+    {
+      // Size counts devices here, so build a tree holding that many
+      TreeBuilder      tree(size * 4 + 1);
+      DBusMessage*     reply = tree.buildManagedObjects();
+      BluetoothManager manager;
+      manager.applyManagedObjects(reply);
+      dbus_message_unref(reply);
+
+      manager.desiredServices_.insert(BluetoothUuid::fromString("15451545"));
+      manager.desiredServices_.insert(BluetoothUuid::fromString("1234"));
+
+      size_t matches = 0;
+      add(measure(name, size, size, options.minSeconds, [&]() {
+        for (const auto& entry : manager.devices_)
+        {
+          matches += manager.hasDesiredService(entry.device);
+        }
+      }));
+      if (matches == 0)
+        std::cerr << "No device matched the service filter" << std::endl;
+    }
+  }
+
+  void writeMarshal()
+  {
+    const std::string name = "write_value_marshal";
+    if (!selected(name))
+      return;
+
+    for (size_t size : PAYLOAD_SIZES)
+    {
+      std::vector<uint8_t> data(size, 0xa5);
+
+      add(measure(name, size, 1, options.minSeconds, [&]() {
+        DBusMessage* msg = dbus_message_new_method_call(
+          "org.bluez",
+          "/org/bluez/hci0/dev_C0_FF_EE_00_00_00/service0010/char0011",
+          GATT_CHARACTERISTIC_INTERFACE.c_str(),
+          "WriteValue");
+        BluetoothManager::appendWriteValueArgs(
+          msg, data.data(), data.size(), WriteType::Command);
+        dbus_message_unref(msg);
+      }));
+    }
+  }
+
+  void readUnmarshal()
+  {
+    const std::string name = "read_value_unmarshal";
+    if (!selected(name))
+      return;
+
+    uint8_t buffer[NOTIFICATION_MAX_PAYLOAD];
+    for (size_t size : PAYLOAD_SIZES)
+    {
+      std::vector<uint8_t> data(size, 0xa5);
+      DBusMessage* reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+      DBusMessageIter iter;
+      dbus_message_iter_init_append(reply, &iter);
+      DBusHelper::appendByteArray(&iter, data.data(), data.size());
+
+      add(measure(name, size, 1, options.minSeconds, [&]() {
+        BluetoothManager::copyReadValue(reply, buffer, sizeof(buffer));
+      }));
+      dbus_message_unref(reply);
+    }
+  }
+
+  // A value signal goes through the connection filter, the path lookup and
+  // delivery, either to the callback or into the notification queue
+  void notificationDispatch(bool queued)
+  {
+    const std::string name = queued ? "notification_dispatch_queue"
+                                    : "notification_dispatch_callback";
+    if (!selected(name))
+      return;
+
+    TreeBuilder      tree(1000);
+    DBusMessage*     reply = tree.buildManagedObjects();
+    BluetoothManager manager;
+    manager.applyManagedObjects(reply);
+    dbus_message_unref(reply);
+
+    for (auto& entry : manager.characteristics_)
+    {
+      entry.notifying = true;
+    }
+
+    uint64_t delivered = 0;
+    if (queued)
+    {
+      manager.enableNotificationQueue();
+    }
+    else
+    {
+      manager.setNotificationCallback(
+        [&delivered](const std::string&, const std::vector<uint8_t>&) {
+          delivered++;
+        });
+    }
+
+    NotificationRecord record;
+    const std::string& path = tree.characteristicPaths()[0];
+    for (size_t size : {size_t(20), size_t(244)})
+    {
+      DBusMessage* signal = buildValueChanged(path, size);
+
+      add(measure(name, size, 1, options.minSeconds, [&]() {
+        BluetoothManager::messageFilter(nullptr, signal, &manager);
+        if (queued && manager.getNotificationQueue()->tryPop(record))
+          delivered++;
+      }));
+      dbus_message_unref(signal);
+    }
+
+    if (delivered == 0)
+      std::cerr << name << " delivered nothing" << std::endl;
+  }
+
+  // Appending to the recorder, segment rotation included, with the files
+  // on the temp directory
+  void recorderAppend()
+  {
+    const std::string name = "recorder_append";
+    if (!selected(name))
+      return;
+
+    const std::string path =
+      "/org/bluez/hci0/dev_C0_FF_EE_00_00_00/service0010/char0011";
+    std::string prefix = "/tmp/bscm-benchmark-" + std::to_string(getpid());
+
+    for (size_t size : PAYLOAD_SIZES)
+    {
+      RecorderOptions recorderOptions;
+      recorderOptions.prefix      = prefix;
+      recorderOptions.maxSegments = 2;
+
+      NotificationRecorder recorder;
+      if (!recorder.open(recorderOptions))
+        return;
+
+      std::vector<uint8_t> data(size, 0xa5);
+      NotificationHeader   header;
+      header.length = static_cast<uint16_t>(size);
+
+      add(measure(name, size, 1, options.minSeconds, [&]() {
+        header.sequence++;
+        recorder.append(path, header, data.data());
+      }));
+      recorder.close();
+
+      for (const auto& file : RecordingReader::listSegments(prefix))
+      {
+        unlink(file.c_str());
+      }
+    }
+  }
+
+  void run()
+  {
+    managedObjects();
+    serviceFilter();
+    writeMarshal();
+    readUnmarshal();
+    notificationDispatch(false);
+    notificationDispatch(true);
+    recorderAppend();
+  }
+};
+
+static void writeJson(std::ostream&                       out,
+                      const BenchmarkOptions&             options,
+                      const std::vector<BenchmarkResult>& results)
+{
+  out << "{\n"
+      << "  \"suite\": \"bscm-benchmark\",\n"
+      << "  \"format\": 1,\n"
+      << "  \"build\": \"" << BUILD_FLAVOR << "\",\n"
+      << "  \"min_time_ms\": " << static_cast<int>(options.minSeconds * 1000)
+      << ",\n"
+      << "  \"results\": [";
+
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BenchmarkResult& result = results[i];
+    double                 opsPerSec = 1e9 / result.nsPerOp;
+
+    out << (i ? "," : "") << "\n    {\"name\": \"" << result.name
+        << "\", \"size\": " << result.size << ", \"items\": " << result.items
+        << ", \"iterations\": " << result.iterations << std::fixed
+        << std::setprecision(2) << ", \"ns_per_op\": " << result.nsPerOp
+        << ", \"ns_per_item\": "
+        << result.nsPerOp / static_cast<double>(result.items)
+        << ", \"ops_per_sec\": " << opsPerSec << "}";
+  }
+
+  out << "\n  ]\n}" << std::endl;
+}
+
+static void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options]" << std::endl
+            << "  --min-time MS    Minimum run time per measurement "
+               "(default 200)"
+            << std::endl
+            << "  --filter TEXT    Only run benchmarks whose name contains "
+               "TEXT"
+            << std::endl
+            << "  --output FILE    Write JSON results to FILE instead of "
+               "stdout"
+            << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  BenchmarkOptions options;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--min-time" && i + 1 < argc)
+    {
+      options.minSeconds = std::stod(argv[++i]) / 1000.0;
+    }
+    else if (arg == "--filter" && i + 1 < argc)
+    {
+      options.filter = argv[++i];
+    }
+    else if (arg == "--output" && i + 1 < argc)
+    {
+      options.output = argv[++i];
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (std::string(BUILD_FLAVOR) != "release")
+  {
+    std::cerr << "Warning: not a release build, configure with "
+                 "-DCMAKE_BUILD_TYPE=Release for comparable numbers"
+              << std::endl;
+  }
+
+  // The manager logs to stdout, which must carry nothing but the JSON
+  std::streambuf* console = std::cout.rdbuf(std::cerr.rdbuf());
+
+  std::vector<BenchmarkResult> results;
+  BluetoothManagerBenchmark    benchmark{options, results};
+  benchmark.run();
+
+  std::cout.rdbuf(console);
+
+  if (options.output.empty())
+  {
+    writeJson(std::cout, options, results);
+    return 0;
+  }
+
+  std::ofstream file(options.output);
+  if (!file)
+  {
+    std::cerr << "Cannot write " << options.output << std::endl;
+    return 1;
+  }
+  writeJson(file, options, results);
+  return 0;
+}
\ No newline at end of file
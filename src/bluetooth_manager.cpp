@@ -1,9 +1,20 @@
 #include "bluetooth_manager.h"
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <thread>
+#include <unistd.h>
 
 const std::string BLUEZ_SERVICE          = "org.bluez";
 const std::string ADAPTER_INTERFACE_1    = "org.bluez.Adapter1";
@@ -15,38 +26,239 @@ const std::string PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
 const std::string OBJECT_MANAGER_INTERFACE =
   "org.freedesktop.DBus.ObjectManager";
 
+// Match rules only ever cover signals from BlueZ, and each one is narrowed
+// to what some current operation needs
+static std::string propertiesChangedRule(const std::string& interface,
+                                         const std::string& path = "")
+{
+  std::string rule = "type='signal',sender='" + BLUEZ_SERVICE +
+                     "',interface='" + PROPERTIES_INTERFACE +
+                     "',member='PropertiesChanged',arg0='" + interface + "'";
+  if (!path.empty())
+    rule += ",path='" + path + "'";
+  return rule;
+}
+
+// ObjectManager signals carry the object path as arg0, so arg0path selects
+// a subtree. Without one every InterfacesAdded/Removed matches.
+static std::string objectManagerRule(const std::string& arg0path = "")
+{
+  std::string rule = "type='signal',sender='" + BLUEZ_SERVICE +
+                     "',interface='" + OBJECT_MANAGER_INTERFACE + "'";
+  if (!arg0path.empty())
+    rule += ",arg0path='" + arg0path + "'";
+  return rule;
+}
+
+// A watched device: its own property updates, its removal, and the GATT
+// objects BlueZ exports below it once connected
+static std::vector<std::string> deviceRules(const std::string& devicePath)
+{
+  return {propertiesChangedRule(DEVICE_INTERFACE_1, devicePath),
+          objectManagerRule(devicePath),
+          objectManagerRule(devicePath + "/")};
+}
+
+// ATT opcode and handle that precede a value in a write command
+const size_t ATT_WRITE_HEADER_SIZE = 3;
+// Smallest ATT MTU a LE link can have; anything less is a broken reply
+const uint16_t ATT_MIN_MTU = 23;
+// How long a streaming write waits for a full socket to drain before failing
+const int STREAM_WRITE_TIMEOUT_MS = 5000;
+// Packets handed to the kernel per sendmmsg call when streaming writes
+const size_t WRITE_BATCH_SIZE = 64;
+
+// Replaces values with the strings of an "as" value
+static void readStringArray(DBusMessageIter*          iter,
+                            std::vector<std::string>& values)
+{
+  values.clear();
+  dbus_decode::forEach<std::string_view>(
+    iter, [&](std::string_view value) { values.emplace_back(value); });
+}
+
+// Replaces values with the UUIDs of an "as" value, skipping invalid ones
+static void readUuidArray(DBusMessageIter*            iter,
+                          std::vector<BluetoothUuid>& values)
+{
+  values.clear();
+  dbus_decode::forEach<std::string_view>(iter, [&](std::string_view text) {
+    BluetoothUuid uuid;
+    if (BluetoothUuid::parse(text, uuid))
+    {
+      values.push_back(uuid);
+    }
+  });
+}
+
+// Copies a string or object path into value if the type matches
+static void readString(DBusMessageIter* iter, std::string& value)
+{
+  std::string_view view;
+  if (dbus_decode::read(iter, view))
+  {
+    value.assign(view);
+  }
+}
+
+// Applies the properties present in an org.bluez.Device1 a{sv} dict
+static void applyDeviceProperties(DBusMessageIter* props_iter,
+                                  BluetoothDevice& device)
+{
+  dbus_decode::forEachProperty(
+    props_iter, [&](std::string_view property, DBusMessageIter* value_iter) {
+      if (property == "Address")
+      {
+        readString(value_iter, device.address);
+      }
+      else if (property == "Name")
+      {
+        readString(value_iter, device.name);
+      }
+      else if (property == "Connected")
+      {
+        dbus_decode::read(value_iter, device.connected);
+      }
+      else if (property == "ServicesResolved")
+      {
+        dbus_decode::read(value_iter, device.servicesResolved);
+      }
+      else if (property == "UUIDs")
+      {
+        readUuidArray(value_iter, device.services);
+      }
+    });
+}
+
+// Returns the object path one level up, e.g. a device's adapter
+static std::string_view parentPath(std::string_view path)
+{
+  size_t slash = path.rfind('/');
+  return slash == std::string_view::npos ? std::string_view()
+                                         : path.substr(0, slash);
+}
+
+// Applies the properties present in an org.bluez.Adapter1 a{sv} dict
+static void applyAdapterProperties(DBusMessageIter* props_iter,
+                                   std::string&     address,
+                                   bool&            discovering)
+{
+  dbus_decode::forEachProperty(
+    props_iter, [&](std::string_view property, DBusMessageIter* value_iter) {
+      if (property == "Address")
+      {
+        readString(value_iter, address);
+      }
+      else if (property == "Discovering")
+      {
+        dbus_decode::read(value_iter, discovering);
+      }
+    });
+}
+
+// Applies the properties present in an org.bluez.GattCharacteristic1 dict
+static void applyCharacteristicProperties(
+  DBusMessageIter*         props_iter,
+  BluetoothCharacteristic& characteristic)
+{
+  dbus_decode::forEachProperty(
+    props_iter, [&](std::string_view property, DBusMessageIter* value_iter) {
+      std::string_view text;
+      if (property == "UUID" && dbus_decode::read(value_iter, text))
+      {
+        characteristic.uuid = BluetoothUuid::fromString(text);
+      }
+      else if (property == "Service")
+      {
+        readString(value_iter, characteristic.service_path);
+      }
+      else if (property == "Flags")
+      {
+        readStringArray(value_iter, characteristic.flags);
+      }
+    });
+}
+
 BluetoothManager::BluetoothManager()
 {
 }
 
 BluetoothManager::~BluetoothManager()
 {
-  stopDiscovery();
+  // Hand the connection back to this thread before tearing anything down
+  eventLoop_.stop();
+
+  if (discoveryWatched_)
+    stopDiscovery();
+
+  for (const auto& socketPair : notifySockets_)
+  {
+    close(socketPair.second.fd);
+  }
+  for (const auto& socketPair : writeSockets_)
+  {
+    close(socketPair.second.fd);
+  }
+
+  if (filterInstalled_)
+  {
+    dbus_.removeMessageFilter(&BluetoothManager::messageFilter, this);
+  }
 }
 
-bool BluetoothManager::initialize()
+bool BluetoothManager::initialize(const std::string& busAddress)
 {
-  if (!dbus_.connect())
+  if (!dbus_.connect(busAddress))
   {
     std::cerr << "Failed to connect to D-Bus" << std::endl;
     return false;
   }
 
+  // Only adapter state is watched all the time; device and GATT rules come
+  // and go with discovery, connections and notifications. The match and
+  // filter go in before the snapshot so no update is missed.
+  dbus_.addSignalMatch(propertiesChangedRule(ADAPTER_INTERFACE_1));
+
+  filterInstalled_ =
+    dbus_.addMessageFilter(&BluetoothManager::messageFilter, this);
+  if (!filterInstalled_)
+  {
+    std::cerr << "Failed to install D-Bus message filter" << std::endl;
+    return false;
+  }
+
+  if (!loadObjectTree())
+  {
+    std::cerr << "Failed to read the BlueZ object tree" << std::endl;
+    return false;
+  }
+
   if (!findAdapter())
   {
     std::cerr << "No Bluetooth adapter found" << std::endl;
     return false;
   }
 
-  // Add signal match for property changes and interface additions
-  dbus_.addSignalMatch("type='signal',sender='org.bluez'");
+  // Links that were already up before we started are ours to track too
+  for (const auto& device : getAllDevices())
+  {
+    if (device.connected)
+      watchDevice(device.path);
+  }
 
-  std::cout << "Bluetooth manager initialized with adapter: " << adapterPath_
-            << std::endl;
+  if (!eventLoop_.start(dbus_.getConnection()))
+  {
+    std::cerr << "Failed to start D-Bus event loop, messages will only be "
+                 "processed when polled"
+              << std::endl;
+  }
+
+  std::cout << "Bluetooth manager initialized with " << adapters_.size()
+            << " adapter(s), default: " << adapterPath_ << std::endl;
   return true;
 }
 
-bool BluetoothManager::findAdapter()
+bool BluetoothManager::loadObjectTree()
 {
   DBusMessage* reply = dbus_.callMethod(
     BLUEZ_SERVICE, "/", OBJECT_MANAGER_INTERFACE, "GetManagedObjects");
@@ -56,505 +268,1794 @@ bool BluetoothManager::findAdapter()
     return false;
   }
 
-  DBusMessageIter iter, dict_iter;
+  bool loaded = applyManagedObjects(reply);
+  dbus_message_unref(reply);
+  return loaded;
+}
+
+bool BluetoothManager::applyManagedObjects(DBusMessage* reply)
+{
+  DBusMessageIter iter;
   if (!dbus_message_iter_init(reply, &iter) ||
       dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
   {
-    dbus_message_unref(reply);
     return false;
   }
 
-  dbus_message_iter_recurse(&iter, &dict_iter);
+  std::lock_guard<std::mutex> lock(stateMutex_);
 
-  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY)
+  // Handles stay interned while the contents are rebuilt; the ones no
+  // object claimed again are released afterwards
+  adapters_.clear();
+  for (auto& entry : devices_)
   {
-    DBusMessageIter entry_iter, interfaces_iter;
-    const char*     path;
-
-    dbus_message_iter_recurse(&dict_iter, &entry_iter);
-    dbus_message_iter_get_basic(&entry_iter, &path);
-    dbus_message_iter_next(&entry_iter);
-
-    if (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_ARRAY)
-    {
-      dbus_message_iter_recurse(&entry_iter, &interfaces_iter);
-
-      while (dbus_message_iter_get_arg_type(&interfaces_iter) ==
-             DBUS_TYPE_DICT_ENTRY)
-      {
-        DBusMessageIter iface_entry_iter;
-        const char*     interface;
-
-        dbus_message_iter_recurse(&interfaces_iter, &iface_entry_iter);
-        dbus_message_iter_get_basic(&iface_entry_iter, &interface);
-
-        if (std::string(interface) == "org.bluez.Adapter1")
-        {
-          adapterPath_ = std::string(path);
-          dbus_message_unref(reply);
-          return true;
-        }
+    entry.present = false;
+  }
+  for (auto& entry : characteristics_)
+  {
+    entry.present = false;
+  }
 
-        dbus_message_iter_next(&interfaces_iter);
-      }
-    }
+  dbus_decode::forEachManagedObject(&iter,
+                                    [this](std::string_view path,
+                                           std::string_view interface,
+                                           DBusMessageIter* props_iter) {
+                                      addInterface(path, interface, props_iter);
+                                    });
 
-    dbus_message_iter_next(&dict_iter);
+  for (uint32_t handle = 0; handle < devices_.size(); handle++)
+  {
+    releaseDevice(handle);
+  }
+  for (uint32_t handle = 0; handle < characteristics_.size(); handle++)
+  {
+    releaseCharacteristic(handle);
   }
 
-  dbus_message_unref(reply);
-  return false;
+  return true;
 }
 
-bool BluetoothManager::startDiscovery()
+bool BluetoothManager::findAdapter()
 {
-  if (adapterPath_.empty())
-    return false;
+  std::lock_guard<std::mutex> lock(stateMutex_);
 
-  DBusMessage* reply = dbus_.callMethod(
-    "org.bluez", adapterPath_, "org.bluez.Adapter1", "StartDiscovery");
-
-  if (reply)
-  {
-    dbus_message_unref(reply);
-    std::cout << "Started Bluetooth discovery" << std::endl;
-    return true;
-  }
+  if (adapters_.empty())
+    return false;
 
-  return false;
+  // Only used as a default for logging; everything else covers all adapters
+  adapterPath_ = adapters_.begin()->first;
+  return true;
 }
 
-bool BluetoothManager::stopDiscovery()
+std::vector<BluetoothAdapter> BluetoothManager::getAdapters()
 {
-  if (adapterPath_.empty())
-    return false;
-
-  DBusMessage* reply = dbus_.callMethod(
-    "org.bluez", adapterPath_, "org.bluez.Adapter1", "StopDiscovery");
+  std::vector<BluetoothAdapter> adapters;
 
-  if (reply)
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  for (const auto& adapterPair : adapters_)
   {
-    dbus_message_unref(reply);
-    std::cout << "Stopped Bluetooth discovery" << std::endl;
-    return true;
+    BluetoothAdapter adapter;
+    adapter.path            = adapterPair.first;
+    adapter.address         = adapterPair.second.address;
+    adapter.discovering     = adapterPair.second.discovering;
+    adapter.deviceCount     = adapterPair.second.devices.size();
+    adapter.connectionCount = adapterLoad(adapterPair.second);
+    adapters.push_back(adapter);
   }
 
-  return false;
+  return adapters;
 }
 
-void BluetoothManager::scanForDevices(int timeoutSeconds)
+// Builds the a{sv} argument of Adapter1.SetDiscoveryFilter. A disabled
+// filter is sent as an empty dict, which resets BlueZ to its defaults.
+static void appendDiscoveryFilter(DBusMessage*                    msg,
+                                  const DiscoveryFilter&          filter,
+                                  const std::vector<std::string>& uuids)
 {
-  std::cout << "Scanning for devices for " << timeoutSeconds << " seconds..."
-            << std::endl;
-
-  auto startTime = std::chrono::steady_clock::now();
-  auto endTime   = startTime + std::chrono::seconds(timeoutSeconds);
+  DBusMessageIter iter, dict_iter;
+  dbus_message_iter_init_append(msg, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict_iter);
 
-  while (std::chrono::steady_clock::now() < endTime)
+  if (filter.enabled)
   {
-    dbus_.processMessages(1000);
-    discoverDevices();
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    if (!uuids.empty())
+    {
+      DBusHelper::appendDictEntry(&dict_iter, "UUIDs", uuids);
+    }
+    if (filter.rssi != 0)
+    {
+      dbus_int16_t rssi = filter.rssi;
+      DBusHelper::appendDictEntry(&dict_iter, "RSSI", DBUS_TYPE_INT16, &rssi);
+    }
+    if (filter.pathloss != 0)
+    {
+      dbus_uint16_t pathloss = filter.pathloss;
+      DBusHelper::appendDictEntry(
+        &dict_iter, "Pathloss", DBUS_TYPE_UINT16, &pathloss);
+    }
+    if (!filter.transport.empty())
+    {
+      const char* transport = filter.transport.c_str();
+      DBusHelper::appendDictEntry(
+        &dict_iter, "Transport", DBUS_TYPE_STRING, &transport);
+    }
+
+    dbus_bool_t duplicateData = filter.duplicateData;
+    DBusHelper::appendDictEntry(
+      &dict_iter, "DuplicateData", DBUS_TYPE_BOOLEAN, &duplicateData);
   }
 
-  std::cout << "Scan complete. Found " << devices_.size() << " devices_."
-            << std::endl;
+  dbus_message_iter_close_container(&iter, &dict_iter);
 }
 
-void BluetoothManager::discoverDevices()
+bool BluetoothManager::setDiscovery(const std::string& method)
 {
-  DBusMessage* reply = dbus_.callMethod("org.bluez",
-                                        "/",
-                                        "org.freedesktop.DBus.ObjectManager",
-                                        "GetManagedObjects");
-
-  if (!reply)
-    return;
-
-  DBusMessageIter iter, dict_iter;
-  if (!dbus_message_iter_init(reply, &iter) ||
-      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+  std::vector<std::string> paths;
   {
-    dbus_message_unref(reply);
-    return;
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    for (const auto& adapterPair : adapters_)
+    {
+      paths.push_back(adapterPair.first);
+    }
   }
 
-  dbus_message_iter_recurse(&iter, &dict_iter);
-
-  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY)
-  {
-    DBusMessageIter entry_iter, interfaces_iter;
-    const char*     path;
+  bool starting = method == "StartDiscovery";
 
-    dbus_message_iter_recurse(&dict_iter, &entry_iter);
-    dbus_message_iter_get_basic(&entry_iter, &path);
-    dbus_message_iter_next(&entry_iter);
+  // Subscribe before discovery starts so no early device is missed
+  if (starting)
+    watchDiscovery(true);
 
-    std::string pathStr(path);
-    // if (pathStr.find("/org/bluez/hci") != std::string::npos &&
-    //     pathStr.find("/dev_") != std::string::npos)
-    if (pathStr.find(adapterPath_) != std::string::npos &&
-        pathStr.find("/dev_") != std::string::npos)
+  // BlueZ handles our calls in order, so the filter can be queued right
+  // ahead of StartDiscovery without waiting for its reply
+  std::vector<DBusPendingReply> filterRequests;
+  if (starting)
+  {
+    std::vector<std::string> uuids;
+    if (discoveryFilter_.enabled && discoveryFilter_.serviceUuids)
     {
-      if (devices_.find(pathStr) == devices_.end())
+      for (const auto& uuid : desiredServices_)
       {
-        BluetoothDevice device;
-        device.path = pathStr;
-        parseDeviceProperties(pathStr, device);
-        devices_[pathStr] = device;
-        std::cout << __func__ << "() found device: " << device.name << ", "
-                  << device.address << ", " << device.path << std::endl;
+        uuids.push_back(uuid.toString());
       }
     }
 
-    dbus_message_iter_next(&dict_iter);
+    for (const auto& path : paths)
+    {
+      filterRequests.push_back(dbus_.callMethodWithArgsAsync(
+        BLUEZ_SERVICE,
+        path,
+        ADAPTER_INTERFACE_1,
+        "SetDiscoveryFilter",
+        [&](DBusMessage* msg) {
+          appendDiscoveryFilter(msg, discoveryFilter_, uuids);
+        }));
+    }
   }
 
-  dbus_message_unref(reply);
-}
-
-void BluetoothManager::parseDeviceProperties(const std::string& devicePath,
-                                             BluetoothDevice&   device)
-{
-  device.address = dbus_.getStringProperty(
-    "org.bluez", devicePath, "org.bluez.Device1", "Address");
-  device.name = dbus_.getStringProperty(
-    "org.bluez", devicePath, "org.bluez.Device1", "Name");
-  device.connected = dbus_.getBoolProperty(
-    "org.bluez", devicePath, "org.bluez.Device1", "Connected");
-
-  // Get UUIDs (services)
-  DBusMessage* reply =
-    dbus_.callMethodWithArgs("org.bluez",
-                             devicePath,
-                             "org.freedesktop.DBus.Properties",
-                             "Get",
-                             [](DBusMessage* msg) {
-                               const char* iface = "org.bluez.Device1";
-                               const char* prop  = "UUIDs";
-                               dbus_message_append_args(msg,
-                                                        DBUS_TYPE_STRING,
-                                                        &iface,
-                                                        DBUS_TYPE_STRING,
-                                                        &prop,
-                                                        DBUS_TYPE_INVALID);
-                             });
+  // Issue the call on every adapter before waiting for any reply
+  std::vector<DBusPendingReply> requests;
+  requests.reserve(paths.size());
+  for (const auto& path : paths)
+  {
+    requests.push_back(
+      dbus_.callMethodAsync(BLUEZ_SERVICE, path, ADAPTER_INTERFACE_1, method));
+  }
 
-  if (reply)
+  for (size_t i = 0; i < filterRequests.size(); i++)
   {
-    DBusMessageIter iter, variant_iter, array_iter;
-    if (dbus_message_iter_init(reply, &iter) &&
-        dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
+    DBusMessage* reply = filterRequests[i].wait();
+    if (!reply)
     {
-      dbus_message_iter_recurse(&iter, &variant_iter);
-      if (dbus_message_iter_get_arg_type(&variant_iter) == DBUS_TYPE_ARRAY)
-      {
-        dbus_message_iter_recurse(&variant_iter, &array_iter);
-
-        device.services.clear();
-        while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRING)
-        {
-          const char* uuid;
-          dbus_message_iter_get_basic(&array_iter, &uuid);
-          device.services.push_back(std::string(uuid));
-          dbus_message_iter_next(&array_iter);
-        }
-      }
+      std::cerr << "SetDiscoveryFilter failed on " << paths[i]
+                << ", discovery there is unfiltered" << std::endl;
+      continue;
     }
     dbus_message_unref(reply);
   }
+
+  bool anySucceeded = false;
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    DBusMessage* reply = requests[i].wait();
+    if (!reply)
+      continue;
+
+    dbus_message_unref(reply);
+    anySucceeded = true;
+
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    auto                        it = adapters_.find(paths[i]);
+    if (it != adapters_.end())
+      it->second.discovering = starting;
+  }
+
+  if (!starting || !anySucceeded)
+    watchDiscovery(false);
+
+  return anySucceeded;
 }
 
-void BluetoothManager::setDesiredServices(
-  const std::vector<std::string>& services)
+void BluetoothManager::watchDiscovery(bool enable)
 {
-  desiredServices_ = services;
-  std::cout << "Set desired services: ";
-  for (const auto& service : services)
+  if (enable == discoveryWatched_)
+    return;
+  discoveryWatched_ = enable;
+
+  // Discovery is the one time any device under any adapter is of interest
+  const std::string rules[] = {objectManagerRule(),
+                               propertiesChangedRule(DEVICE_INTERFACE_1)};
+  for (const auto& rule : rules)
   {
-    std::cout << service << " ";
+    if (enable)
+      dbus_.addSignalMatch(rule);
+    else
+      dbus_.removeSignalMatch(rule);
   }
-  std::cout << std::endl;
 }
 
-std::vector<BluetoothDevice> BluetoothManager::getDevicesWithDesiredServices()
+void BluetoothManager::watchDevice(const std::string& devicePath)
 {
-  std::vector<BluetoothDevice> filteredDevices;
-
-  for (const auto& devicePair : devices_)
   {
-    if (hasDesiredService(devicePair.second))
-    {
-      filteredDevices.push_back(devicePair.second);
-    }
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    if (!watchedDevices_.insert(devicePath).second)
+      return;
   }
 
-  return filteredDevices;
+  for (const auto& rule : deviceRules(devicePath))
+  {
+    dbus_.addSignalMatch(rule);
+  }
 }
 
-bool BluetoothManager::hasDesiredService(const BluetoothDevice& device)
+void BluetoothManager::unwatchDevice(const std::string& devicePath)
 {
-  if (desiredServices_.empty())
   {
-    return true;  // If no filter set, include all devices
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    if (watchedDevices_.erase(devicePath) == 0)
+      return;
   }
 
-  for (const auto& desiredService : desiredServices_)
+  for (const auto& rule : deviceRules(devicePath))
   {
-    for (const auto& deviceService : device.services)
-    {
-      if (deviceService.find(desiredService) != std::string::npos)
-      {
-        return true;
-      }
-    }
+    dbus_.removeSignalMatch(rule);
   }
-
-  return false;
 }
 
-bool BluetoothManager::connectToDevice(const std::string& devicePath)
+bool BluetoothManager::setDiscoveryFilter(const DiscoveryFilter& filter)
 {
-  std::cout << "Connecting to device: " << devicePath << std::endl;
+  if (filter.rssi != 0 && filter.pathloss != 0)
+  {
+    std::cerr << "Discovery filter cannot set both RSSI and pathloss"
+              << std::endl;
+    return false;
+  }
 
-  DBusMessage* reply =
-    dbus_.callMethod("org.bluez", devicePath, "org.bluez.Device1", "Connect");
+  discoveryFilter_ = filter;
+  return true;
+}
 
-  if (reply)
+bool BluetoothManager::startDiscovery()
+{
+  if (setDiscovery("StartDiscovery"))
   {
-    dbus_message_unref(reply);
-
-    // Wait a bit for connection to establish
-    for (int i = 0; i < 6; i++)
-    {
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-      bool connected = dbus_.getBoolProperty(
-        "org.bluez", devicePath, "org.bluez.Device1", "Connected");
-      if (connected)
-      {
-        std::cout << "Successfully connected to device" << std::endl;
-        devices_[devicePath].connected = true;
-        return true;
-      }
-    }
+    std::cout << "Started Bluetooth discovery" << std::endl;
+    return true;
   }
 
-  std::cerr << "Failed to connect to device" << std::endl;
   return false;
 }
 
-bool BluetoothManager::disconnectFromDevice(const std::string& devicePath)
+bool BluetoothManager::stopDiscovery()
 {
-  std::cout << "Disconnecting from device: " << devicePath << std::endl;
-
-  DBusMessage* reply = dbus_.callMethod(
-    "org.bluez", devicePath, "org.bluez.Device1", "Disconnect");
-
-  if (reply)
+  if (setDiscovery("StopDiscovery"))
   {
-    dbus_message_unref(reply);
-    devices_[devicePath].connected = false;
-    std::cout << "Disconnected from device" << std::endl;
+    std::cout << "Stopped Bluetooth discovery" << std::endl;
     return true;
   }
 
   return false;
 }
 
-std::vector<BluetoothCharacteristic> BluetoothManager::getCharacteristics(
-  const std::string& devicePath)
+void BluetoothManager::scanForDevices(int timeoutSeconds)
 {
-  std::vector<BluetoothCharacteristic> characteristics;
-
-  DBusMessage* reply = dbus_.callMethod("org.bluez",
-                                        "/",
-                                        "org.freedesktop.DBus.ObjectManager",
-                                        "GetManagedObjects");
+  std::cout << "Scanning for devices for " << timeoutSeconds << " seconds..."
+            << std::endl;
 
-  if (!reply)
-    return characteristics;
+  auto startTime = std::chrono::steady_clock::now();
+  auto endTime   = startTime + std::chrono::seconds(timeoutSeconds);
 
-  DBusMessageIter iter, dict_iter;
-  if (!dbus_message_iter_init(reply, &iter) ||
-      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+  // The object tree cache is kept current by InterfacesAdded and
+  // InterfacesRemoved, so scanning only has to dispatch signals. With the
+  // event loop running that happens on its thread and we just wait.
+  if (eventLoop_.isRunning())
+  {
+    std::this_thread::sleep_until(endTime);
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  while (now < endTime)
+  {
+    auto remaining =
+      std::chrono::duration_cast<std::chrono::milliseconds>(endTime - now);
+    dbus_.processMessages(
+      static_cast<int>(std::min<long long>(remaining.count(), 1000)));
+    now = std::chrono::steady_clock::now();
+  }
+
+  std::cout << "Scan complete. Found " << getAllDevices().size()
+            << " devices_." << std::endl;
+}
+
+BluetoothDevice* BluetoothManager::findDevice(std::string_view path)
+{
+  uint32_t handle = devicePaths_.find(path);
+  if (handle == ObjectPathTable::INVALID_HANDLE || !devices_[handle].present)
+    return nullptr;
+
+  return &devices_[handle].device;
+}
+
+BluetoothCharacteristic* BluetoothManager::findCharacteristic(
+  std::string_view path)
+{
+  uint32_t handle = characteristicPaths_.find(path);
+  if (handle == ObjectPathTable::INVALID_HANDLE ||
+      !characteristics_[handle].present)
+    return nullptr;
+
+  return &characteristics_[handle].characteristic;
+}
+
+uint32_t BluetoothManager::internDevice(std::string_view path)
+{
+  uint32_t handle = devicePaths_.intern(path);
+  if (handle >= devices_.size())
+  {
+    devices_.resize(handle + 1);
+  }
+  return handle;
+}
+
+uint32_t BluetoothManager::internCharacteristic(std::string_view path)
+{
+  uint32_t handle = characteristicPaths_.intern(path);
+  if (handle >= characteristics_.size())
+  {
+    characteristics_.resize(handle + 1);
+  }
+  return handle;
+}
+
+// Handles that leave the manager, as notification handles or through
+// internCharacteristicPath(), may be held by callers indefinitely, so they
+// are never released
+uint32_t BluetoothManager::exportCharacteristic(std::string_view path)
+{
+  uint32_t handle                   = internCharacteristic(path);
+  characteristics_[handle].exported = true;
+  return handle;
+}
+
+// Recycle the handle of an object BlueZ no longer has, so a long-running
+// process seeing endless new device addresses does not grow without bound
+void BluetoothManager::releaseDevice(uint32_t handle)
+{
+  if (handle >= devices_.size() || devices_[handle].present)
+    return;
+
+  devices_[handle] = DeviceEntry();
+  devicePaths_.release(handle);
+}
+
+void BluetoothManager::releaseCharacteristic(uint32_t handle)
+{
+  if (handle >= characteristics_.size())
+    return;
+
+  const CharacteristicEntry& entry = characteristics_[handle];
+  if (entry.present || entry.notifying || entry.exported)
+    return;
+
+  characteristics_[handle] = CharacteristicEntry();
+  characteristicPaths_.release(handle);
+}
+
+bool BluetoothManager::addInterface(std::string_view path,
+                                    std::string_view interface,
+                                    DBusMessageIter* props_iter)
+{
+  if (interface == ADAPTER_INTERFACE_1)
+  {
+    auto it = adapters_.find(path);
+    if (it == adapters_.end())
+    {
+      it = adapters_.emplace(std::string(path), AdapterState()).first;
+
+      // GetManagedObjects is unordered, so devices may already be known
+      std::string prefix(path);
+      prefix += '/';
+      for (uint32_t handle : devicePaths_.findPrefix(prefix))
+      {
+        if (devices_[handle].present)
+          it->second.devices.insert(handle);
+      }
+    }
+    applyAdapterProperties(
+      props_iter, it->second.address, it->second.discovering);
+  }
+  else if (interface == DEVICE_INTERFACE_1)
+  {
+    uint32_t     handle = internDevice(path);
+    DeviceEntry& entry  = devices_[handle];
+    if (!entry.present)
+    {
+      entry.device         = BluetoothDevice();
+      entry.device.path    = std::string(path);
+      entry.device.adapter = std::string(parentPath(path));
+      entry.present        = true;
+
+      auto adapterIt = adapters_.find(entry.device.adapter);
+      if (adapterIt != adapters_.end())
+        adapterIt->second.devices.insert(handle);
+    }
+    applyDeviceProperties(props_iter, entry.device);
+  }
+  else if (interface == GATT_CHARACTERISTIC_INTERFACE)
+  {
+    CharacteristicEntry& entry = characteristics_[internCharacteristic(path)];
+    if (!entry.present)
+    {
+      entry.characteristic      = BluetoothCharacteristic();
+      entry.characteristic.path = std::string(path);
+      entry.present             = true;
+    }
+    applyCharacteristicProperties(props_iter, entry.characteristic);
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+bool BluetoothManager::handleInterfacesAdded(DBusMessage* message)
+{
+  DBusMessageIter         iter;
+  dbus_decode::ObjectPath path;
+
+  if (!dbus_message_iter_init(message, &iter) ||
+      !dbus_decode::readArgs(&iter, path))
+    return false;
+
+  std::lock_guard<std::mutex> lock(stateMutex_);
+
+  bool known   = findDevice(path.value) != nullptr;
+  bool tracked = false;
+
+  dbus_decode::forEachInterface(
+    &iter, [&](std::string_view interface, DBusMessageIter* props_iter) {
+      tracked |= addInterface(path.value, interface, props_iter);
+    });
+
+  BluetoothDevice* device = findDevice(path.value);
+  if (!known && device)
+  {
+    std::cout << __func__ << "() found device: " << device->name << ", "
+              << device->address << ", " << device->path << std::endl;
+  }
+
+  return tracked;
+}
+
+bool BluetoothManager::handleInterfacesRemoved(DBusMessage* message)
+{
+  DBusMessageIter         iter;
+  dbus_decode::ObjectPath path;
+
+  if (!dbus_message_iter_init(message, &iter) ||
+      !dbus_decode::readArgs(&iter, path))
+    return false;
+
+  bool tracked       = false;
+  bool deviceRemoved = false;
+  bool stopWatching  = false;  // A StartNotify characteristic went away
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+
+    dbus_decode::forEach<std::string_view>(
+      &iter, [&](std::string_view interface) {
+        if (interface == ADAPTER_INTERFACE_1)
+        {
+          auto it = adapters_.find(path.value);
+          if (it != adapters_.end())
+          {
+            adapters_.erase(it);
+            tracked = true;
+          }
+        }
+        else if (interface == DEVICE_INTERFACE_1)
+        {
+          uint32_t handle = devicePaths_.find(path.value);
+          if (handle != ObjectPathTable::INVALID_HANDLE &&
+              devices_[handle].present)
+          {
+            const BluetoothDevice& device = devices_[handle].device;
+            std::cout << "handleInterfacesRemoved() lost device: "
+                      << device.name << ", " << device.address << ", "
+                      << device.path << std::endl;
+            devices_[handle].present = false;
+
+            auto adapterIt = adapters_.find(device.adapter);
+            if (adapterIt != adapters_.end())
+              adapterIt->second.devices.erase(handle);
+            releaseDevice(handle);
+            tracked = true;
+          }
+
+          auto stateIt = connectionStates_.find(path.value);
+          if (stateIt != connectionStates_.end())
+            connectionStates_.erase(stateIt);
+          deviceRemoved = true;
+        }
+        else if (interface == GATT_CHARACTERISTIC_INTERFACE)
+        {
+          uint32_t handle = characteristicPaths_.find(path.value);
+          if (handle != ObjectPathTable::INVALID_HANDLE)
+          {
+            CharacteristicEntry& entry = characteristics_[handle];
+            if (entry.notifying &&
+                notifySockets_.count(characteristicPaths_.path(handle)) == 0)
+            {
+              entry.notifying = false;
+              stopWatching    = true;
+            }
+            entry.present = false;
+            releaseCharacteristic(handle);
+            tracked = true;
+          }
+        }
+      });
+  }
+
+  // Rules are dropped outside the state lock, like every other bus call
+  if (deviceRemoved)
+  {
+    unwatchDevice(std::string(path.value));
+  }
+  if (stopWatching)
+  {
+    dbus_.removeSignalMatch(propertiesChangedRule(
+      GATT_CHARACTERISTIC_INTERFACE, std::string(path.value)));
+  }
+
+  return tracked;
+}
+
+bool BluetoothManager::handlePropertiesChanged(DBusMessage* message)
+{
+  const char* path = dbus_message_get_path(message);
+  if (!path)
+    return false;
+
+  DBusMessageIter  iter;
+  std::string_view interface;
+
+  // iter is left on the changed a{sv} dict
+  if (!dbus_message_iter_init(message, &iter) ||
+      !dbus_decode::readArgs(&iter, interface) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+    return false;
+
+  // Interned paths never move, so this stays valid once the lock is dropped
+  const std::string* notifyPath   = nullptr;
+  uint32_t           handle       = 0;
+  bool               tracked      = false;
+  bool               stateChanged = false;
+  bool               linkLost     = false;
+  ConnectionState    state        = ConnectionState::Disconnected;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+
+    if (interface == ADAPTER_INTERFACE_1)
+    {
+      auto it = adapters_.find(path);
+      if (it != adapters_.end())
+      {
+        applyAdapterProperties(
+          &iter, it->second.address, it->second.discovering);
+        tracked = true;
+      }
+    }
+    else if (interface == DEVICE_INTERFACE_1)
+    {
+      BluetoothDevice* device = findDevice(path);
+      if (device)
+      {
+        bool wasConnected = device->connected;
+        applyDeviceProperties(&iter, *device);
+        tracked      = true;
+        stateChanged = updateConnectionState(*device, state);
+        linkLost     = wasConnected && !device->connected;
+      }
+    }
+    else if (interface == GATT_CHARACTERISTIC_INTERFACE)
+    {
+      // One hash lookup resolves the path; the rest is table access
+      handle = characteristicPaths_.find(path);
+      if (handle != ObjectPathTable::INVALID_HANDLE)
+      {
+        CharacteristicEntry& entry = characteristics_[handle];
+        if (entry.present)
+        {
+          applyCharacteristicProperties(&iter, entry.characteristic);
+          tracked = true;
+        }
+        if (entry.notifying)
+        {
+          notifyPath = &characteristicPaths_.path(handle);
+          tracked    = true;
+        }
+      }
+    }
+  }
+
+  // Delivery runs without the state lock so a callback may call back into us
+  if (stateChanged)
+  {
+    reportConnectionState(path, state);
+  }
+  if (linkLost)
+  {
+    // The remote end or the controller dropped the link
+    retireDevice(std::string(path));
+  }
+  if (notifyPath)
+  {
+    dispatchNotification(handle, *notifyPath, &iter);
+  }
+
+  return tracked;
+}
+
+void BluetoothManager::dispatchNotification(uint32_t           handle,
+                                            const std::string& path,
+                                            DBusMessageIter*   changed_iter)
+{
+  dbus_decode::forEachProperty(
+    changed_iter, [&](std::string_view property, DBusMessageIter* value_iter) {
+      dbus_decode::ByteView value;
+      if (property != "Value" || !dbus_decode::read(value_iter, value))
+        return true;
+
+      deliverNotification(handle, path, value.data, value.size);
+      return false;
+    });
+}
+
+DBusHandlerResult BluetoothManager::messageFilter(DBusConnection* connection,
+                                                  DBusMessage*    message,
+                                                  void*           userData)
+{
+  (void)connection;
+  auto* self = static_cast<BluetoothManager*>(userData);
+
+  // Replies pass through here too; only signals are accounted for
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  bool tracked = false;
+  if (dbus_message_is_signal(
+        message, OBJECT_MANAGER_INTERFACE.c_str(), "InterfacesAdded"))
+  {
+    tracked = self->handleInterfacesAdded(message);
+  }
+  else if (dbus_message_is_signal(
+             message, OBJECT_MANAGER_INTERFACE.c_str(), "InterfacesRemoved"))
+  {
+    tracked = self->handleInterfacesRemoved(message);
+  }
+  else if (dbus_message_is_signal(
+             message, PROPERTIES_INTERFACE.c_str(), "PropertiesChanged"))
+  {
+    tracked = self->handlePropertiesChanged(message);
+  }
+
+  if (tracked)
+    self->signalsHandled_.fetch_add(1, std::memory_order_relaxed);
+  else
+    self->signalsIgnored_.fetch_add(1, std::memory_order_relaxed);
+
+  // Leave the message for any other filters or handlers on the connection
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+DBusPendingReply BluetoothManager::requestDeviceProperties(
+  const std::string& devicePath)
+{
+  return dbus_.callMethodWithArgsAsync(
+    "org.bluez",
+    devicePath,
+    "org.freedesktop.DBus.Properties",
+    "GetAll",
+    [](DBusMessage* msg) {
+      const char* iface = "org.bluez.Device1";
+      dbus_message_append_args(
+        msg, DBUS_TYPE_STRING, &iface, DBUS_TYPE_INVALID);
+    });
+}
+
+void BluetoothManager::parseDeviceProperties(const std::string& devicePath,
+                                             DBusPendingReply&  request)
+{
+  DBusMessage* reply = request.wait();
+  if (!reply)
+    return;
+
+  DBusMessageIter iter;
+  if (dbus_message_iter_init(reply, &iter))
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    BluetoothDevice*            device = findDevice(devicePath);
+    if (device)
+    {
+      applyDeviceProperties(&iter, *device);
+    }
+  }
+
+  dbus_message_unref(reply);
+}
+
+void BluetoothManager::setDesiredServices(
+  const std::vector<std::string>& services)
+{
+  desiredServices_.clear();
+
+  std::cout << "Set desired services: ";
+  for (const auto& service : services)
+  {
+    BluetoothUuid uuid;
+    if (BluetoothUuid::parse(service, uuid))
+    {
+      desiredServices_.insert(uuid);
+      std::cout << uuid << " ";
+    }
+    else
+    {
+      std::cerr << "(ignoring invalid UUID " << service << ") ";
+    }
+  }
+  std::cout << std::endl;
+}
+
+std::vector<BluetoothDevice> BluetoothManager::getDevicesWithDesiredServices()
+{
+  std::vector<BluetoothDevice> filteredDevices;
+
+  for (const auto& device : getAllDevices())
+  {
+    if (hasDesiredService(device))
+    {
+      filteredDevices.push_back(device);
+    }
+  }
+
+  return filteredDevices;
+}
+
+bool BluetoothManager::hasDesiredService(const BluetoothDevice& device)
+{
+  if (desiredServices_.empty())
+  {
+    return true;  // If no filter set, include all devices
+  }
+
+  // Devices advertise a handful of services, so probe the hashed filter set
+  // with each of them rather than the other way round
+  for (const auto& deviceService : device.services)
+  {
+    if (desiredServices_.count(deviceService))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool BluetoothManager::connectToDevice(const std::string& devicePath)
+{
+  std::cout << "Connecting to device: " << devicePath << std::endl;
+
+  if (beginConnect(devicePath) &&
+      waitForConnection(devicePath, connectTimeout_))
+  {
+    std::cout << "Successfully connected to device" << std::endl;
+    return true;
+  }
+
+  std::cerr << "Failed to connect to device" << std::endl;
+  return false;
+}
+
+std::vector<std::string> BluetoothManager::connectToDevices(
+  const std::vector<std::string>& devicePaths)
+{
+  std::vector<std::string> connected;
+
+  // Start every connect first so the controller works on them together
+  for (const auto& devicePath : devicePaths)
+  {
+    beginConnect(devicePath);
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + connectTimeout_;
+  for (const auto& devicePath : devicePaths)
+  {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+    if (waitForConnection(devicePath,
+                          std::max(remaining, std::chrono::milliseconds(0))))
+    {
+      connected.push_back(devicePath);
+    }
+  }
+
+  return connected;
+}
+
+size_t BluetoothManager::adapterLoad(const AdapterState& adapter)
+{
+  size_t load = 0;
+  for (uint32_t handle : adapter.devices)
+  {
+    const BluetoothDevice& device = devices_[handle].device;
+    if (device.connected)
+    {
+      load++;
+      continue;
+    }
+
+    // Count attempts still in progress so parallel connects spread out
+    auto stateIt = connectionStates_.find(device.path);
+    if (stateIt != connectionStates_.end() &&
+        stateIt->second == ConnectionState::Connecting)
+      load++;
+  }
+  return load;
+}
+
+std::string BluetoothManager::placeConnection(const std::string& address)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+
+  std::string bestPath;
+  size_t      bestLoad = SIZE_MAX;
+  for (const auto& adapterPair : adapters_)
+  {
+    for (uint32_t handle : adapterPair.second.devices)
+    {
+      const BluetoothDevice& device = devices_[handle].device;
+      if (strcasecmp(device.address.c_str(), address.c_str()) != 0)
+        continue;
+
+      // Keep an existing link where it is
+      if (device.connected)
+        return device.path;
+
+      size_t load = adapterLoad(adapterPair.second);
+      if (load < bestLoad)
+      {
+        bestLoad = load;
+        bestPath = device.path;
+      }
+      break;
+    }
+  }
+
+  return bestPath;
+}
+
+bool BluetoothManager::connectToAddress(const std::string& address)
+{
+  std::string devicePath = placeConnection(address);
+  if (devicePath.empty())
+  {
+    std::cerr << "No adapter has seen device " << address << std::endl;
+    return false;
+  }
+
+  return connectToDevice(devicePath);
+}
+
+bool BluetoothManager::beginConnect(const std::string& devicePath)
+{
+  // Subscribe first so the Connected update cannot slip past us
+  watchDevice(devicePath);
+
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+
+    // BlueZ raises no PropertiesChanged for a link that is already up
+    BluetoothDevice* device = findDevice(devicePath);
+    if (device && device->connected && device->servicesResolved)
+    {
+      connectionStates_[devicePath] = ConnectionState::ServicesResolved;
+      return true;
+    }
+
+    connectionStates_[devicePath] = ConnectionState::Connecting;
+  }
+
+  // Progress is driven by Connected/ServicesResolved PropertiesChanged
+  // signals; the method reply only tells us whether the attempt failed
+  bool sent = dbus_.callMethodWithReplyHandler(
+    "org.bluez",
+    devicePath,
+    "org.bluez.Device1",
+    "Connect",
+    nullptr,
+    [this, devicePath](DBusMessage* reply) {
+      handleConnectReply(devicePath, reply != nullptr);
+    });
+
+  if (!sent)
+  {
+    handleConnectReply(devicePath, false);
+  }
+
+  return sent;
+}
+
+void BluetoothManager::handleConnectReply(const std::string& devicePath,
+                                          bool               succeeded)
+{
+  ConnectionState state;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+
+    auto stateIt = connectionStates_.find(devicePath);
+    if (stateIt == connectionStates_.end() ||
+        stateIt->second != ConnectionState::Connecting)
+      return;
+
+    if (!succeeded)
+    {
+      stateIt->second = ConnectionState::Failed;
+    }
+    else
+    {
+      // Connect only returns once the link is up, even if the Connected
+      // update has not been dispatched yet
+      BluetoothDevice* device = findDevice(devicePath);
+      if (!device)
+      {
+        stateIt->second = ConnectionState::Connected;
+      }
+      else
+      {
+        device->connected = true;
+        updateConnectionState(*device, state);
+      }
+    }
+    state = stateIt->second;
+  }
+
+  if (state == ConnectionState::Failed)
+  {
+    unwatchDevice(devicePath);
+  }
+
+  reportConnectionState(devicePath, state);
+}
+
+bool BluetoothManager::waitForConnection(const std::string&        devicePath,
+                                         std::chrono::milliseconds timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  std::unique_lock<std::mutex> lock(stateMutex_);
+  for (;;)
+  {
+    auto stateIt = connectionStates_.find(devicePath);
+    if (stateIt == connectionStates_.end())
+      return false;
+
+    if (stateIt->second == ConnectionState::ServicesResolved)
+      return true;
+    if (stateIt->second == ConnectionState::Failed ||
+        stateIt->second == ConnectionState::Disconnected)
+      return false;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+    {
+      stateIt->second = ConnectionState::Failed;
+      lock.unlock();
+      unwatchDevice(devicePath);
+      return false;
+    }
+
+    if (eventLoop_.isRunning())
+    {
+      connectionChanged_.wait_until(lock, deadline);
+    }
+    else
+    {
+      // Nobody else is dispatching, so pump the bus until something changes
+      auto remaining =
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+      lock.unlock();
+      dbus_.processMessages(
+        static_cast<int>(std::min<long long>(remaining.count(), 100)));
+      lock.lock();
+    }
+  }
+}
+
+ConnectionState BluetoothManager::getConnectionState(
+  const std::string& devicePath)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+
+  auto stateIt = connectionStates_.find(devicePath);
+  if (stateIt != connectionStates_.end())
+    return stateIt->second;
+
+  BluetoothDevice* device = findDevice(devicePath);
+  if (!device || !device->connected)
+    return ConnectionState::Disconnected;
+
+  return device->servicesResolved ? ConnectionState::ServicesResolved
+                                  : ConnectionState::Connected;
+}
+
+void BluetoothManager::setConnectTimeout(std::chrono::milliseconds timeout)
+{
+  connectTimeout_ = timeout;
+}
+
+void BluetoothManager::setConnectionCallback(ConnectionCallback callback)
+{
+  connectionCallback_ = callback;
+}
+
+bool BluetoothManager::updateConnectionState(const BluetoothDevice& device,
+                                             ConnectionState&       state)
+{
+  auto stateIt = connectionStates_.find(device.path);
+  if (stateIt == connectionStates_.end())
+    return false;
+
+  ConnectionState next = stateIt->second;
+  if (device.connected && device.servicesResolved)
+  {
+    next = ConnectionState::ServicesResolved;
+  }
+  else if (device.connected)
+  {
+    next = ConnectionState::Connected;
+  }
+  else if (stateIt->second == ConnectionState::Connected ||
+           stateIt->second == ConnectionState::ServicesResolved)
+  {
+    next = ConnectionState::Disconnected;
+  }
+
+  if (next == stateIt->second)
+    return false;
+
+  stateIt->second = next;
+  state           = next;
+  return true;
+}
+
+void BluetoothManager::reportConnectionState(const std::string& devicePath,
+                                             ConnectionState    state)
+{
+  connectionChanged_.notify_all();
+
+  if (connectionCallback_)
+  {
+    connectionCallback_(devicePath, state);
+  }
+}
+
+bool BluetoothManager::disconnectFromDevice(const std::string& devicePath)
+{
+  std::cout << "Disconnecting from device: " << devicePath << std::endl;
+
+  DBusMessage* reply = dbus_.callMethod(
+    "org.bluez", devicePath, "org.bluez.Device1", "Disconnect");
+
+  if (reply)
   {
     dbus_message_unref(reply);
-    return characteristics;
+    retireDevice(devicePath);
+    std::cout << "Disconnected from device" << std::endl;
+    return true;
+  }
+
+  return false;
+}
+
+// Stops listening for a device whose link is gone, whichever side dropped
+// it. BlueZ drops the GATT objects with the link, but the signals saying so
+// are covered by the rules removed here, so retire them now as well.
+void BluetoothManager::retireDevice(const std::string& devicePath)
+{
+  std::vector<std::string> unwatched;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    BluetoothDevice*            device = findDevice(devicePath);
+    if (device)
+    {
+      device->connected        = false;
+      device->servicesResolved = false;
+    }
+    connectionStates_.erase(devicePath);
+
+    for (uint32_t handle : characteristicPaths_.findPrefix(devicePath + "/"))
+    {
+      CharacteristicEntry& entry = characteristics_[handle];
+      const std::string&   path  = characteristicPaths_.path(handle);
+      if (entry.notifying && notifySockets_.count(path) == 0)
+      {
+        entry.notifying = false;
+        unwatched.push_back(path);
+      }
+      entry.present = false;
+      releaseCharacteristic(handle);
+    }
+  }
+
+  unwatchDevice(devicePath);
+  for (const auto& path : unwatched)
+  {
+    dbus_.removeSignalMatch(
+      propertiesChangedRule(GATT_CHARACTERISTIC_INTERFACE, path));
+  }
+}
+
+std::vector<BluetoothCharacteristic> BluetoothManager::getCharacteristics(
+  const std::string& devicePath)
+{
+  std::vector<BluetoothCharacteristic> characteristics;
+
+  // Characteristic paths nest below their device's path
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  for (uint32_t handle : characteristicPaths_.findPrefix(devicePath + "/"))
+  {
+    if (characteristics_[handle].present)
+    {
+      characteristics.push_back(characteristics_[handle].characteristic);
+    }
+  }
+
+  return characteristics;
+}
+
+bool BluetoothManager::enableNotifications(
+  const std::string& characteristicPath,
+  NotificationMode   mode)
+{
+  std::cout << "Enabling notifications for: " << characteristicPath
+            << std::endl;
+
+  // Only characteristics BlueZ has exported get a handle, so a made-up path
+  // cannot grow the tables
+  uint32_t handle;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    handle = characteristicPaths_.find(characteristicPath);
+    if (handle == ObjectPathTable::INVALID_HANDLE ||
+        !characteristics_[handle].present)
+    {
+      std::cerr << "Unknown characteristic: " << characteristicPath
+                << std::endl;
+      return false;
+    }
+    handle = exportCharacteristic(characteristicPath);
+  }
+  resetNotificationStream(handle);
+
+  if (mode == NotificationMode::AcquireNotify)
+  {
+    AcquiredSocket socket;
+    if (acquireSocket(characteristicPath, "AcquireNotify", socket))
+    {
+      {
+        std::lock_guard<std::mutex> lock(stateMutex_);
+        notifySockets_[characteristicPath] = socket;
+        characteristics_[handle].notifying = true;
+      }
+
+      // Read the socket on the event loop thread as soon as data arrives
+      if (eventLoop_.isRunning())
+      {
+        eventLoop_.addFd(
+          socket.fd, [this, characteristicPath, handle, socket]() {
+            drainNotifySocket(characteristicPath, handle, socket);
+          });
+      }
+
+      std::cout << "Notifications enabled on acquired socket (MTU "
+                << socket.mtu << ")" << std::endl;
+      return true;
+    }
+
+    std::cerr << "AcquireNotify failed, falling back to StartNotify"
+              << std::endl;
+  }
+
+  // Values arrive as PropertiesChanged on this one path; the rule has to be
+  // in place before StartNotify so the first value is not lost
+  bool notifying;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    notifying = characteristics_[handle].notifying;
+  }
+
+  std::string rule =
+    propertiesChangedRule(GATT_CHARACTERISTIC_INTERFACE, characteristicPath);
+  if (!notifying && !dbus_.addSignalMatch(rule))
+  {
+    std::cerr << "Failed to enable notifications" << std::endl;
+    return false;
+  }
+
+  DBusMessage* reply = dbus_.callMethod("org.bluez",
+                                        characteristicPath,
+                                        "org.bluez.GattCharacteristic1",
+                                        "StartNotify");
+
+  if (reply)
+  {
+    dbus_message_unref(reply);
+    {
+      std::lock_guard<std::mutex> lock(stateMutex_);
+      characteristics_[handle].notifying = true;
+    }
+    std::cout << "Notifications enabled" << std::endl;
+    return true;
+  }
+
+  if (!notifying)
+  {
+    dbus_.removeSignalMatch(rule);
+  }
+
+  std::cerr << "Failed to enable notifications" << std::endl;
+  return false;
+}
+
+bool BluetoothManager::disableNotifications(
+  const std::string& characteristicPath)
+{
+  std::cout << "Disabling notifications for: " << characteristicPath
+            << std::endl;
+
+  // Closing an acquired socket is what tells BlueZ to stop notifying
+  int notifyFd = -1;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    auto socketIt = notifySockets_.find(characteristicPath);
+    if (socketIt != notifySockets_.end())
+    {
+      notifyFd = socketIt->second.fd;
+      notifySockets_.erase(socketIt);
+      characteristics_[internCharacteristic(characteristicPath)].notifying =
+        false;
+    }
+  }
+
+  if (notifyFd >= 0)
+  {
+    eventLoop_.removeFd(notifyFd);
+    close(notifyFd);
+    std::cout << "Notifications disabled" << std::endl;
+    return true;
+  }
+
+  DBusMessage* reply = dbus_.callMethod("org.bluez",
+                                        characteristicPath,
+                                        "org.bluez.GattCharacteristic1",
+                                        "StopNotify");
+
+  if (reply)
+  {
+    dbus_message_unref(reply);
+
+    bool notifying;
+    {
+      std::lock_guard<std::mutex> lock(stateMutex_);
+      CharacteristicEntry&        entry =
+        characteristics_[internCharacteristic(characteristicPath)];
+      notifying       = entry.notifying;
+      entry.notifying = false;
+    }
+
+    if (notifying)
+    {
+      dbus_.removeSignalMatch(propertiesChangedRule(
+        GATT_CHARACTERISTIC_INTERFACE, characteristicPath));
+    }
+
+    std::cout << "Notifications disabled" << std::endl;
+    return true;
+  }
+
+  return false;
+}
+
+bool BluetoothManager::acquireSocket(const std::string& characteristicPath,
+                                     const std::string& method,
+                                     AcquiredSocket&    socket)
+{
+  DBusMessage* reply = dbus_.callMethodWithArgs(
+    "org.bluez",
+    characteristicPath,
+    "org.bluez.GattCharacteristic1",
+    method,
+    [](DBusMessage* msg) {
+      DBusMessageIter iter, options_iter;
+      dbus_message_iter_init_append(msg, &iter);
+
+      // Append empty options dict
+      dbus_message_iter_open_container(
+        &iter, DBUS_TYPE_ARRAY, "{sv}", &options_iter);
+      dbus_message_iter_close_container(&iter, &options_iter);
+    });
+
+  if (!reply)
+    return false;
+
+  DBusError     error;
+  int           fd  = -1;
+  dbus_uint16_t mtu = 0;
+  dbus_error_init(&error);
+
+  bool ok = dbus_message_get_args(reply,
+                                  &error,
+                                  DBUS_TYPE_UNIX_FD,
+                                  &fd,
+                                  DBUS_TYPE_UINT16,
+                                  &mtu,
+                                  DBUS_TYPE_INVALID);
+  dbus_message_unref(reply);
+
+  if (!ok)
+  {
+    std::cerr << method << " returned an unexpected reply: " << error.message
+              << std::endl;
+    dbus_error_free(&error);
+    return false;
+  }
+
+  if (mtu < ATT_MIN_MTU)
+  {
+    std::cerr << method << " returned an invalid MTU of " << mtu << std::endl;
+    close(fd);
+    return false;
+  }
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  socket.fd  = fd;
+  socket.mtu = mtu;
+  return true;
+}
+
+ssize_t BluetoothManager::readNotification(
+  const std::string& characteristicPath,
+  uint8_t*           buffer,
+  size_t             size)
+{
+  int fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    auto socketIt = notifySockets_.find(characteristicPath);
+    if (socketIt == notifySockets_.end())
+      return -1;
+    fd = socketIt->second.fd;
+  }
+
+  // The socket is SOCK_SEQPACKET, so every read returns one whole value
+  ssize_t length = read(fd, buffer, size);
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+
+  // End of file means BlueZ or the peer hung up
+  if (length <= 0)
+  {
+    closeNotifySocket(characteristicPath, fd);
+    return -1;
+  }
+
+  return length;
+}
+
+void BluetoothManager::drainNotifySocket(
+  const std::string&    characteristicPath,
+  uint32_t              handle,
+  const AcquiredSocket& socket)
+{
+  if (notifyBuffer_.size() < socket.mtu)
+  {
+    notifyBuffer_.resize(socket.mtu);
+  }
+
+  // Always drain, even with nobody listening, or the level-triggered event
+  // loop would keep waking up for the same data
+  ssize_t length;
+  while ((length = read(
+            socket.fd, notifyBuffer_.data(), notifyBuffer_.size())) > 0)
+  {
+    deliverNotification(
+      handle, characteristicPath, notifyBuffer_.data(), length);
+  }
+
+  // A hung up socket stays readable forever, so it has to go as well
+  bool pending = length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                                errno == EINTR);
+  if (!pending)
+  {
+    closeNotifySocket(characteristicPath, socket.fd);
+  }
+}
+
+// Drops an acquired notify socket the other end has closed. The fd is only
+// closed if it is still the one registered for the path, so a concurrent
+// disableNotifications() cannot have it closed twice.
+void BluetoothManager::closeNotifySocket(const std::string& characteristicPath,
+                                         int                fd)
+{
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    auto socketIt = notifySockets_.find(characteristicPath);
+    if (socketIt == notifySockets_.end() || socketIt->second.fd != fd)
+      return;
+
+    notifySockets_.erase(socketIt);
+    characteristics_[internCharacteristic(characteristicPath)].notifying =
+      false;
+  }
+
+  eventLoop_.removeFd(fd);
+  close(fd);
+  std::cerr << "Notification socket closed by remote for "
+            << characteristicPath << std::endl;
+}
+
+std::string BluetoothManager::getCharacteristicPath(uint32_t handle)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+
+  if (handle >= characteristicPaths_.size())
+    return "";
+
+  return characteristicPaths_.path(handle);
+}
+
+uint32_t BluetoothManager::findCharacteristicHandle(
+  const std::string& characteristicPath)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  return characteristicPaths_.find(characteristicPath);
+}
+
+bool BluetoothManager::isNotifying(uint32_t handle)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  return handle < characteristics_.size() && characteristics_[handle].notifying;
+}
+
+static uint64_t steadyNowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+// Reads a SequenceField's counter, if the payload is long enough to hold it
+static bool readSequenceField(const SequenceField& field,
+                              const uint8_t*       data,
+                              size_t               length,
+                              uint64_t&            value)
+{
+  if (field.offset + field.width > length)
+    return false;
+
+  value = 0;
+  for (size_t i = 0; i < field.width; i++)
+  {
+    size_t byte = field.bigEndian ? i : field.width - 1 - i;
+    value       = (value << 8) | data[field.offset + byte];
+  }
+  return true;
+}
+
+void BluetoothManager::deliverNotification(uint32_t           handle,
+                                           const std::string& path,
+                                           const uint8_t*     data,
+                                           size_t             length)
+{
+  NotificationHeader header;
+  header.handle      = handle;
+  header.length      = static_cast<uint16_t>(std::min<size_t>(length, 0xFFFF));
+  header.timestampNs = steadyNowNs();
+  sequenceNotification(header, data);
+
+  if (notificationQueue_)
+  {
+    notificationQueue_->push(header, data);
+  }
+  else
+  {
+    invokeNotificationCallback(path, header, data);
+  }
+}
+
+void BluetoothManager::invokeNotificationCallback(
+  const std::string&        path,
+  const NotificationHeader& header,
+  const uint8_t*            data)
+{
+  std::lock_guard<std::mutex> lock(callbackMutex_);
+  if (recordCallback_)
+  {
+    recordCallback_(path, header, data);
+  }
+  else if (notificationCallback_)
+  {
+    notificationCallback_(path,
+                          std::vector<uint8_t>(data, data + header.length));
+  }
+}
+
+BluetoothManager::NotificationStream& BluetoothManager::notificationStream(
+  uint32_t handle)
+{
+  if (handle >= streams_.size())
+  {
+    streams_.resize(handle + 1);
+  }
+  return streams_[handle];
+}
+
+void BluetoothManager::sequenceNotification(NotificationHeader& header,
+                                            const uint8_t*      data)
+{
+  std::lock_guard<std::mutex> lock(streamMutex_);
+  NotificationStream&         stream = notificationStream(header.handle);
+  NotificationStats&          stats  = stream.stats;
+
+  header.sequence = ++stats.received;
+
+  if (stats.received > 1)
+  {
+    // Welford's running mean and variance of the inter-arrival time, and
+    // RFC 3550's 1/16 filter over how much each interval differs from the
+    // one before
+    uint64_t interval = header.timestampNs - stream.lastTimestampNs;
+    double   delta    = static_cast<double>(interval) - stream.intervalMean;
+    stream.intervalMean += delta / static_cast<double>(stats.received - 1);
+    stream.intervalM2 +=
+      delta * (static_cast<double>(interval) - stream.intervalMean);
+    stats.intervalMaxNs = std::max(stats.intervalMaxNs, interval);
+
+    if (stats.received > 2)
+    {
+      double change = std::abs(static_cast<double>(interval) -
+                               static_cast<double>(stream.lastIntervalNs));
+      stream.jitter += (change - stream.jitter) / 16;
+    }
+    stream.lastIntervalNs = interval;
+  }
+  stream.lastTimestampNs = header.timestampNs;
+
+  if (!stream.hasField ||
+      !readSequenceField(stream.field, data, header.length, header.appSequence))
+    return;
+
+  header.hasAppSequence = true;
+  if (stats.sequenced++ > 0)
+  {
+    // Counters wrap at their width; a step of more than half the range is
+    // taken as going backwards
+    uint64_t mask = stream.field.width == 8
+                      ? ~uint64_t(0)
+                      : (uint64_t(1) << (stream.field.width * 8)) - 1;
+    uint64_t step = (header.appSequence - stream.lastAppSequence) & mask;
+
+    if (step == 0 || step > mask / 2)
+    {
+      stats.reordered++;
+      return;
+    }
+    if (step > 1)
+    {
+      stats.gaps++;
+      stats.missing += step - 1;
+    }
+  }
+  stream.lastAppSequence = header.appSequence;
+}
+
+void BluetoothManager::resetNotificationStream(uint32_t handle)
+{
+  std::lock_guard<std::mutex> lock(streamMutex_);
+  NotificationStream&         stream = notificationStream(handle);
+
+  // The sequence field is configuration and survives the reset
+  NotificationStream fresh;
+  fresh.hasField = stream.hasField;
+  fresh.field    = stream.field;
+  stream         = fresh;
+}
+
+bool BluetoothManager::setSequenceField(const std::string&   characteristicPath,
+                                        const SequenceField& field)
+{
+  if (field.width != 1 && field.width != 2 && field.width != 4 &&
+      field.width != 8)
+  {
+    std::cerr << "Sequence field width must be 1, 2, 4 or 8 bytes"
+              << std::endl;
+    return false;
   }
 
-  dbus_message_iter_recurse(&iter, &dict_iter);
+  uint32_t handle;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    handle = exportCharacteristic(characteristicPath);
+  }
+
+  std::lock_guard<std::mutex> lock(streamMutex_);
+  NotificationStream&         stream = notificationStream(handle);
+  stream.hasField                    = true;
+  stream.field                       = field;
+  stream.stats.sequenced             = 0;
+  return true;
+}
 
-  while (dbus_message_iter_get_arg_type(&dict_iter) == DBUS_TYPE_DICT_ENTRY)
+void BluetoothManager::clearSequenceField(
+  const std::string& characteristicPath)
+{
+  uint32_t handle;
   {
-    DBusMessageIter entry_iter, interfaces_iter;
-    const char*     path;
-
-    dbus_message_iter_recurse(&dict_iter, &entry_iter);
-    dbus_message_iter_get_basic(&entry_iter, &path);
-    dbus_message_iter_next(&entry_iter);
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    handle = exportCharacteristic(characteristicPath);
+  }
 
-    std::string pathStr(path);
-    if (pathStr.find(devicePath) == 0 &&
-        pathStr.find("/char") != std::string::npos)
-    {
-      if (dbus_message_iter_get_arg_type(&entry_iter) == DBUS_TYPE_ARRAY)
-      {
-        dbus_message_iter_recurse(&entry_iter, &interfaces_iter);
+  std::lock_guard<std::mutex> lock(streamMutex_);
+  notificationStream(handle).hasField = false;
+}
 
-        while (dbus_message_iter_get_arg_type(&interfaces_iter) ==
-               DBUS_TYPE_DICT_ENTRY)
-        {
-          DBusMessageIter iface_entry_iter;
-          const char*     interface;
+NotificationStats BluetoothManager::getNotificationStats(
+  const std::string& characteristicPath)
+{
+  uint32_t handle;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    handle = characteristicPaths_.find(characteristicPath);
+  }
 
-          dbus_message_iter_recurse(&interfaces_iter, &iface_entry_iter);
-          dbus_message_iter_get_basic(&iface_entry_iter, &interface);
+  std::lock_guard<std::mutex> lock(streamMutex_);
+  if (handle == ObjectPathTable::INVALID_HANDLE || handle >= streams_.size())
+    return NotificationStats();
 
-          if (std::string(interface) == "org.bluez.GattCharacteristic1")
-          {
-            BluetoothCharacteristic characteristic;
-            characteristic.path = pathStr;
-            parseCharacteristicProperties(pathStr, characteristic);
-            characteristics.push_back(characteristic);
-            break;
-          }
+  const NotificationStream& stream = streams_[handle];
+  NotificationStats         stats  = stream.stats;
+  stats.intervalMeanNs = static_cast<uint64_t>(stream.intervalMean);
+  stats.jitterNs       = static_cast<uint64_t>(stream.jitter);
+  if (stats.received > 2)
+  {
+    stats.intervalStddevNs = static_cast<uint64_t>(std::sqrt(
+      stream.intervalM2 / static_cast<double>(stats.received - 2)));
+  }
+  return stats;
+}
 
-          dbus_message_iter_next(&interfaces_iter);
-        }
-      }
-    }
+const LatencyHistogram& BluetoothManager::getDeliveryLatency() const
+{
+  return deliveryLatency_;
+}
 
-    dbus_message_iter_next(&dict_iter);
-  }
+void BluetoothManager::enableNotificationQueue(size_t capacity)
+{
+  notificationQueue_.reset(new NotificationQueue(capacity));
+}
 
-  dbus_message_unref(reply);
-  return characteristics;
+NotificationQueue* BluetoothManager::getNotificationQueue()
+{
+  return notificationQueue_.get();
 }
 
-void BluetoothManager::parseCharacteristicProperties(
-  const std::string&       charPath,
-  BluetoothCharacteristic& characteristic)
+void BluetoothManager::drainNotificationQueue(int timeoutMs)
 {
-  characteristic.uuid = dbus_.getStringProperty(
-    "org.bluez", charPath, "org.bluez.GattCharacteristic1", "UUID");
-  characteristic.service_path = dbus_.getStringProperty(
-    "org.bluez", charPath, "org.bluez.GattCharacteristic1", "Service");
+  NotificationRecord record;
 
-  // Get flags
-  DBusMessage* reply = dbus_.callMethodWithArgs(
-    "org.bluez",
-    charPath,
-    "org.freedesktop.DBus.Properties",
-    "Get",
-    [](DBusMessage* msg) {
-      const char* iface = "org.bluez.GattCharacteristic1";
-      const char* prop  = "Flags";
-      dbus_message_append_args(msg,
-                               DBUS_TYPE_STRING,
-                               &iface,
-                               DBUS_TYPE_STRING,
-                               &prop,
-                               DBUS_TYPE_INVALID);
-    });
+  if (!notificationQueue_->waitPop(record,
+                                   std::chrono::milliseconds(timeoutMs)))
+    return;
 
-  if (reply)
+  do
   {
-    DBusMessageIter iter, variant_iter, array_iter;
-    if (dbus_message_iter_init(reply, &iter) &&
-        dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
-    {
-      dbus_message_iter_recurse(&iter, &variant_iter);
-      if (dbus_message_iter_get_arg_type(&variant_iter) == DBUS_TYPE_ARRAY)
-      {
-        dbus_message_iter_recurse(&variant_iter, &array_iter);
-
-        characteristic.flags.clear();
-        while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_STRING)
-        {
-          const char* flag;
-          dbus_message_iter_get_basic(&array_iter, &flag);
-          characteristic.flags.push_back(std::string(flag));
-          dbus_message_iter_next(&array_iter);
-        }
-      }
-    }
-    dbus_message_unref(reply);
-  }
+    deliveryLatency_.record((steadyNowNs() - record.timestampNs) / 1000);
+    invokeNotificationCallback(queuedPath(record.handle), record, record.data);
+  } while (notificationQueue_->tryPop(record));
 }
 
-bool BluetoothManager::enableNotifications(
-  const std::string& characteristicPath)
+// Only the consumer draining the queue touches queuePaths_
+const std::string& BluetoothManager::queuedPath(uint32_t handle)
 {
-  std::cout << "Enabling notifications for: " << characteristicPath
-            << std::endl;
-
-  DBusMessage* reply = dbus_.callMethod("org.bluez",
-                                        characteristicPath,
-                                        "org.bluez.GattCharacteristic1",
-                                        "StartNotify");
+  if (handle >= queuePaths_.size())
+    queuePaths_.resize(handle + 1, nullptr);
 
-  if (reply)
+  const std::string*& path = queuePaths_[handle];
+  if (!path)
   {
-    dbus_message_unref(reply);
-    notifyingCharacteristics_.insert(characteristicPath);
-    std::cout << "Notifications enabled" << std::endl;
-    return true;
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    path = &characteristicPaths_.path(handle);
   }
-
-  std::cerr << "Failed to enable notifications" << std::endl;
-  return false;
+  return *path;
 }
 
-bool BluetoothManager::disableNotifications(
-  const std::string& characteristicPath)
+// WriteValue arguments: the value followed by an options dict carrying the
+// write type, so BlueZ does not fall back to its own default
+void BluetoothManager::appendWriteValueArgs(DBusMessage*   msg,
+                                            const uint8_t* data,
+                                            size_t         length,
+                                            WriteType      type)
 {
-  std::cout << "Disabling notifications for: " << characteristicPath
-            << std::endl;
+  DBusMessageIter iter, options_iter;
+  dbus_message_iter_init_append(msg, &iter);
 
-  DBusMessage* reply = dbus_.callMethod("org.bluez",
-                                        characteristicPath,
-                                        "org.bluez.GattCharacteristic1",
-                                        "StopNotify");
+  DBusHelper::appendByteArray(&iter, data, length);
 
-  if (reply)
+  dbus_message_iter_open_container(
+    &iter, DBUS_TYPE_ARRAY, "{sv}", &options_iter);
+  if (type != WriteType::Auto)
   {
-    dbus_message_unref(reply);
-    notifyingCharacteristics_.erase(characteristicPath);
-    std::cout << "Notifications disabled" << std::endl;
-    return true;
+    const char* value = type == WriteType::Command ? "command" : "request";
+    DBusHelper::appendDictEntry(
+      &options_iter, "type", DBUS_TYPE_STRING, &value);
   }
-
-  return false;
+  dbus_message_iter_close_container(&iter, &options_iter);
 }
 
 bool BluetoothManager::writeCharacteristic(
   const std::string&          characteristicPath,
-  const std::vector<uint8_t>& data)
+  const std::vector<uint8_t>& data,
+  WriteType                   type)
+{
+  return writeCharacteristic(
+    characteristicPath, data.data(), data.size(), type);
+}
+
+bool BluetoothManager::writeCharacteristic(
+  const std::string& characteristicPath,
+  const uint8_t*     data,
+  size_t             length,
+  WriteType          type)
 {
   std::cout << "Writing to characteristic: " << characteristicPath << std::endl;
 
+  type = resolveWriteType(characteristicPath, type);
+
   DBusMessage* reply = dbus_.callMethodWithArgs(
     "org.bluez",
     characteristicPath,
     "org.bluez.GattCharacteristic1",
     "WriteValue",
     [&](DBusMessage* msg) {
-      DBusMessageIter iter, array_iter, options_iter;
-      dbus_message_iter_init_append(msg, &iter);
-
-      // Append byte array
-      dbus_message_iter_open_container(
-        &iter, DBUS_TYPE_ARRAY, "y", &array_iter);
-      for (uint8_t byte : data)
-      {
-        dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_BYTE, &byte);
-      }
-      dbus_message_iter_close_container(&iter, &array_iter);
-
-      // Append empty options dict
-      dbus_message_iter_open_container(
-        &iter, DBUS_TYPE_ARRAY, "{sv}", &options_iter);
-      dbus_message_iter_close_container(&iter, &options_iter);
+      appendWriteValueArgs(msg, data, length, type);
     });
 
   if (reply)
@@ -568,11 +2069,151 @@ bool BluetoothManager::writeCharacteristic(
   return false;
 }
 
+bool BluetoothManager::writeCharacteristicBulk(
+  const std::string&                       characteristicPath,
+  const std::vector<std::vector<uint8_t>>& chunks,
+  WriteType                                type)
+{
+  // Per-batch counts live on the heap so a late reply can never touch a
+  // finished caller's stack
+  struct Batch
+  {
+    size_t   inFlight = 0;
+    uint64_t failed   = 0;
+  };
+  auto batch = std::make_shared<Batch>();
+
+  type = resolveWriteType(characteristicPath, type);
+
+  auto waitForBatch = [this, &batch](size_t maxInFlight) {
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    while (batch->inFlight > maxInFlight)
+    {
+      if (eventLoop_.isRunning())
+      {
+        writeCompleted_.wait(lock);
+      }
+      else
+      {
+        // Nobody else is dispatching, so pump the bus for the replies
+        lock.unlock();
+        dbus_.processMessages(100);
+        lock.lock();
+      }
+    }
+  };
+
+  for (const auto& chunk : chunks)
+  {
+    size_t window;
+    {
+      std::lock_guard<std::mutex> lock(writeMutex_);
+      window = writeWindow_;
+    }
+    waitForBatch(window - 1);
+
+    {
+      std::lock_guard<std::mutex> lock(writeMutex_);
+      batch->inFlight++;
+      writeStats_.sent++;
+    }
+
+    bool sent = dbus_.callMethodWithReplyHandler(
+      "org.bluez",
+      characteristicPath,
+      "org.bluez.GattCharacteristic1",
+      "WriteValue",
+      [&](DBusMessage* msg) {
+        appendWriteValueArgs(msg, chunk.data(), chunk.size(), type);
+      },
+      [this, batch](DBusMessage* reply) {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        batch->inFlight--;
+        writeStats_.completed++;
+        if (!reply)
+        {
+          batch->failed++;
+          writeStats_.failed++;
+        }
+        writeCompleted_.notify_all();
+      });
+
+    if (!sent)
+    {
+      std::lock_guard<std::mutex> lock(writeMutex_);
+      batch->inFlight--;
+      batch->failed++;
+      writeStats_.completed++;
+      writeStats_.failed++;
+    }
+  }
+
+  waitForBatch(0);
+
+  std::lock_guard<std::mutex> lock(writeMutex_);
+  if (batch->failed > 0)
+  {
+    std::cerr << batch->failed << " of " << chunks.size()
+              << " writes failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void BluetoothManager::setWriteWindow(size_t window)
+{
+  std::lock_guard<std::mutex> lock(writeMutex_);
+  writeWindow_ = std::max<size_t>(window, 1);
+}
+
+WriteStats BluetoothManager::getWriteStats()
+{
+  std::lock_guard<std::mutex> lock(writeMutex_);
+  return writeStats_;
+}
+
+WriteType BluetoothManager::resolveWriteType(
+  const std::string& characteristicPath,
+  WriteType          type)
+{
+  if (type != WriteType::Auto)
+    return type;
+
+  std::lock_guard<std::mutex> lock(stateMutex_);
+
+  BluetoothCharacteristic* characteristic =
+    findCharacteristic(characteristicPath);
+  if (!characteristic)
+    return WriteType::Auto;
+
+  const auto& flags = characteristic->flags;
+  if (std::find(flags.begin(), flags.end(), "write-without-response") !=
+      flags.end())
+    return WriteType::Command;
+  if (std::find(flags.begin(), flags.end(), "write") != flags.end())
+    return WriteType::Request;
+
+  // Unknown capabilities, leave the choice to BlueZ
+  return WriteType::Auto;
+}
+
 std::vector<uint8_t> BluetoothManager::readCharacteristic(
   const std::string& characteristicPath)
 {
-  std::vector<uint8_t> data;
+  std::vector<uint8_t> data(NOTIFICATION_MAX_PAYLOAD);
+
+  ssize_t length =
+    readCharacteristic(characteristicPath, data.data(), data.size());
+  data.resize(length > 0 ? length : 0);
+
+  return data;
+}
 
+ssize_t BluetoothManager::readCharacteristic(
+  const std::string& characteristicPath,
+  uint8_t*           buffer,
+  size_t             size)
+{
   DBusMessage* reply = dbus_.callMethodWithArgs(
     "org.bluez",
     characteristicPath,
@@ -588,53 +2229,292 @@ std::vector<uint8_t> BluetoothManager::readCharacteristic(
       dbus_message_iter_close_container(&iter, &options_iter);
     });
 
-  if (reply)
+  if (!reply)
+    return -1;
+
+  ssize_t copied = copyReadValue(reply, buffer, size);
+  dbus_message_unref(reply);
+
+  return copied;
+}
+
+ssize_t BluetoothManager::copyReadValue(DBusMessage* reply,
+                                        uint8_t*     buffer,
+                                        size_t       size)
+{
+  DBusMessageIter       iter;
+  dbus_decode::ByteView value;
+  if (!dbus_message_iter_init(reply, &iter) || !dbus_decode::read(&iter, value))
+    return -1;
+
+  if (value.size > size)
+  {
+    std::cerr << "Read value of " << value.size
+              << " bytes does not fit a buffer of " << size << std::endl;
+    return -1;
+  }
+
+  std::memcpy(buffer, value.data, value.size);
+  return static_cast<ssize_t>(value.size);
+}
+
+bool BluetoothManager::acquireWrite(const std::string& characteristicPath,
+                                    AcquiredSocket&    socket)
+{
+  auto socketIt = writeSockets_.find(characteristicPath);
+  if (socketIt != writeSockets_.end())
+  {
+    socket = socketIt->second;
+    return true;
+  }
+
+  if (!acquireSocket(characteristicPath, "AcquireWrite", socket))
+  {
+    std::cerr << "AcquireWrite failed for: " << characteristicPath
+              << std::endl;
+    return false;
+  }
+
+  writeSockets_[characteristicPath] = socket;
+  return true;
+}
+
+void BluetoothManager::releaseWrite(const std::string& characteristicPath)
+{
+  // Closing the socket releases the WriteValue lock held by AcquireWrite
+  auto socketIt = writeSockets_.find(characteristicPath);
+  if (socketIt != writeSockets_.end())
+  {
+    close(socketIt->second.fd);
+    writeSockets_.erase(socketIt);
+  }
+}
+
+bool BluetoothManager::writeCharacteristicStream(
+  const std::string& characteristicPath,
+  const uint8_t*     data,
+  size_t             length)
+{
+  AcquiredSocket socket;
+  if (!acquireWrite(characteristicPath, socket))
+    return false;
+
+  const size_t chunkSize = socket.mtu - ATT_WRITE_HEADER_SIZE;
+
+  // Each packet is its own message on the SOCK_SEQPACKET socket, so point
+  // one iovec per message straight into the caller's buffer
+  iovec   iovecs[WRITE_BATCH_SIZE];
+  mmsghdr messages[WRITE_BATCH_SIZE];
+  size_t  offset = 0;
+
+  while (offset < length)
   {
-    DBusMessageIter iter, array_iter;
-    if (dbus_message_iter_init(reply, &iter) &&
-        dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY)
+    size_t count = 0;
+    for (size_t chunkOffset = offset;
+         chunkOffset < length && count < WRITE_BATCH_SIZE;
+         chunkOffset += chunkSize, count++)
+    {
+      iovecs[count].iov_base = const_cast<uint8_t*>(data + chunkOffset);
+      iovecs[count].iov_len  = std::min(chunkSize, length - chunkOffset);
+
+      std::memset(&messages[count], 0, sizeof(messages[count]));
+      messages[count].msg_hdr.msg_iov    = &iovecs[count];
+      messages[count].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(socket.fd, messages, count, MSG_NOSIGNAL);
+    if (sent < 0)
     {
-      dbus_message_iter_recurse(&iter, &array_iter);
+      if (errno == EINTR)
+        continue;
 
-      while (dbus_message_iter_get_arg_type(&array_iter) == DBUS_TYPE_BYTE)
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
       {
-        uint8_t byte;
-        dbus_message_iter_get_basic(&array_iter, &byte);
-        data.push_back(byte);
-        dbus_message_iter_next(&array_iter);
+        // A link that stalls without hanging up must not block us forever
+        pollfd fd = {socket.fd, POLLOUT, 0};
+        if (poll(&fd, 1, STREAM_WRITE_TIMEOUT_MS) != 0)
+          continue;
+        errno = ETIMEDOUT;
       }
+
+      std::cerr << "Streaming write failed: " << std::strerror(errno)
+                << std::endl;
+      // The socket is unusable after a HUP, so acquire a new one next time
+      releaseWrite(characteristicPath);
+      return false;
+    }
+
+    for (int i = 0; i < sent; i++)
+    {
+      offset += iovecs[i].iov_len;
     }
-    dbus_message_unref(reply);
   }
 
-  return data;
+  return true;
+}
+
+bool BluetoothManager::writeCharacteristicStream(
+  const std::string&          characteristicPath,
+  const std::vector<uint8_t>& data)
+{
+  return writeCharacteristicStream(
+    characteristicPath, data.data(), data.size());
 }
 
 void BluetoothManager::processNotifications()
 {
-  dbus_.processMessages(100);
+  // The event loop thread already dispatches notifications as they arrive,
+  // so all that is left is handing queued ones to the callback. Without a
+  // bus, e.g. during a replay, there is nothing to poll either.
+  if (eventLoop_.isRunning() || !dbus_.getConnection())
+  {
+    if (notificationQueue_)
+    {
+      drainNotificationQueue(100);
+    }
+    else
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return;
+  }
+
+  pollNotifications();
+
+  if (notificationQueue_)
+  {
+    drainNotificationQueue(0);
+  }
+}
+
+void BluetoothManager::pollNotifications()
+{
+  std::map<std::string, AcquiredSocket> sockets;
+  std::vector<uint32_t>                 handles;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    sockets = notifySockets_;
+    for (const auto& socketPair : sockets)
+    {
+      handles.push_back(characteristicPaths_.find(socketPair.first));
+    }
+  }
+
+  if (sockets.empty())
+  {
+    dbus_.processMessages(100);
+    return;
+  }
+
+  // Wait on the bus and every acquired socket together so neither source
+  // holds up the other
+  std::vector<pollfd> fds;
+  fds.push_back({dbus_.getUnixFd(), POLLIN, 0});
+  for (const auto& socketPair : sockets)
+  {
+    fds.push_back({socketPair.second.fd, POLLIN, 0});
+  }
+
+  poll(fds.data(), fds.size(), 100);
+
+  dbus_.processMessages(0);
+
+  size_t index = 0;
+  for (const auto& socketPair : sockets)
+  {
+    drainNotifySocket(socketPair.first, handles[index++], socketPair.second);
+  }
 }
 
 void BluetoothManager::setNotificationCallback(
   std::function<void(const std::string&, const std::vector<uint8_t>&)> callback)
 {
+  std::lock_guard<std::mutex> lock(callbackMutex_);
   notificationCallback_ = callback;
 }
 
+void BluetoothManager::setNotificationRecordCallback(
+  NotificationRecordCallback callback)
+{
+  std::lock_guard<std::mutex> lock(callbackMutex_);
+  recordCallback_ = callback;
+}
+
+uint32_t BluetoothManager::internCharacteristicPath(
+  const std::string& characteristicPath)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  return exportCharacteristic(characteristicPath);
+}
+
+void BluetoothManager::injectNotification(uint32_t       handle,
+                                          const uint8_t* data,
+                                          size_t         length)
+{
+  const std::string* path;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    if (handle >= characteristicPaths_.size())
+      return;
+    path = &characteristicPaths_.path(handle);
+  }
+
+  deliverNotification(handle, *path, data, length);
+}
+
+SignalStats BluetoothManager::getSignalStats()
+{
+  SignalStats stats;
+  stats.handled    = signalsHandled_.load(std::memory_order_relaxed);
+  stats.ignored    = signalsIgnored_.load(std::memory_order_relaxed);
+  stats.matchRules = dbus_.getSignalMatchCount();
+  return stats;
+}
+
+std::vector<MethodStatsSnapshot> BluetoothManager::getCallStats()
+{
+  return dbus_.getCallMetrics().snapshot();
+}
+
 std::vector<BluetoothDevice> BluetoothManager::getAllDevices()
 {
   std::vector<BluetoothDevice> deviceList;
-  for (const auto& devicePair : devices_)
+
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  for (const auto& adapterPair : adapters_)
   {
-    deviceList.push_back(devicePair.second);
+    for (uint32_t handle : adapterPair.second.devices)
+    {
+      deviceList.push_back(devices_[handle].device);
+    }
   }
   return deviceList;
 }
 
 void BluetoothManager::updateDeviceInfo()
 {
-  for (auto& devicePair : devices_)
+  std::vector<std::string> paths;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    for (const auto& entry : devices_)
+    {
+      if (entry.present)
+      {
+        paths.push_back(entry.device.path);
+      }
+    }
+  }
+
+  // One GetAll per device, all in flight before the first reply is read
+  std::vector<DBusPendingReply> requests;
+  requests.reserve(paths.size());
+  for (const auto& path : paths)
+  {
+    requests.push_back(requestDeviceProperties(path));
+  }
+
+  for (size_t i = 0; i < paths.size(); i++)
   {
-    parseDeviceProperties(devicePair.first, devicePair.second);
+    parseDeviceProperties(paths[i], requests[i]);
   }
 }
\ No newline at end of file
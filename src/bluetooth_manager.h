@@ -1,91 +1,478 @@
 #ifndef BLUETOOTH_MANAGER_H
 #define BLUETOOTH_MANAGER_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <unordered_set>
 #include <vector>
+#include "bluetooth_uuid.h"
+#include "dbus_event_loop.h"
 #include "dbus_helper.h"
+#include "notification_queue.h"
+#include "object_path_table.h"
 
 struct BluetoothDevice
 {
-  std::string              path;
-  std::string              address;
-  std::string              name;
-  std::vector<std::string> services;
-  bool                     connected = false;
+  std::string                path;
+  std::string                adapter;  // Path of the controller that sees it
+  std::string                address;
+  std::string                name;
+  std::vector<BluetoothUuid> services;
+  bool                       connected        = false;
+  bool                       servicesResolved = false;
 };
 
 struct BluetoothCharacteristic
 {
   std::string              path;
-  std::string              uuid;
+  BluetoothUuid            uuid;
   std::vector<std::string> flags;
   std::string              service_path;
 };
 
+// Snapshot of one controller managed by BluetoothManager
+struct BluetoothAdapter
+{
+  std::string path;
+  std::string address;
+  bool        discovering     = false;
+  size_t      deviceCount     = 0;
+  size_t      connectionCount = 0;  // Connected or connecting devices
+};
+
+// Applied with Adapter1.SetDiscoveryFilter on every adapter before
+// discovery starts, so bluetoothd drops unwanted devices itself instead of
+// signalling them to us
+struct DiscoveryFilter
+{
+  bool        enabled       = true;   // false clears any previous filter
+  bool        serviceUuids  = true;   // Restrict to setDesiredServices()
+  int16_t     rssi          = 0;      // dBm threshold, 0 for none
+  uint16_t    pathloss      = 0;      // dB threshold, 0 for none
+  std::string transport     = "le";   // "auto", "bredr" or "le"
+  bool        duplicateData = false;  // Report every advertisement
+};
+
+// Socket handed out by BlueZ through AcquireNotify/AcquireWrite
+struct AcquiredSocket
+{
+  int      fd  = -1;
+  uint16_t mtu = 0;
+};
+
+enum class NotificationMode
+{
+  StartNotify,   // Values arrive as PropertiesChanged signals via dbus-daemon
+  AcquireNotify  // Values are read straight from a socket owned by us
+};
+
+enum class WriteType
+{
+  Auto,     // Command when the characteristic allows it, otherwise Request
+  Request,  // ATT Write Request, waits for the peripheral to acknowledge
+  Command   // ATT Write Command, no acknowledgement and no round trip
+};
+
+// Totals for pipelined writes, updated as the WriteValue replies arrive
+struct WriteStats
+{
+  uint64_t sent      = 0;
+  uint64_t completed = 0;
+  uint64_t failed    = 0;
+};
+
+// Signals seen by the message filter. BlueZ signals are subscribed with
+// narrow match rules, so ignored should stay near zero even on a busy site;
+// a growing count means a rule lets through traffic nothing here tracks.
+struct SignalStats
+{
+  uint64_t handled    = 0;
+  uint64_t ignored    = 0;
+  size_t   matchRules = 0;  // Rules currently installed on the bus
+};
+
+// Where a characteristic's payload carries the sender's own sequence
+// counter: an unsigned integer of width bytes at offset
+struct SequenceField
+{
+  size_t  offset    = 0;
+  uint8_t width     = 4;  // 1, 2, 4 or 8
+  bool    bigEndian = false;
+};
+
+// Receive accounting for one characteristic since notifications were last
+// enabled. Gaps are only detected with a SequenceField set; a counter that
+// repeats or goes backwards is counted as reordered instead.
+struct NotificationStats
+{
+  uint64_t received         = 0;
+  uint64_t sequenced        = 0;  // Values the sender's counter was read from
+  uint64_t gaps             = 0;  // Times the counter jumped forward
+  uint64_t missing          = 0;  // Values skipped over by those jumps
+  uint64_t reordered        = 0;
+  uint64_t intervalMeanNs   = 0;  // Time between consecutive values
+  uint64_t intervalStddevNs = 0;
+  uint64_t intervalMaxNs    = 0;
+  uint64_t jitterNs         = 0;  // Smoothed interval change, as RFC 3550
+};
+
+enum class ConnectionState
+{
+  Disconnected,
+  Connecting,
+  Connected,         // Link is up, GATT services not resolved yet
+  ServicesResolved,  // GATT objects are exported and ready to use
+  Failed
+};
+
+using ConnectionCallback =
+  std::function<void(const std::string& devicePath, ConnectionState state)>;
+
+// Notification callback that also gets the receive timestamp and sequence
+// numbers. data holds header.length bytes and is only valid during the call.
+using NotificationRecordCallback =
+  std::function<void(const std::string&        characteristicPath,
+                     const NotificationHeader& header,
+                     const uint8_t*            data)>;
+
 class BluetoothManager
 {
 public:
   BluetoothManager();
   ~BluetoothManager();
 
-  bool initialize();
+  // busAddress selects a bus other than the system bus, e.g. a private
+  // dbus-daemon running mock-bluez
+  bool initialize(const std::string& busAddress = "");
+
+  // Every org.bluez.Adapter1 is managed; discovery runs on all of them
+  std::vector<BluetoothAdapter> getAdapters();
 
-  // Device scanning
+  // Device scanning. RSSI and pathloss thresholds are mutually exclusive,
+  // so setDiscoveryFilter() rejects a filter that sets both.
+  bool setDiscoveryFilter(const DiscoveryFilter& filter);
   bool startDiscovery();
   bool stopDiscovery();
   void scanForDevices(int timeoutSeconds = 10);
 
   // Service filtering
+  // Short (16/32-bit) and full 128-bit UUID strings are both accepted
   void setDesiredServices(const std::vector<std::string>& services);
   std::vector<BluetoothDevice> getDevicesWithDesiredServices();
 
   // Device connection
   bool connectToDevice(const std::string& devicePath);
   bool disconnectFromDevice(const std::string& devicePath);
+  std::vector<std::string> connectToDevices(
+    const std::vector<std::string>& devicePaths);
+
+  // Placement for gateways with several controllers. A device seen by more
+  // than one adapter is connected through the least-loaded of them, so
+  // connections spread past a single controller's limit. placeConnection()
+  // returns the chosen device path, or "" if no adapter sees the address.
+  std::string placeConnection(const std::string& address);
+  bool        connectToAddress(const std::string& address);
+
+  // Event driven connection handling. beginConnect() only sends
+  // Device1.Connect; Connected and ServicesResolved updates move the state
+  // on and fire the connection callback from the dispatching thread.
+  bool            beginConnect(const std::string& devicePath);
+  bool            waitForConnection(const std::string&        devicePath,
+                                    std::chrono::milliseconds timeout);
+  ConnectionState getConnectionState(const std::string& devicePath);
+  void            setConnectTimeout(std::chrono::milliseconds timeout);
+  void            setConnectionCallback(ConnectionCallback callback);
 
   // Service and characteristic discovery
   std::vector<BluetoothCharacteristic> getCharacteristics(
     const std::string& devicePath);
 
   // Characteristic operations
-  bool enableNotifications(const std::string& characteristicPath);
+  bool enableNotifications(
+    const std::string& characteristicPath,
+    NotificationMode   mode = NotificationMode::StartNotify);
   bool disableNotifications(const std::string& characteristicPath);
+
+  // Non-blocking read of one notification from an AcquireNotify socket.
+  // Returns the payload length, 0 if nothing is pending, or -1 on error or
+  // when the characteristic has no acquired socket. A socket the remote has
+  // hung up is released and reads as -1 from then on.
+  ssize_t readNotification(const std::string& characteristicPath,
+                           uint8_t*           buffer,
+                           size_t             size);
+
   bool writeCharacteristic(const std::string&          characteristicPath,
-                           const std::vector<uint8_t>& data);
+                           const std::vector<uint8_t>& data,
+                           WriteType                   type = WriteType::Auto);
   std::vector<uint8_t> readCharacteristic(
     const std::string& characteristicPath);
 
+  // Buffer based variants for hot paths. readCharacteristic copies the value
+  // into buffer and returns its length, or -1 on error or when the value is
+  // longer than size.
+  bool    writeCharacteristic(const std::string& characteristicPath,
+                              const uint8_t*     data,
+                              size_t             length,
+                              WriteType          type = WriteType::Auto);
+  ssize_t readCharacteristic(const std::string& characteristicPath,
+                             uint8_t*           buffer,
+                             size_t             size);
+
+  // Pipelined writes. Each chunk is one WriteValue call; up to the write
+  // window are kept in flight and failures are counted as replies come
+  // back. Returns false if any chunk failed.
+  bool       writeCharacteristicBulk(
+          const std::string&                       characteristicPath,
+          const std::vector<std::vector<uint8_t>>& chunks,
+          WriteType                                type = WriteType::Auto);
+  void       setWriteWindow(size_t window);
+  WriteStats getWriteStats();
+  WriteType  resolveWriteType(const std::string& characteristicPath,
+                              WriteType          type);
+
+  // Streaming writes over an AcquireWrite socket. The payload is split into
+  // MTU sized packets and sent without a D-Bus message per packet.
+  bool acquireWrite(const std::string& characteristicPath,
+                    AcquiredSocket&    socket);
+  void releaseWrite(const std::string& characteristicPath);
+  bool writeCharacteristicStream(const std::string& characteristicPath,
+                                 const uint8_t*     data,
+                                 size_t             length);
+  bool writeCharacteristicStream(const std::string&          characteristicPath,
+                                 const std::vector<uint8_t>& data);
+
   // Notification handling
   void processNotifications();
   void setNotificationCallback(
     std::function<void(const std::string&, const std::vector<uint8_t>&)>
       callback);
 
+  // Notification queueing. Once enabled, values received on the bus thread
+  // are pushed into a lock-free ring instead of calling the callback there;
+  // processNotifications() then runs the callback on the caller's thread, or
+  // a consumer pops records directly. Enable before turning on notifications.
+  void               enableNotificationQueue(size_t capacity = 4096);
+  NotificationQueue* getNotificationQueue();
+  std::string        getCharacteristicPath(uint32_t handle);
+
+  // Handle of a path the manager already knows, or
+  // ObjectPathTable::INVALID_HANDLE. Unlike internCharacteristicPath() it
+  // never adds one, so it is safe to call with untrusted paths.
+  uint32_t findCharacteristicHandle(const std::string& characteristicPath);
+  // Whether BlueZ is still delivering values; cleared when the link drops,
+  // the device is disconnected or the remote closes an acquired socket
+  bool     isNotifying(uint32_t handle);
+
+  // Used instead of the plain callback when set. Both callbacks may be
+  // swapped while values arrive: once a setter returns, the previous
+  // callback has finished and is not called again. Not from a callback.
+  void setNotificationRecordCallback(NotificationRecordCallback callback);
+
+  // Feeds a value through the same sequencing, queue and callback path as
+  // one received from BlueZ, e.g. to replay a recording. The handle comes
+  // from internCharacteristicPath(); no bus connection is needed.
+  uint32_t internCharacteristicPath(const std::string& characteristicPath);
+  void     injectNotification(uint32_t       handle,
+                              const uint8_t* data,
+                              size_t         length);
+
+  // Sequencing. Every notification is stamped with its receive time and a
+  // per-characteristic sequence number. With a sequence field set, the
+  // sender's counter is also read from each payload and jumps in it are
+  // counted as gaps, which tells values lost upstream from ones we dropped.
+  bool              setSequenceField(const std::string&   characteristicPath,
+                                     const SequenceField& field);
+  void              clearSequenceField(const std::string& characteristicPath);
+  NotificationStats getNotificationStats(
+    const std::string& characteristicPath);
+
+  // Time queued notifications waited between receipt and the callback run
+  // by processNotifications()
+  const LatencyHistogram& getDeliveryLatency() const;
+
   // Device management
   std::vector<BluetoothDevice> getAllDevices();
   void                         updateDeviceInfo();
 
+  SignalStats getSignalStats();
+
+  // Latency percentiles and error counts of the D-Bus calls made so far, per
+  // (interface, method); format with CallMetrics::formatText or formatJson
+  std::vector<MethodStatsSnapshot> getCallStats();
+
 private:
+  // Drives the parsing and dispatch paths below with in-memory messages
+  friend struct BluetoothManagerBenchmark;
+
   DBusHelper                             dbus_;
-  std::vector<std::string>               desiredServices_;
-  std::map<std::string, BluetoothDevice> devices_;
-  std::set<std::string>                  notifyingCharacteristics_;
+  DBusEventLoop                          eventLoop_;
+  std::unordered_set<BluetoothUuid>      desiredServices_;
+  DiscoveryFilter                        discoveryFilter_;
+
+  // Guards the cache and notification state below, which is updated from
+  // the event loop thread and read from the caller's thread
+  std::mutex stateMutex_;
+
+  struct DeviceEntry
+  {
+    BluetoothDevice device;
+    bool            present = false;
+  };
+
+  struct CharacteristicEntry
+  {
+    BluetoothCharacteristic characteristic;
+    bool                    present   = false;
+    bool                    notifying = false;
+    bool                    exported  = false;  // Handle given to callers
+  };
+
+  struct AdapterState
+  {
+    std::string        address;
+    bool               discovering = false;
+    std::set<uint32_t> devices;  // Handles into devices_
+  };
+
+  // Mirror of the BlueZ object tree, seeded from GetManagedObjects and kept
+  // current by ObjectManager and PropertiesChanged signals. Object paths
+  // are interned once; devices and characteristics live in flat tables
+  // indexed by the interned handle. A characteristic's handle is also the
+  // handle carried by its queued notifications.
+  std::map<std::string, AdapterState, std::less<>> adapters_;
+  ObjectPathTable                                  devicePaths_;
+  ObjectPathTable                                  characteristicPaths_;
+  std::vector<DeviceEntry>                         devices_;
+  std::vector<CharacteristicEntry>                 characteristics_;
+
+  std::unique_ptr<NotificationQueue> notificationQueue_;
+  // Paths of queued handles, resolved once by the consumer. Queued handles
+  // are exported and so never released, and the table never moves a path.
+  std::vector<const std::string*> queuePaths_;
+
+  std::map<std::string, ConnectionState, std::less<>> connectionStates_;
+  std::condition_variable                              connectionChanged_;
+  std::chrono::milliseconds                            connectTimeout_{10000};
+  ConnectionCallback                                   connectionCallback_;
+
+  // Pipelined write accounting, kept apart from stateMutex_ so reply
+  // handling never contends with notification delivery
+  std::mutex              writeMutex_;
+  std::condition_variable writeCompleted_;
+  size_t                  writeWindow_ = 16;
+  WriteStats              writeStats_;
+
+  // Per-characteristic receive accounting, indexed by handle like
+  // characteristics_. Updated for every notification, so it has its own
+  // lock rather than contending with object tree updates.
+  struct NotificationStream
+  {
+    NotificationStats stats;
+    bool              hasField = false;
+    SequenceField     field;
+    uint64_t          lastAppSequence = 0;
+    uint64_t          lastTimestampNs = 0;
+    uint64_t          lastIntervalNs  = 0;
+    double            intervalMean    = 0;
+    double            intervalM2      = 0;  // Welford sum of squares
+    double            jitter          = 0;
+  };
+
+  std::mutex                      streamMutex_;
+  std::vector<NotificationStream> streams_;
+  LatencyHistogram                deliveryLatency_;
+
+  std::map<std::string, AcquiredSocket>  notifySockets_;
+  std::map<std::string, AcquiredSocket>  writeSockets_;
+  std::vector<uint8_t>                   notifyBuffer_;
+  // Held while a notification callback runs, so a swap waits for it
+  std::mutex callbackMutex_;
   std::function<void(const std::string&, const std::vector<uint8_t>&)>
-    notificationCallback_;
+                             notificationCallback_;
+  NotificationRecordCallback recordCallback_;
 
   std::string adapterPath_;
+  bool        filterInstalled_ = false;
+
+  // Match rule bookkeeping. Discovery subscribes to all ObjectManager
+  // traffic while it runs; otherwise only devices we connect to and
+  // characteristics notifying through StartNotify are watched.
+  bool                  discoveryWatched_ = false;
+  std::set<std::string> watchedDevices_;  // Guarded by stateMutex_
+  std::atomic<uint64_t> signalsHandled_{0};
+  std::atomic<uint64_t> signalsIgnored_{0};
 
+  bool loadObjectTree();
+  bool applyManagedObjects(DBusMessage* reply);
   bool findAdapter();
-  void discoverDevices();
-  void parseDeviceProperties(const std::string& devicePath,
-                             BluetoothDevice&   device);
-  void parseCharacteristicProperties(const std::string&       charPath,
-                                     BluetoothCharacteristic& characteristic);
-  bool hasDesiredService(const BluetoothDevice& device);
+  BluetoothDevice*         findDevice(std::string_view path);
+  BluetoothCharacteristic* findCharacteristic(std::string_view path);
+  uint32_t                 internDevice(std::string_view path);
+  uint32_t                 internCharacteristic(std::string_view path);
+  uint32_t                 exportCharacteristic(std::string_view path);
+  void                     releaseDevice(uint32_t handle);
+  void                     releaseCharacteristic(uint32_t handle);
+  bool addInterface(std::string_view path,
+                    std::string_view interface,
+                    DBusMessageIter* props_iter);
+  bool handleInterfacesAdded(DBusMessage* message);
+  bool handleInterfacesRemoved(DBusMessage* message);
+  bool handlePropertiesChanged(DBusMessage* message);
+  void dispatchNotification(uint32_t           handle,
+                            const std::string& path,
+                            DBusMessageIter*   changed_iter);
+  void deliverNotification(uint32_t           handle,
+                           const std::string& path,
+                           const uint8_t*     data,
+                           size_t             length);
+  void sequenceNotification(NotificationHeader& header, const uint8_t* data);
+  void invokeNotificationCallback(const std::string&        path,
+                                  const NotificationHeader& header,
+                                  const uint8_t*            data);
+  void resetNotificationStream(uint32_t handle);
+  NotificationStream& notificationStream(uint32_t handle);
+  DBusPendingReply requestDeviceProperties(const std::string& devicePath);
+  void             parseDeviceProperties(const std::string& devicePath,
+                                         DBusPendingReply&  request);
+  bool   hasDesiredService(const BluetoothDevice& device);
+  size_t adapterLoad(const AdapterState& adapter);
+  bool   setDiscovery(const std::string& method);
+  void   watchDiscovery(bool enable);
+  void   watchDevice(const std::string& devicePath);
+  void   unwatchDevice(const std::string& devicePath);
+  void   retireDevice(const std::string& devicePath);
+  void handleConnectReply(const std::string& devicePath, bool succeeded);
+  bool updateConnectionState(const BluetoothDevice& device,
+                             ConnectionState&       state);
+  void reportConnectionState(const std::string& devicePath,
+                             ConnectionState    state);
+  bool acquireSocket(const std::string& characteristicPath,
+                     const std::string& method,
+                     AcquiredSocket&    socket);
+  void drainNotifySocket(const std::string&    characteristicPath,
+                         uint32_t              handle,
+                         const AcquiredSocket& socket);
+  void closeNotifySocket(const std::string& characteristicPath, int fd);
+  static void    appendWriteValueArgs(DBusMessage*   msg,
+                                      const uint8_t* data,
+                                      size_t         length,
+                                      WriteType      type);
+  static ssize_t copyReadValue(DBusMessage* reply,
+                               uint8_t*     buffer,
+                               size_t       size);
+  void     pollNotifications();
+  void     drainNotificationQueue(int timeoutMs);
+  const std::string& queuedPath(uint32_t handle);
   static DBusHandlerResult messageFilter(DBusConnection* connection,
                                          DBusMessage*    message,
                                          void*           userData);
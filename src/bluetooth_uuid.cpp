@@ -0,0 +1,153 @@
+#include "bluetooth_uuid.h"
+#include <cstring>
+
+// Bytes 4..15 shared by every SIG assigned UUID
+const uint8_t BLUETOOTH_BASE_UUID_TAIL[12] = {
+  0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb};
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+BluetoothUuid BluetoothUuid::fromShort(uint32_t value)
+{
+  BluetoothUuid uuid;
+  std::memcpy(uuid.bytes_.data() + 4, BLUETOOTH_BASE_UUID_TAIL, 12);
+  uuid.bytes_[0] = static_cast<uint8_t>(value >> 24);
+  uuid.bytes_[1] = static_cast<uint8_t>(value >> 16);
+  uuid.bytes_[2] = static_cast<uint8_t>(value >> 8);
+  uuid.bytes_[3] = static_cast<uint8_t>(value);
+  return uuid;
+}
+
+bool BluetoothUuid::parse(std::string_view text, BluetoothUuid& uuid)
+{
+  if (text.size() == 4 || text.size() == 8)
+  {
+    uint32_t value = 0;
+    for (char c : text)
+    {
+      int digit = hexValue(c);
+      if (digit < 0)
+        return false;
+      value = (value << 4) | static_cast<uint32_t>(digit);
+    }
+    uuid = fromShort(value);
+    return true;
+  }
+
+  // 128-bit form; dashes are only allowed in the canonical 8-4-4-4-12 spots
+  bool dashed = text.size() == 36;
+  if (!dashed && text.size() != 32)
+    return false;
+
+  BluetoothUuid parsed;
+  size_t        digits = 0;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (dashed && (i == 8 || i == 13 || i == 18 || i == 23))
+    {
+      if (text[i] != '-')
+        return false;
+      continue;
+    }
+
+    int digit = hexValue(text[i]);
+    if (digit < 0)
+      return false;
+
+    parsed.bytes_[digits / 2] |=
+      static_cast<uint8_t>(digits % 2 ? digit : digit << 4);
+    digits++;
+  }
+
+  uuid = parsed;
+  return true;
+}
+
+BluetoothUuid BluetoothUuid::fromString(std::string_view text)
+{
+  BluetoothUuid uuid;
+  parse(text, uuid);
+  return uuid;
+}
+
+bool BluetoothUuid::isNil() const
+{
+  for (uint8_t byte : bytes_)
+  {
+    if (byte != 0)
+      return false;
+  }
+  return true;
+}
+
+bool BluetoothUuid::isShort() const
+{
+  return std::memcmp(bytes_.data() + 4, BLUETOOTH_BASE_UUID_TAIL, 12) == 0;
+}
+
+uint32_t BluetoothUuid::shortValue() const
+{
+  return (static_cast<uint32_t>(bytes_[0]) << 24) |
+         (static_cast<uint32_t>(bytes_[1]) << 16) |
+         (static_cast<uint32_t>(bytes_[2]) << 8) |
+         static_cast<uint32_t>(bytes_[3]);
+}
+
+std::string BluetoothUuid::toString() const
+{
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+
+  std::string text;
+  text.reserve(36);
+  for (size_t i = 0; i < bytes_.size(); i++)
+  {
+    if (i == 4 || i == 6 || i == 8 || i == 10)
+      text.push_back('-');
+    text.push_back(HEX_DIGITS[bytes_[i] >> 4]);
+    text.push_back(HEX_DIGITS[bytes_[i] & 0x0f]);
+  }
+  return text;
+}
+
+const std::array<uint8_t, 16>& BluetoothUuid::bytes() const
+{
+  return bytes_;
+}
+
+size_t BluetoothUuid::hash() const
+{
+  // SIG UUIDs only differ in the first word, so mix both halves
+  uint64_t high, low;
+  std::memcpy(&high, bytes_.data(), sizeof(high));
+  std::memcpy(&low, bytes_.data() + 8, sizeof(low));
+  return static_cast<size_t>((high * 0x9e3779b97f4a7c15ULL) ^ low);
+}
+
+bool BluetoothUuid::operator==(const BluetoothUuid& other) const
+{
+  return bytes_ == other.bytes_;
+}
+
+bool BluetoothUuid::operator!=(const BluetoothUuid& other) const
+{
+  return bytes_ != other.bytes_;
+}
+
+bool BluetoothUuid::operator<(const BluetoothUuid& other) const
+{
+  return bytes_ < other.bytes_;
+}
+
+std::ostream& operator<<(std::ostream& os, const BluetoothUuid& uuid)
+{
+  return os << uuid.toString();
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef BLUETOOTH_UUID_H
+#define BLUETOOTH_UUID_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// 128-bit Bluetooth UUID stored as 16 big-endian bytes. 16- and 32-bit SIG
+// short forms are expanded with the Bluetooth base UUID
+// (xxxxxxxx-0000-1000-8000-00805f9b34fb), so "180f", "0000180f" and the
+// full 128-bit string all compare equal.
+class BluetoothUuid
+{
+public:
+  BluetoothUuid() = default;
+
+  static BluetoothUuid fromShort(uint32_t value);
+
+  // Accepts 4 or 8 hex digits, or 32 hex digits with or without dashes.
+  // Returns false and leaves uuid untouched if text is not a UUID.
+  static bool parse(std::string_view text, BluetoothUuid& uuid);
+
+  // Same as parse(), but yields the nil UUID for invalid text
+  static BluetoothUuid fromString(std::string_view text);
+
+  bool     isNil() const;
+  bool     isShort() const;  // Built on the base UUID
+  uint32_t shortValue() const;
+
+  // Lowercase dashed 128-bit form
+  std::string toString() const;
+
+  const std::array<uint8_t, 16>& bytes() const;
+  size_t                         hash() const;
+
+  bool operator==(const BluetoothUuid& other) const;
+  bool operator!=(const BluetoothUuid& other) const;
+  bool operator<(const BluetoothUuid& other) const;
+
+private:
+  std::array<uint8_t, 16> bytes_{};
+};
+
+std::ostream& operator<<(std::ostream& os, const BluetoothUuid& uuid);
+
+namespace std
+{
+template <>
+struct hash<BluetoothUuid>
+{
+  size_t operator()(const BluetoothUuid& uuid) const
+  {
+    return uuid.hash();
+  }
+};
+}  // namespace std
+
+#endif  // BLUETOOTH_UUID_H
\ No newline at end of file
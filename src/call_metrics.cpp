@@ -0,0 +1,230 @@
+#include "call_metrics.h"
+#include <algorithm>
+#include <cstring>
+#include <dbus/dbus.h>
+#include <iomanip>
+#include <sstream>
+
+// Values below this get a bucket each; above, each power of two is split
+// into SUB_BUCKETS
+const uint64_t SUB_BUCKETS = 4;
+
+size_t LatencyHistogram::bucketIndex(uint64_t micros)
+{
+  if (micros < SUB_BUCKETS)
+    return static_cast<size_t>(micros);
+
+  unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(micros));
+  uint64_t sub = (micros >> (msb - 2)) & (SUB_BUCKETS - 1);
+  size_t   index =
+    static_cast<size_t>(SUB_BUCKETS + (msb - 2) * SUB_BUCKETS + sub);
+  return std::min(index, BUCKET_COUNT - 1);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t index)
+{
+  if (index < SUB_BUCKETS)
+    return index;
+
+  uint64_t msb = (index - SUB_BUCKETS) / SUB_BUCKETS + 2;
+  uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+  uint64_t low = (SUB_BUCKETS + sub) << (msb - 2);
+  return low + (uint64_t(1) << (msb - 2)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t micros)
+{
+  buckets_[bucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(micros, std::memory_order_relaxed);
+
+  uint64_t seen = max_.load(std::memory_order_relaxed);
+  while (micros > seen &&
+         !max_.compare_exchange_weak(seen, micros, std::memory_order_relaxed))
+  {
+  }
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+  // Sum the buckets themselves rather than trust count_, which a
+  // concurrent record() may already have bumped
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t total = 0;
+  for (size_t i = 0; i < BUCKET_COUNT; i++)
+  {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total));
+  rank          = std::max<uint64_t>(rank, 1);
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKET_COUNT; i++)
+  {
+    seen += counts[i];
+    if (seen >= rank)
+      return std::min(bucketUpperBound(i), max());
+  }
+  return max();
+}
+
+uint64_t LatencyHistogram::count() const
+{
+  return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+  return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::sum() const
+{
+  return sum_.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset()
+{
+  for (auto& bucket : buckets_)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+void MethodStats::recordLatency(std::chrono::steady_clock::time_point start)
+{
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  latency.record(static_cast<uint64_t>(
+    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+}
+
+void MethodStats::recordError(const char* errorName)
+{
+  errors.fetch_add(1, std::memory_order_relaxed);
+
+  // NoReply is what libdbus reports when the call timed out locally
+  if (errorName && (std::strcmp(errorName, DBUS_ERROR_NO_REPLY) == 0 ||
+                    std::strcmp(errorName, DBUS_ERROR_TIMEOUT) == 0))
+  {
+    timeouts.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+MethodStats* CallMetrics::find(const char* interface, const char* method)
+{
+  if (!interface)
+    interface = "";
+  if (!method)
+    method = "";
+
+  // Reused per thread so the lookup does not allocate once warm
+  thread_local std::string key;
+  key.assign(interface).append(1, '.').append(method);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = stats_.find(key);
+  if (it != stats_.end())
+    return it->second.get();
+
+  auto stats       = std::make_unique<MethodStats>();
+  stats->interface = interface;
+  stats->method    = method;
+  return stats_.emplace(key, std::move(stats)).first->second.get();
+}
+
+std::vector<MethodStatsSnapshot> CallMetrics::snapshot() const
+{
+  std::vector<MethodStatsSnapshot> snapshots;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& statsPair : stats_)
+  {
+    const MethodStats&  stats = *statsPair.second;
+    MethodStatsSnapshot snapshot;
+    snapshot.interface = stats.interface;
+    snapshot.method    = stats.method;
+    snapshot.calls     = stats.latency.count();
+    snapshot.errors    = stats.errors.load(std::memory_order_relaxed);
+    snapshot.timeouts  = stats.timeouts.load(std::memory_order_relaxed);
+    snapshot.meanUs    = snapshot.calls ? stats.latency.sum() / snapshot.calls
+                                        : 0;
+    snapshot.maxUs     = stats.latency.max();
+    snapshot.p50Us     = stats.latency.percentile(0.5);
+    snapshot.p99Us     = stats.latency.percentile(0.99);
+    snapshot.p999Us    = stats.latency.percentile(0.999);
+    snapshots.push_back(snapshot);
+  }
+
+  std::sort(snapshots.begin(),
+            snapshots.end(),
+            [](const MethodStatsSnapshot& a, const MethodStatsSnapshot& b) {
+              return a.interface != b.interface ? a.interface < b.interface
+                                                : a.method < b.method;
+            });
+  return snapshots;
+}
+
+void CallMetrics::reset()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& statsPair : stats_)
+  {
+    statsPair.second->latency.reset();
+    statsPair.second->errors.store(0, std::memory_order_relaxed);
+    statsPair.second->timeouts.store(0, std::memory_order_relaxed);
+  }
+}
+
+std::string CallMetrics::formatText(
+  const std::vector<MethodStatsSnapshot>& stats)
+{
+  std::ostringstream text;
+  text << std::left << std::setw(48) << "method" << std::right
+       << std::setw(9) << "calls" << std::setw(8) << "errors"
+       << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+       << std::setw(10) << "p99.9 us" << std::setw(10) << "max us" << "\n";
+
+  for (const auto& entry : stats)
+  {
+    text << std::left << std::setw(48)
+         << (entry.interface + "." + entry.method) << std::right
+         << std::setw(9) << entry.calls << std::setw(8) << entry.errors
+         << std::setw(10) << entry.p50Us << std::setw(10) << entry.p99Us
+         << std::setw(10) << entry.p999Us << std::setw(10) << entry.maxUs
+         << "\n";
+  }
+
+  return text.str();
+}
+
+std::string CallMetrics::formatJson(
+  const std::vector<MethodStatsSnapshot>& stats)
+{
+  // Interface and member names are restricted to [A-Za-z0-9_.], so they
+  // need no escaping
+  std::ostringstream json;
+  json << "[";
+  for (size_t i = 0; i < stats.size(); i++)
+  {
+    const MethodStatsSnapshot& entry = stats[i];
+    json << (i ? "," : "") << "\n  {\"interface\": \"" << entry.interface
+         << "\", \"method\": \"" << entry.method
+         << "\", \"calls\": " << entry.calls
+         << ", \"errors\": " << entry.errors
+         << ", \"timeouts\": " << entry.timeouts
+         << ", \"mean_us\": " << entry.meanUs
+         << ", \"p50_us\": " << entry.p50Us << ", \"p99_us\": " << entry.p99Us
+         << ", \"p999_us\": " << entry.p999Us
+         << ", \"max_us\": " << entry.maxUs << "}";
+  }
+  json << "\n]\n";
+  return json.str();
+}
\ No newline at end of file
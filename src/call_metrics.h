@@ -0,0 +1,88 @@
+#ifndef CALL_METRICS_H
+#define CALL_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Latency histogram with log-spaced buckets: four per power of two of
+// microseconds, so any recorded value is off by at most 25% of its bucket's
+// lower bound. Recording is a handful of relaxed atomic adds.
+class LatencyHistogram
+{
+public:
+  static const size_t BUCKET_COUNT = 160;
+
+  void record(uint64_t micros);
+
+  static size_t   bucketIndex(uint64_t micros);
+  static uint64_t bucketUpperBound(size_t index);
+
+  // Upper bound of the bucket holding the given fraction of samples
+  uint64_t percentile(double fraction) const;
+  uint64_t count() const;
+  uint64_t max() const;
+  uint64_t sum() const;
+  void     reset();
+
+private:
+  std::atomic<uint64_t> buckets_[BUCKET_COUNT] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// Counters for one (interface, method) pair
+struct MethodStats
+{
+  std::string           interface;
+  std::string           method;
+  LatencyHistogram      latency;  // Send to reply, errors included
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> timeouts{0};  // Subset of errors
+
+  void recordLatency(std::chrono::steady_clock::time_point start);
+  void recordError(const char* errorName);
+};
+
+// Point-in-time copy of one MethodStats, latencies in microseconds
+struct MethodStatsSnapshot
+{
+  std::string interface;
+  std::string method;
+  uint64_t    calls    = 0;
+  uint64_t    errors   = 0;
+  uint64_t    timeouts = 0;
+  uint64_t    meanUs   = 0;
+  uint64_t    maxUs    = 0;
+  uint64_t    p50Us    = 0;
+  uint64_t    p99Us    = 0;
+  uint64_t    p999Us   = 0;
+};
+
+// Registry of MethodStats, one per (interface, method) seen. Entries are
+// never removed, so the pointer returned by find() stays valid for the
+// lifetime of the registry and recording needs no lock.
+class CallMetrics
+{
+public:
+  MethodStats* find(const char* interface, const char* method);
+
+  std::vector<MethodStatsSnapshot> snapshot() const;
+  void                             reset();
+
+  static std::string formatText(const std::vector<MethodStatsSnapshot>& stats);
+  static std::string formatJson(const std::vector<MethodStatsSnapshot>& stats);
+
+private:
+  mutable std::mutex                                            mutex_;
+  std::unordered_map<std::string, std::unique_ptr<MethodStats>> stats_;
+};
+
+#endif  // CALL_METRICS_H
\ No newline at end of file
@@ -0,0 +1,964 @@
+#include "daemon_server.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+
+const int MAX_EPOLL_EVENTS = 16;
+
+// epoll tokens for the server's own descriptors; client ids start at 1
+const uint64_t LISTEN_TOKEN = UINT64_MAX;
+const uint64_t WAKEUP_TOKEN = UINT64_MAX - 1;
+const uint64_t SIGNAL_TOKEN = UINT64_MAX - 2;
+
+// Unsent bytes a client may fall behind by before notifications to it are
+// dropped. Responses are always queued.
+const size_t CLIENT_OUTBOX_LIMIT = 4 * 1024 * 1024;
+
+const size_t FRAME_LENGTH_SIZE = sizeof(uint32_t);
+
+DaemonFrameWriter::DaemonFrameWriter(DaemonMessage type)
+{
+  reset(type);
+}
+
+void DaemonFrameWriter::reset(DaemonMessage type)
+{
+  frame_.assign(FRAME_LENGTH_SIZE, 0);
+  frame_.push_back(static_cast<uint8_t>(type));
+}
+
+void DaemonFrameWriter::u8(uint8_t value)
+{
+  frame_.push_back(value);
+}
+
+void DaemonFrameWriter::u16(uint16_t value)
+{
+  frame_.push_back(static_cast<uint8_t>(value));
+  frame_.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+void DaemonFrameWriter::u32(uint32_t value)
+{
+  for (int shift = 0; shift < 32; shift += 8)
+    frame_.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+void DaemonFrameWriter::u64(uint64_t value)
+{
+  for (int shift = 0; shift < 64; shift += 8)
+    frame_.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+void DaemonFrameWriter::string(const std::string& value)
+{
+  bytes(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+}
+
+void DaemonFrameWriter::bytes(const uint8_t* data, size_t length)
+{
+  length = std::min<size_t>(length, UINT16_MAX);
+  u16(static_cast<uint16_t>(length));
+  frame_.insert(frame_.end(), data, data + length);
+}
+
+const std::vector<uint8_t>& DaemonFrameWriter::finish()
+{
+  uint32_t length = static_cast<uint32_t>(frame_.size() - FRAME_LENGTH_SIZE);
+  for (size_t i = 0; i < FRAME_LENGTH_SIZE; i++)
+    frame_[i] = static_cast<uint8_t>(length >> (8 * i));
+  return frame_;
+}
+
+DaemonFrameReader::DaemonFrameReader(const uint8_t* body, size_t length)
+  : body_(body), length_(length)
+{
+}
+
+bool DaemonFrameReader::take(void* out, size_t count)
+{
+  if (length_ - offset_ < count)
+    return false;
+
+  std::memcpy(out, body_ + offset_, count);
+  offset_ += count;
+  return true;
+}
+
+bool DaemonFrameReader::u8(uint8_t& value)
+{
+  return take(&value, 1);
+}
+
+bool DaemonFrameReader::u16(uint16_t& value)
+{
+  uint8_t raw[2];
+  if (!take(raw, sizeof(raw)))
+    return false;
+  value = static_cast<uint16_t>(raw[0] | (raw[1] << 8));
+  return true;
+}
+
+bool DaemonFrameReader::u32(uint32_t& value)
+{
+  uint8_t raw[4];
+  if (!take(raw, sizeof(raw)))
+    return false;
+  value = 0;
+  for (int i = 3; i >= 0; i--)
+    value = (value << 8) | raw[i];
+  return true;
+}
+
+bool DaemonFrameReader::u64(uint64_t& value)
+{
+  uint8_t raw[8];
+  if (!take(raw, sizeof(raw)))
+    return false;
+  value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = (value << 8) | raw[i];
+  return true;
+}
+
+bool DaemonFrameReader::string(std::string& value)
+{
+  const uint8_t* data;
+  size_t         length;
+  if (!bytes(data, length))
+    return false;
+  value.assign(reinterpret_cast<const char*>(data), length);
+  return true;
+}
+
+bool DaemonFrameReader::bytes(const uint8_t*& data, size_t& length)
+{
+  uint16_t count;
+  if (!u16(count) || length_ - offset_ < count)
+    return false;
+  data   = body_ + offset_;
+  length = count;
+  offset_ += count;
+  return true;
+}
+
+static DaemonFrameWriter response(DaemonMessage request,
+                                  uint32_t      requestId,
+                                  DaemonStatus  status)
+{
+  DaemonFrameWriter writer(static_cast<DaemonMessage>(
+    static_cast<uint8_t>(request) |
+    static_cast<uint8_t>(DaemonMessage::Response)));
+  writer.u32(requestId);
+  writer.u8(static_cast<uint8_t>(status));
+  return writer;
+}
+
+static DaemonStatus statusFor(bool succeeded)
+{
+  return succeeded ? DaemonStatus::Ok : DaemonStatus::Failed;
+}
+
+static sigset_t terminationSignals()
+{
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
+}
+
+DaemonServer::DaemonServer(BluetoothManager& manager) : manager_(manager)
+{
+}
+
+DaemonServer::~DaemonServer()
+{
+  shutdown();
+}
+
+bool DaemonServer::blockTerminationSignals()
+{
+  sigset_t signals = terminationSignals();
+  if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0)
+  {
+    std::cerr << "Failed to block termination signals" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool DaemonServer::listen(const std::string& socketPath)
+{
+  sockaddr_un address = {};
+  address.sun_family  = AF_UNIX;
+  if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+  {
+    std::cerr << "Invalid socket path: " << socketPath << std::endl;
+    return false;
+  }
+  std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+  // A socket file left by a daemon that died can be replaced, one that
+  // still answers cannot, and anything that is not a socket is left alone
+  struct stat info;
+  if (lstat(socketPath.c_str(), &info) == 0)
+  {
+    if (!S_ISSOCK(info.st_mode))
+    {
+      std::cerr << socketPath << " exists and is not a socket" << std::endl;
+      return false;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 && connect(probe,
+                                      reinterpret_cast<sockaddr*>(&address),
+                                      sizeof(address)) == 0;
+    if (probe >= 0)
+      close(probe);
+    if (live)
+    {
+      std::cerr << "Another daemon is listening on " << socketPath
+                << std::endl;
+      return false;
+    }
+    unlink(socketPath.c_str());
+  }
+
+  listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0 ||
+      bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+        != 0 ||
+      ::listen(listenFd_, SOMAXCONN) != 0)
+  {
+    std::cerr << "Failed to listen on " << socketPath << ": "
+              << std::strerror(errno) << std::endl;
+    shutdown();
+    return false;
+  }
+  socketPath_ = socketPath;
+
+  sigset_t signals = terminationSignals();
+  epollFd_         = epoll_create1(EPOLL_CLOEXEC);
+  wakeupFd_        = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  signalFd_        = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epollFd_ < 0 || wakeupFd_ < 0 || signalFd_ < 0)
+  {
+    std::cerr << "Failed to create daemon event descriptors" << std::endl;
+    shutdown();
+    return false;
+  }
+
+  const std::pair<int, uint64_t> watched[] = {
+    {listenFd_, LISTEN_TOKEN}, {wakeupFd_, WAKEUP_TOKEN},
+    {signalFd_, SIGNAL_TOKEN}};
+  for (const auto& entry : watched)
+  {
+    epoll_event event = {};
+    event.events      = EPOLLIN;
+    event.data.u64    = entry.second;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, entry.first, &event);
+  }
+
+  // Cleared again by shutdown(), before anything fanOut() touches goes away
+  manager_.setNotificationRecordCallback(
+    [this](const std::string&,
+           const NotificationHeader& header,
+           const uint8_t*            data) { fanOut(header, data); });
+
+  std::cout << "Daemon listening on " << socketPath << std::endl;
+  return true;
+}
+
+void DaemonServer::run()
+{
+  if (epollFd_ < 0)
+    return;
+
+  running_ = true;
+  worker_  = std::thread(&DaemonServer::runJobs, this);
+
+  epoll_event events[MAX_EPOLL_EVENTS];
+  while (running_)
+  {
+    int count = epoll_wait(epollFd_, events, MAX_EPOLL_EVENTS, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "Daemon epoll_wait failed: " << std::strerror(errno)
+                << std::endl;
+      break;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      uint64_t token = events[i].data.u64;
+      if (token == LISTEN_TOKEN)
+      {
+        acceptClients();
+      }
+      else if (token == WAKEUP_TOKEN)
+      {
+        uint64_t value;
+        while (read(wakeupFd_, &value, sizeof(value)) > 0)
+        {
+        }
+        wakeupPending_ = false;
+      }
+      else if (token == SIGNAL_TOKEN)
+      {
+        signalfd_siginfo info;
+        while (read(signalFd_, &info, sizeof(info)) > 0)
+        {
+          std::cout << "Daemon stopping on signal " << info.ssi_signo
+                    << std::endl;
+          running_ = false;
+        }
+      }
+      else
+      {
+        // Reading also notices a hangup, after whatever came before it
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLIN))
+          readClient(token);
+        if (events[i].events & EPOLLOUT)
+          resumeWrites(token);
+      }
+    }
+
+    flushClients();
+  }
+
+  shutdown();
+}
+
+void DaemonServer::stop()
+{
+  running_ = false;
+  wakeup();
+}
+
+size_t DaemonServer::clientCount()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return clients_.size();
+}
+
+void DaemonServer::acceptClients()
+{
+  while (true)
+  {
+    int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        std::cerr << "Daemon accept failed: " << std::strerror(errno)
+                  << std::endl;
+      }
+      return;
+    }
+
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id              = nextClientId_++;
+      clients_[id].fd = fd;
+    }
+
+    epoll_event event = {};
+    event.events      = EPOLLIN;
+    event.data.u64    = id;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+// Only this thread inserts or erases clients, so the entry found here stays
+// put while its inbox, which no other thread touches, is filled and parsed
+void DaemonServer::readClient(uint64_t id)
+{
+  Client* client;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = clients_.find(id);
+    if (it == clients_.end())
+      return;
+    client = &it->second;
+  }
+
+  bool    closed = false;
+  uint8_t buffer[16 * 1024];
+  while (true)
+  {
+    ssize_t received = recv(client->fd, buffer, sizeof(buffer), 0);
+    if (received > 0)
+    {
+      client->inbox.insert(client->inbox.end(), buffer, buffer + received);
+      continue;
+    }
+    if (received < 0 && errno == EINTR)
+      continue;
+    closed = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    break;
+  }
+
+  std::vector<uint8_t>& inbox    = client->inbox;
+  size_t                consumed = 0;
+  while (inbox.size() - consumed >= FRAME_LENGTH_SIZE)
+  {
+    DaemonFrameReader header(inbox.data() + consumed, FRAME_LENGTH_SIZE);
+    uint32_t          length;
+    header.u32(length);
+    if (length == 0 || length > DAEMON_MAX_FRAME)
+    {
+      std::cerr << "Client " << id << " sent a bad frame length " << length
+                << std::endl;
+      closed = true;
+      break;
+    }
+    if (inbox.size() - consumed - FRAME_LENGTH_SIZE < length)
+      break;
+
+    if (!handleFrame(
+          id, inbox.data() + consumed + FRAME_LENGTH_SIZE, length))
+    {
+      closed = true;
+      break;
+    }
+    consumed += FRAME_LENGTH_SIZE + length;
+  }
+  inbox.erase(inbox.begin(), inbox.begin() + consumed);
+
+  if (closed)
+    closeClient(id);
+}
+
+void DaemonServer::closeClient(uint64_t id)
+{
+  int                fd;
+  uint64_t           dropped;
+  std::set<uint32_t> subscriptions;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = clients_.find(id);
+    if (it == clients_.end())
+      return;
+
+    fd            = it->second.fd;
+    dropped       = it->second.dropped;
+    subscriptions = it->second.subscriptions;
+    for (uint32_t handle : subscriptions)
+      subscribers_[handle].erase(id);
+    clients_.erase(it);
+  }
+
+  if (fd >= 0)
+  {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+  }
+
+  if (dropped > 0)
+  {
+    std::cerr << "Client " << id << " fell behind, " << dropped
+              << " notifications dropped" << std::endl;
+  }
+
+  for (uint32_t handle : subscriptions)
+    post([this, handle]() { releaseIfUnused(handle); });
+}
+
+// Parses one request and hands the BlueZ part to the worker. Returns false
+// only for frames too broken to answer, which drops the client.
+bool DaemonServer::handleFrame(uint64_t       id,
+                               const uint8_t* frame,
+                               size_t         length)
+{
+  DaemonMessage     type = static_cast<DaemonMessage>(frame[0]);
+  DaemonFrameReader reader(frame + 1, length - 1);
+  uint32_t          requestId;
+  if (!reader.u32(requestId))
+    return false;
+
+  auto reject = [&](DaemonStatus status) {
+    respond(id, response(type, requestId, status).finish());
+    return true;
+  };
+
+  std::string path;
+  switch (type)
+  {
+    case DaemonMessage::Connect:
+    case DaemonMessage::Disconnect:
+      if (!reader.string(path))
+        return reject(DaemonStatus::BadRequest);
+      post([this, id, requestId, type, path]() {
+        bool connected = type == DaemonMessage::Connect
+                           ? manager_.connectToDevice(path)
+                           : manager_.disconnectFromDevice(path);
+        if (connected && type == DaemonMessage::Connect)
+          restoreNotifications(path);
+        respond(id, response(type, requestId, statusFor(connected)).finish());
+      });
+      return true;
+
+    case DaemonMessage::Read:
+      if (!reader.string(path))
+        return reject(DaemonStatus::BadRequest);
+      post([this, id, requestId, path]() {
+        uint8_t value[NOTIFICATION_MAX_PAYLOAD];
+        ssize_t valueLength =
+          manager_.readCharacteristic(path, value, sizeof(value));
+        DaemonFrameWriter writer = response(
+          DaemonMessage::Read, requestId, statusFor(valueLength >= 0));
+        if (valueLength >= 0)
+          writer.bytes(value, static_cast<size_t>(valueLength));
+        respond(id, writer.finish());
+      });
+      return true;
+
+    case DaemonMessage::Write:
+    {
+      uint8_t        writeType;
+      const uint8_t* data;
+      size_t         dataLength;
+      if (!reader.string(path) || !reader.u8(writeType) ||
+          writeType > static_cast<uint8_t>(WriteType::Command) ||
+          !reader.bytes(data, dataLength))
+        return reject(DaemonStatus::BadRequest);
+
+      std::vector<uint8_t> value(data, data + dataLength);
+      post([this, id, requestId, path, writeType, value]() {
+        bool written = manager_.writeCharacteristic(
+          path, value, static_cast<WriteType>(writeType));
+        respond(id,
+                response(DaemonMessage::Write, requestId, statusFor(written))
+                  .finish());
+      });
+      return true;
+    }
+
+    case DaemonMessage::Subscribe:
+    {
+      uint8_t mode;
+      if (!reader.string(path) || !reader.u8(mode) ||
+          mode > static_cast<uint8_t>(NotificationMode::AcquireNotify))
+        return reject(DaemonStatus::BadRequest);
+      post([this, id, requestId, path, mode]() {
+        subscribe(id, requestId, path, static_cast<NotificationMode>(mode));
+      });
+      return true;
+    }
+
+    case DaemonMessage::Unsubscribe:
+      if (!reader.string(path))
+        return reject(DaemonStatus::BadRequest);
+      post([this, id, requestId, path]() {
+        // A path nobody subscribed to is not worth a handle
+        uint32_t handle = manager_.findCharacteristicHandle(path);
+        if (handle != ObjectPathTable::INVALID_HANDLE)
+          unsubscribe(id, handle);
+        respond(
+          id,
+          response(DaemonMessage::Unsubscribe, requestId, DaemonStatus::Ok)
+            .finish());
+      });
+      return true;
+
+    case DaemonMessage::ListDevices:
+      post([this, id, requestId]() {
+        std::vector<BluetoothDevice> devices = manager_.getAllDevices();
+        DaemonFrameWriter            writer =
+          response(DaemonMessage::ListDevices, requestId, DaemonStatus::Ok);
+        writer.u16(static_cast<uint16_t>(
+          std::min<size_t>(devices.size(), UINT16_MAX)));
+        for (size_t i = 0; i < devices.size() && i < UINT16_MAX; i++)
+        {
+          writer.string(devices[i].path);
+          writer.string(devices[i].address);
+          writer.string(devices[i].name);
+          writer.u8(devices[i].connected ? 1 : 0);
+        }
+        respond(id, writer.finish());
+      });
+      return true;
+
+    case DaemonMessage::Scan:
+    {
+      uint16_t seconds;
+      if (!reader.u16(seconds))
+        return reject(DaemonStatus::BadRequest);
+      post([this, id, requestId, seconds]() { scan(id, requestId, seconds); });
+      return true;
+    }
+
+    default:
+      return reject(DaemonStatus::Unknown);
+  }
+}
+
+void DaemonServer::flushClients()
+{
+  std::vector<uint64_t> failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : clients_)
+    {
+      Client& client = entry.second;
+      if (client.writable && client.outboxSent < client.outbox.size())
+        flushClient(entry.first, client);
+      if (client.fd < 0)
+        failed.push_back(entry.first);
+    }
+  }
+
+  for (uint64_t id : failed)
+    closeClient(id);
+}
+
+// Writes as much of the outbox as the socket takes. When it fills up the
+// client waits for EPOLLOUT; on a hard error its fd is closed and set to -1
+// for flushClients() to drop it. Called with mutex_ held.
+void DaemonServer::flushClient(uint64_t id, Client& client)
+{
+  while (client.outboxSent < client.outbox.size())
+  {
+    ssize_t sent = send(client.fd,
+                        client.outbox.data() + client.outboxSent,
+                        client.outbox.size() - client.outboxSent,
+                        MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      client.outboxSent += static_cast<size_t>(sent);
+      continue;
+    }
+    if (sent < 0 && errno == EINTR)
+      continue;
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      client.writable   = false;
+      epoll_event event = {};
+      event.events      = EPOLLIN | EPOLLOUT;
+      event.data.u64    = id;
+      epoll_ctl(epollFd_, EPOLL_CTL_MOD, client.fd, &event);
+      break;
+    }
+
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, client.fd, nullptr);
+    close(client.fd);
+    client.fd = -1;
+    return;
+  }
+
+  if (client.outboxSent == client.outbox.size())
+  {
+    client.outbox.clear();
+    client.outboxSent = 0;
+  }
+  else if (client.outboxSent >= CLIENT_OUTBOX_LIMIT / 4)
+  {
+    // Keep a slow client's outbox from only ever growing at the back
+    client.outbox.erase(client.outbox.begin(),
+                        client.outbox.begin() + client.outboxSent);
+    client.outboxSent = 0;
+  }
+}
+
+void DaemonServer::resumeWrites(uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto                        it = clients_.find(id);
+  if (it == clients_.end() || it->second.writable)
+    return;
+
+  it->second.writable = true;
+  epoll_event event   = {};
+  event.events        = EPOLLIN;
+  event.data.u64      = id;
+  epoll_ctl(epollFd_, EPOLL_CTL_MOD, it->second.fd, &event);
+}
+
+void DaemonServer::post(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> lock(jobMutex_);
+    jobs_.push_back(std::move(job));
+  }
+  jobReady_.notify_one();
+}
+
+void DaemonServer::runJobs()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(jobMutex_);
+      auto ready = [this]() { return workerStopping_ || !jobs_.empty(); };
+      if (!scanning_)
+      {
+        jobReady_.wait(lock, ready);
+      }
+      else if (!jobReady_.wait_until(lock, scanUntil_, ready))
+      {
+        lock.unlock();
+        stopScan();
+        continue;
+      }
+      if (workerStopping_)
+        return;
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    job();
+  }
+}
+
+void DaemonServer::respond(uint64_t id, const std::vector<uint8_t>& frame)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = clients_.find(id);
+    if (it == clients_.end())
+      return;
+    std::vector<uint8_t>& outbox = it->second.outbox;
+    outbox.insert(outbox.end(), frame.begin(), frame.end());
+  }
+  wakeup();
+}
+
+void DaemonServer::wakeup()
+{
+  if (wakeupFd_ < 0 || wakeupPending_.exchange(true))
+    return;
+
+  uint64_t value = 1;
+  if (write(wakeupFd_, &value, sizeof(value)) < 0 && errno != EAGAIN)
+  {
+    std::cerr << "Failed to wake daemon loop" << std::endl;
+  }
+}
+
+// Runs on the worker, which is the only thread enabling or disabling
+// notifications, so enabled_ needs no lock
+void DaemonServer::subscribe(uint64_t           id,
+                             uint32_t           requestId,
+                             const std::string& path,
+                             NotificationMode   mode)
+{
+  // Untrusted paths are only looked up; the manager hands out a handle once
+  // BlueZ has accepted the subscription
+  uint32_t handle = manager_.findCharacteristicHandle(path);
+  bool     enabled =
+    enabled_.count(handle) > 0 && manager_.isNotifying(handle);
+  if (!enabled && manager_.enableNotifications(path, mode))
+  {
+    handle           = manager_.internCharacteristicPath(path);
+    enabled_[handle] = mode;
+    enabled          = true;
+  }
+
+  DaemonFrameWriter writer =
+    response(DaemonMessage::Subscribe, requestId, statusFor(enabled));
+  if (enabled)
+    writer.u32(handle);
+  const std::vector<uint8_t>& frame = writer.finish();
+
+  // The response is queued in the same section that adds the subscriber,
+  // so the client never sees a value tagged with a handle it was not given
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = clients_.find(id);
+    if (it != clients_.end())
+    {
+      if (enabled)
+      {
+        it->second.subscriptions.insert(handle);
+        subscribers_[handle].insert(id);
+      }
+      std::vector<uint8_t>& outbox = it->second.outbox;
+      outbox.insert(outbox.end(), frame.begin(), frame.end());
+    }
+  }
+  wakeup();
+
+  // The client may have gone while BlueZ was answering
+  releaseIfUnused(handle);
+}
+
+void DaemonServer::unsubscribe(uint64_t id, uint32_t handle)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = clients_.find(id);
+    if (it != clients_.end())
+      it->second.subscriptions.erase(handle);
+    subscribers_[handle].erase(id);
+  }
+  releaseIfUnused(handle);
+}
+
+// Runs on the worker. Discovery is left on and runJobs() turns it off at
+// the deadline, so a long scan holds up neither other requests nor stop().
+void DaemonServer::scan(uint64_t id, uint32_t requestId, uint16_t seconds)
+{
+  bool started = scanning_ || manager_.startDiscovery();
+  if (started)
+  {
+    scanning_  = true;
+    scanUntil_ = std::chrono::steady_clock::now() +
+                 std::chrono::seconds(seconds);
+  }
+  respond(id,
+          response(DaemonMessage::Scan, requestId, statusFor(started))
+            .finish());
+}
+
+void DaemonServer::stopScan()
+{
+  scanning_ = false;
+  manager_.stopDiscovery();
+}
+
+void DaemonServer::releaseIfUnused(uint32_t handle)
+{
+  if (enabled_.count(handle) == 0)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = subscribers_.find(handle);
+    if (it != subscribers_.end() && !it->second.empty())
+      return;
+    subscribers_.erase(handle);
+  }
+
+  enabled_.erase(handle);
+  if (manager_.isNotifying(handle))
+    manager_.disableNotifications(manager_.getCharacteristicPath(handle));
+}
+
+// Runs on the worker after a Connect. Dropping the link stopped every
+// subscription on the device, but its subscribers are still attached.
+void DaemonServer::restoreNotifications(const std::string& devicePath)
+{
+  std::string prefix = devicePath + "/";
+  for (const auto& entry : enabled_)
+  {
+    std::string path = manager_.getCharacteristicPath(entry.first);
+    if (path.compare(0, prefix.size(), prefix) == 0 &&
+        !manager_.isNotifying(entry.first))
+      manager_.enableNotifications(path, entry.second);
+  }
+}
+
+// Called on the manager's bus thread for every value. The frame is built
+// once and copied into each subscriber's outbox; the socket thread does the
+// writes.
+void DaemonServer::fanOut(const NotificationHeader& header,
+                          const uint8_t*            data)
+{
+  thread_local DaemonFrameWriter writer(DaemonMessage::Notification);
+  writer.reset(DaemonMessage::Notification);
+  writer.u32(header.handle);
+  writer.u64(header.timestampNs);
+  writer.u64(header.sequence);
+  writer.bytes(data, header.length);
+  const std::vector<uint8_t>& frame = writer.finish();
+
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = subscribers_.find(header.handle);
+    if (it == subscribers_.end())
+      return;
+
+    for (uint64_t id : it->second)
+    {
+      auto clientIt = clients_.find(id);
+      if (clientIt == clients_.end())
+        continue;
+
+      Client& client = clientIt->second;
+      if (client.outbox.size() - client.outboxSent + frame.size() >
+          CLIENT_OUTBOX_LIMIT)
+      {
+        client.dropped++;
+        continue;
+      }
+      client.outbox.insert(client.outbox.end(), frame.begin(), frame.end());
+      queued = true;
+    }
+  }
+
+  if (queued)
+    wakeup();
+}
+
+void DaemonServer::shutdown()
+{
+  // Returns once a fanOut() in progress on the bus thread has finished
+  manager_.setNotificationRecordCallback(nullptr);
+
+  if (worker_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(jobMutex_);
+      workerStopping_ = true;
+      jobs_.clear();
+    }
+    jobReady_.notify_one();
+    worker_.join();
+  }
+
+  if (scanning_)
+    stopScan();
+
+  // One BlueZ subscription per characteristic, however many clients had it
+  for (const auto& entry : enabled_)
+  {
+    uint32_t handle = entry.first;
+    if (manager_.isNotifying(handle))
+      manager_.disableNotifications(manager_.getCharacteristicPath(handle));
+  }
+  enabled_.clear();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.clear();
+    for (auto& entry : clients_)
+    {
+      if (entry.second.fd >= 0)
+        close(entry.second.fd);
+    }
+    clients_.clear();
+  }
+
+  if (listenFd_ >= 0)
+  {
+    close(listenFd_);
+    listenFd_ = -1;
+    if (!socketPath_.empty())
+      unlink(socketPath_.c_str());
+    socketPath_.clear();
+  }
+
+  for (int* fd : {&signalFd_, &wakeupFd_, &epollFd_})
+  {
+    if (*fd >= 0)
+    {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+}
\ No newline at end of file
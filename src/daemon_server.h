@@ -0,0 +1,219 @@
+#ifndef DAEMON_SERVER_H
+#define DAEMON_SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bluetooth_manager.h"
+
+// Wire protocol between the daemon and its clients. Every frame is
+//
+//   uint32 length   bytes that follow this field
+//   uint8  type     DaemonMessage
+//   ...             body
+//
+// Requests carry a uint32 id first, which the response echoes followed by
+// a DaemonStatus. Integers are little-endian; strings and byte arrays are
+// a uint16 length followed by the bytes.
+//
+//   Request body                              Response body after id/status
+//   Connect      string devicePath            -
+//   Disconnect   string devicePath            -
+//   Read         string charPath              bytes value
+//   Write        string charPath, u8 type,    -
+//                bytes value                    (type as WriteType)
+//   Subscribe    string charPath, u8 mode     u32 handle
+//                  (mode as NotificationMode)
+//   Unsubscribe  string charPath              -
+//   ListDevices  -                            u16 count, then per device:
+//                                               string path, string address,
+//                                               string name, u8 connected
+//   Scan         u16 seconds                  -
+//
+// Scan answers as soon as discovery is on and turns it off after the given
+// number of seconds; a Scan during a scan moves that deadline.
+//
+// Notifications are pushed to subscribers without a request:
+//
+//   Notification u32 handle, u64 timestampNs, u64 sequence, bytes value
+//
+// handle is the one the Subscribe response returned for that path.
+enum class DaemonMessage : uint8_t
+{
+  Connect      = 0x01,
+  Disconnect   = 0x02,
+  Read         = 0x03,
+  Write        = 0x04,
+  Subscribe    = 0x05,
+  Unsubscribe  = 0x06,
+  ListDevices  = 0x07,
+  Scan         = 0x08,
+  Notification = 0x40,
+  Response     = 0x80  // OR'd with the request type
+};
+
+enum class DaemonStatus : uint8_t
+{
+  Ok         = 0,
+  Failed     = 1,  // BlueZ refused or the call timed out
+  BadRequest = 2,  // Body did not parse
+  Unknown    = 3   // Unsupported message type
+};
+
+// Largest frame either side accepts, length field excluded
+const size_t DAEMON_MAX_FRAME = 64 * 1024;
+
+// Builds one frame; the length is filled in by finish()
+class DaemonFrameWriter
+{
+public:
+  explicit DaemonFrameWriter(DaemonMessage type);
+
+  void u8(uint8_t value);
+  void u16(uint16_t value);
+  void u32(uint32_t value);
+  void u64(uint64_t value);
+  void string(const std::string& value);
+  void bytes(const uint8_t* data, size_t length);
+
+  const std::vector<uint8_t>& finish();
+
+  // Reuses the buffer for another frame
+  void reset(DaemonMessage type);
+
+private:
+  std::vector<uint8_t> frame_;
+};
+
+// Reads the body of one frame; every getter fails once the body runs out
+class DaemonFrameReader
+{
+public:
+  DaemonFrameReader(const uint8_t* body, size_t length);
+
+  bool u8(uint8_t& value);
+  bool u16(uint16_t& value);
+  bool u32(uint32_t& value);
+  bool u64(uint64_t& value);
+  bool string(std::string& value);
+  bool bytes(const uint8_t*& data, size_t& length);
+
+private:
+  const uint8_t* body_;
+  size_t         length_;
+  size_t         offset_ = 0;
+
+  bool take(void* out, size_t count);
+};
+
+// Headless front end for a BluetoothManager. Local clients connect to a
+// Unix stream socket and send requests framed as above. Socket I/O runs on
+// the thread calling run(); requests that talk to BlueZ run one at a time
+// on a worker thread, so a slow Connect never stalls other clients'
+// notifications. A characteristic is enabled in BlueZ once, when its first
+// subscriber arrives, and every value is encoded once and queued to each
+// subscriber. A client that stops reading loses notifications, counted per
+// client, rather than holding up the others. Subscriptions outlive the
+// link: what BlueZ stopped is enabled again when the device is connected
+// through the daemon or the characteristic is subscribed again.
+class DaemonServer
+{
+public:
+  explicit DaemonServer(BluetoothManager& manager);
+  ~DaemonServer();
+
+  DaemonServer(const DaemonServer&)            = delete;
+  DaemonServer& operator=(const DaemonServer&) = delete;
+
+  // Blocks SIGINT and SIGTERM so run() can take them as events. Call before
+  // any thread is started, i.e. before BluetoothManager::initialize().
+  static bool blockTerminationSignals();
+
+  bool listen(const std::string& socketPath);
+
+  // Serves clients until stop() or a termination signal
+  void run();
+  void stop();
+
+  size_t clientCount();
+
+private:
+  struct Client
+  {
+    int                  fd = -1;
+    std::vector<uint8_t> inbox;
+    std::vector<uint8_t> outbox;
+    size_t               outboxSent = 0;
+    bool                 writable   = true;  // Not waiting for EPOLLOUT
+    std::set<uint32_t>   subscriptions;
+    uint64_t             dropped = 0;  // Notifications past the outbox limit
+  };
+
+  BluetoothManager& manager_;
+  std::string       socketPath_;
+  int               listenFd_ = -1;
+  int               epollFd_  = -1;
+  int               wakeupFd_ = -1;
+  int               signalFd_ = -1;
+  std::atomic<bool> running_{false};
+  std::atomic<bool> wakeupPending_{false};
+
+  // Clients and subscriptions, shared by the socket thread, the worker and
+  // the bus thread delivering notifications. Never held across a BlueZ call.
+  std::mutex                             mutex_;
+  uint64_t                               nextClientId_ = 1;
+  std::map<uint64_t, Client>             clients_;
+  std::map<uint32_t, std::set<uint64_t>> subscribers_;  // handle -> clients
+
+  // BlueZ work, run in order on the worker thread
+  std::thread                       worker_;
+  std::mutex                        jobMutex_;
+  std::condition_variable           jobReady_;
+  std::deque<std::function<void()>> jobs_;
+  bool                              workerStopping_ = false;
+
+  // Characteristics with subscribers, and the mode they were enabled in,
+  // and discovery started by Scan; only the worker touches them. BlueZ may
+  // have stopped notifying since, so ask the manager before trusting it.
+  std::map<uint32_t, NotificationMode>  enabled_;
+  bool                                  scanning_ = false;
+  std::chrono::steady_clock::time_point scanUntil_;
+
+  void acceptClients();
+  void readClient(uint64_t id);
+  void closeClient(uint64_t id);
+  bool handleFrame(uint64_t id, const uint8_t* frame, size_t length);
+  void flushClients();
+  void flushClient(uint64_t id, Client& client);
+  void resumeWrites(uint64_t id);
+
+  void post(std::function<void()> job);
+  void runJobs();
+  void respond(uint64_t id, const std::vector<uint8_t>& frame);
+  void wakeup();
+
+  void subscribe(uint64_t           id,
+                 uint32_t           requestId,
+                 const std::string& path,
+                 NotificationMode   mode);
+  void unsubscribe(uint64_t id, uint32_t handle);
+  void releaseIfUnused(uint32_t handle);
+  void restoreNotifications(const std::string& devicePath);
+  void scan(uint64_t id, uint32_t requestId, uint16_t seconds);
+  void stopScan();
+  void fanOut(const NotificationHeader& header, const uint8_t* data);
+
+  void shutdown();
+};
+
+#endif  // DAEMON_SERVER_H
\ No newline at end of file
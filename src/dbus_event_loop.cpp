@@ -0,0 +1,441 @@
+#include "dbus_event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+
+const int MAX_EPOLL_EVENTS = 16;
+
+DBusEventLoop::DBusEventLoop()
+{
+}
+
+DBusEventLoop::~DBusEventLoop()
+{
+  stop();
+}
+
+bool DBusEventLoop::start(DBusConnection* connection)
+{
+  if (running_ || !connection)
+    return false;
+
+  epollFd_  = epoll_create1(EPOLL_CLOEXEC);
+  wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epollFd_ < 0 || wakeupFd_ < 0)
+  {
+    std::cerr << "Failed to create event loop descriptors" << std::endl;
+    stop();
+    return false;
+  }
+
+  epoll_event event = {};
+  event.events      = EPOLLIN;
+  event.data.fd     = wakeupFd_;
+  epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeupFd_, &event);
+
+  connection_ = connection;
+  running_    = true;
+
+  if (!dbus_connection_set_watch_functions(connection_,
+                                           &DBusEventLoop::addWatch,
+                                           &DBusEventLoop::removeWatch,
+                                           &DBusEventLoop::toggleWatch,
+                                           this,
+                                           nullptr) ||
+      !dbus_connection_set_timeout_functions(connection_,
+                                             &DBusEventLoop::addTimeout,
+                                             &DBusEventLoop::removeTimeout,
+                                             &DBusEventLoop::toggleTimeout,
+                                             this,
+                                             nullptr))
+  {
+    std::cerr << "Failed to install D-Bus watch functions" << std::endl;
+    running_ = false;
+    stop();
+    return false;
+  }
+
+  dbus_connection_set_dispatch_status_function(
+    connection_, &DBusEventLoop::dispatchStatusChanged, this, nullptr);
+  dbus_connection_set_wakeup_main_function(
+    connection_, &DBusEventLoop::wakeupMain, this, nullptr);
+
+  thread_ = std::thread(&DBusEventLoop::run, this);
+
+  // Messages may already be queued from before the loop took over
+  wakeup();
+  return true;
+}
+
+void DBusEventLoop::stop()
+{
+  if (running_)
+  {
+    running_ = false;
+    wakeup();
+  }
+
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+
+  if (connection_)
+  {
+    dbus_connection_set_dispatch_status_function(
+      connection_, nullptr, nullptr, nullptr);
+    dbus_connection_set_wakeup_main_function(
+      connection_, nullptr, nullptr, nullptr);
+    dbus_connection_set_watch_functions(
+      connection_, nullptr, nullptr, nullptr, nullptr, nullptr);
+    dbus_connection_set_timeout_functions(
+      connection_, nullptr, nullptr, nullptr, nullptr, nullptr);
+    connection_ = nullptr;
+  }
+
+  if (wakeupFd_ >= 0)
+  {
+    close(wakeupFd_);
+    wakeupFd_ = -1;
+  }
+  if (epollFd_ >= 0)
+  {
+    close(epollFd_);
+    epollFd_ = -1;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  watches_.clear();
+  timeouts_.clear();
+  fdCallbacks_.clear();
+}
+
+bool DBusEventLoop::isRunning() const
+{
+  return running_;
+}
+
+bool DBusEventLoop::addFd(int fd, std::function<void()> onReadable)
+{
+  if (!running_)
+    return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  epoll_event event = {};
+  event.events      = EPOLLIN;
+  event.data.fd     = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) < 0)
+    return false;
+
+  fdCallbacks_[fd] = std::move(onReadable);
+  return true;
+}
+
+void DBusEventLoop::removeFd(int fd)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (fdCallbacks_.erase(fd) && epollFd_ >= 0)
+  {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  // A callback removing its own fd is the running one and cannot wait
+  if (std::this_thread::get_id() != thread_.get_id())
+  {
+    callbackDone_.wait(lock, [this, fd]() { return callbackFd_ != fd; });
+  }
+}
+
+void DBusEventLoop::wakeup()
+{
+  if (wakeupFd_ < 0)
+    return;
+
+  uint64_t value = 1;
+  ssize_t  ret   = write(wakeupFd_, &value, sizeof(value));
+  (void)ret;
+}
+
+void DBusEventLoop::run()
+{
+  epoll_event events[MAX_EPOLL_EVENTS];
+
+  while (running_)
+  {
+    int count = epoll_wait(epollFd_, events, MAX_EPOLL_EVENTS, nextTimeoutMs());
+    if (count < 0 && errno != EINTR)
+    {
+      std::cerr << "Event loop epoll_wait failed" << std::endl;
+      break;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      int fd = events[i].data.fd;
+
+      if (fd == wakeupFd_)
+      {
+        uint64_t value;
+        ssize_t  ret = read(wakeupFd_, &value, sizeof(value));
+        (void)ret;
+        continue;
+      }
+
+      std::function<void()> callback;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        it = fdCallbacks_.find(fd);
+        if (it != fdCallbacks_.end())
+        {
+          callback    = it->second;
+          callbackFd_ = fd;
+        }
+      }
+
+      if (callback)
+      {
+        callback();
+
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          callbackFd_ = -1;
+        }
+        callbackDone_.notify_all();
+      }
+      else
+      {
+        handleWatches(fd, events[i].events);
+      }
+    }
+
+    handleTimeouts();
+    dispatch();
+  }
+}
+
+void DBusEventLoop::updateWatchFd(int fd)
+{
+  uint32_t events = 0;
+  auto     it     = watches_.find(fd);
+
+  if (it != watches_.end())
+  {
+    for (DBusWatch* watch : it->second)
+    {
+      if (!dbus_watch_get_enabled(watch))
+        continue;
+
+      unsigned int flags = dbus_watch_get_flags(watch);
+      if (flags & DBUS_WATCH_READABLE)
+        events |= EPOLLIN;
+      if (flags & DBUS_WATCH_WRITABLE)
+        events |= EPOLLOUT;
+    }
+  }
+
+  if (events == 0)
+  {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    return;
+  }
+
+  epoll_event event = {};
+  event.events      = events;
+  event.data.fd     = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event) < 0 && errno == ENOENT)
+  {
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+int DBusEventLoop::nextTimeoutMs()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (timeouts_.empty())
+    return -1;
+
+  auto now     = std::chrono::steady_clock::now();
+  auto nearest = std::chrono::steady_clock::time_point::max();
+  for (const auto& timeoutPair : timeouts_)
+  {
+    if (dbus_timeout_get_enabled(timeoutPair.first) &&
+        timeoutPair.second < nearest)
+    {
+      nearest = timeoutPair.second;
+    }
+  }
+
+  if (nearest == std::chrono::steady_clock::time_point::max())
+    return -1;
+  if (nearest <= now)
+    return 0;
+
+  // Round up so we never wake just before the deadline and spin
+  auto remaining =
+    std::chrono::duration_cast<std::chrono::milliseconds>(nearest - now);
+  return static_cast<int>(remaining.count()) + 1;
+}
+
+void DBusEventLoop::handleWatches(int fd, uint32_t events)
+{
+  std::vector<DBusWatch*> watches;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        it = watches_.find(fd);
+    if (it == watches_.end())
+      return;
+    watches = it->second;
+  }
+
+  for (DBusWatch* watch : watches)
+  {
+    if (!dbus_watch_get_enabled(watch))
+      continue;
+
+    unsigned int wanted = dbus_watch_get_flags(watch);
+    unsigned int flags  = 0;
+    if ((events & EPOLLIN) && (wanted & DBUS_WATCH_READABLE))
+      flags |= DBUS_WATCH_READABLE;
+    if ((events & EPOLLOUT) && (wanted & DBUS_WATCH_WRITABLE))
+      flags |= DBUS_WATCH_WRITABLE;
+    if (events & EPOLLERR)
+      flags |= DBUS_WATCH_ERROR;
+    if (events & EPOLLHUP)
+      flags |= DBUS_WATCH_HANGUP;
+
+    if (flags)
+    {
+      dbus_watch_handle(watch, flags);
+    }
+  }
+}
+
+void DBusEventLoop::handleTimeouts()
+{
+  std::vector<DBusTimeout*> expired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto                        now = std::chrono::steady_clock::now();
+    for (auto& timeoutPair : timeouts_)
+    {
+      if (dbus_timeout_get_enabled(timeoutPair.first) &&
+          timeoutPair.second <= now)
+      {
+        expired.push_back(timeoutPair.first);
+        // libdbus timeouts repeat until they are removed or disabled
+        timeoutPair.second =
+          now + std::chrono::milliseconds(
+                  dbus_timeout_get_interval(timeoutPair.first));
+      }
+    }
+  }
+
+  for (DBusTimeout* timeout : expired)
+  {
+    dbus_timeout_handle(timeout);
+  }
+}
+
+void DBusEventLoop::dispatch()
+{
+  while (dbus_connection_get_dispatch_status(connection_) ==
+         DBUS_DISPATCH_DATA_REMAINS)
+  {
+    dbus_connection_dispatch(connection_);
+  }
+}
+
+dbus_bool_t DBusEventLoop::addWatch(DBusWatch* watch, void* data)
+{
+  auto*                       self = static_cast<DBusEventLoop*>(data);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+
+  int fd = dbus_watch_get_unix_fd(watch);
+  self->watches_[fd].push_back(watch);
+  self->updateWatchFd(fd);
+  return TRUE;
+}
+
+void DBusEventLoop::removeWatch(DBusWatch* watch, void* data)
+{
+  auto*                       self = static_cast<DBusEventLoop*>(data);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+
+  int  fd = dbus_watch_get_unix_fd(watch);
+  auto it = self->watches_.find(fd);
+  if (it == self->watches_.end())
+    return;
+
+  auto& watches = it->second;
+  for (auto watchIt = watches.begin(); watchIt != watches.end(); ++watchIt)
+  {
+    if (*watchIt == watch)
+    {
+      watches.erase(watchIt);
+      break;
+    }
+  }
+
+  self->updateWatchFd(fd);
+  if (watches.empty())
+  {
+    self->watches_.erase(it);
+  }
+}
+
+void DBusEventLoop::toggleWatch(DBusWatch* watch, void* data)
+{
+  auto*                       self = static_cast<DBusEventLoop*>(data);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+
+  self->updateWatchFd(dbus_watch_get_unix_fd(watch));
+}
+
+dbus_bool_t DBusEventLoop::addTimeout(DBusTimeout* timeout, void* data)
+{
+  auto* self = static_cast<DBusEventLoop*>(data);
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->timeouts_[timeout] =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(dbus_timeout_get_interval(timeout));
+  }
+
+  self->wakeup();
+  return TRUE;
+}
+
+void DBusEventLoop::removeTimeout(DBusTimeout* timeout, void* data)
+{
+  auto*                       self = static_cast<DBusEventLoop*>(data);
+  std::lock_guard<std::mutex> lock(self->mutex_);
+
+  self->timeouts_.erase(timeout);
+}
+
+void DBusEventLoop::toggleTimeout(DBusTimeout* timeout, void* data)
+{
+  addTimeout(timeout, data);
+}
+
+void DBusEventLoop::dispatchStatusChanged(DBusConnection*    connection,
+                                          DBusDispatchStatus status,
+                                          void*              data)
+{
+  (void)connection;
+  if (status == DBUS_DISPATCH_DATA_REMAINS)
+  {
+    static_cast<DBusEventLoop*>(data)->wakeup();
+  }
+}
+
+void DBusEventLoop::wakeupMain(void* data)
+{
+  static_cast<DBusEventLoop*>(data)->wakeup();
+}
\ No newline at end of file
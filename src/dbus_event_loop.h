@@ -0,0 +1,71 @@
+#ifndef DBUS_EVENT_LOOP_H
+#define DBUS_EVENT_LOOP_H
+
+#include <dbus/dbus.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Services a D-Bus connection from its own thread. libdbus watches and
+// timeouts are mapped onto an epoll set, and an eventfd wakes the loop
+// whenever another thread queues work, so messages are dispatched as soon
+// as they arrive instead of whenever the foreground thread polls.
+class DBusEventLoop
+{
+public:
+  DBusEventLoop();
+  ~DBusEventLoop();
+
+  bool start(DBusConnection* connection);
+  void stop();
+  bool isRunning() const;
+
+  // Extra descriptors serviced on the loop thread, e.g. AcquireNotify
+  // sockets. The callback runs on the loop thread when the fd is readable.
+  // removeFd() waits for a callback already running for fd, so the caller
+  // may close it as soon as removeFd() returns.
+  bool addFd(int fd, std::function<void()> onReadable);
+  void removeFd(int fd);
+
+  void wakeup();
+
+private:
+  DBusConnection*   connection_ = nullptr;
+  int               epollFd_    = -1;
+  int               wakeupFd_   = -1;
+  std::thread       thread_;
+  std::atomic<bool> running_{false};
+
+  std::mutex                                      mutex_;
+  std::map<int, std::vector<DBusWatch*>>          watches_;
+  std::map<DBusTimeout*,
+           std::chrono::steady_clock::time_point> timeouts_;
+  std::map<int, std::function<void()>>            fdCallbacks_;
+  int                                             callbackFd_ = -1;
+  std::condition_variable                         callbackDone_;
+
+  void run();
+  void updateWatchFd(int fd);
+  int  nextTimeoutMs();
+  void handleWatches(int fd, uint32_t events);
+  void handleTimeouts();
+  void dispatch();
+
+  static dbus_bool_t addWatch(DBusWatch* watch, void* data);
+  static void        removeWatch(DBusWatch* watch, void* data);
+  static void        toggleWatch(DBusWatch* watch, void* data);
+  static dbus_bool_t addTimeout(DBusTimeout* timeout, void* data);
+  static void        removeTimeout(DBusTimeout* timeout, void* data);
+  static void        toggleTimeout(DBusTimeout* timeout, void* data);
+  static void        dispatchStatusChanged(DBusConnection*    connection,
+                                           DBusDispatchStatus status,
+                                           void*              data);
+  static void        wakeupMain(void* data);
+};
+
+#endif  // DBUS_EVENT_LOOP_H
\ No newline at end of file
@@ -1,8 +1,82 @@
 #include "dbus_helper.h"
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 
-DBusHelper::DBusHelper() : connection(nullptr)
+DBusPendingReply::DBusPendingReply(DBusPendingCall* call, MethodStats* stats)
+  : pending(call), stats(stats)
+{
+}
+
+DBusPendingReply::~DBusPendingReply()
+{
+  if (pending)
+  {
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+  }
+}
+
+DBusPendingReply::DBusPendingReply(DBusPendingReply&& other) noexcept
+  : pending(other.pending), stats(other.stats)
+{
+  other.pending = nullptr;
+}
+
+DBusPendingReply& DBusPendingReply::operator=(DBusPendingReply&& other) noexcept
+{
+  if (this != &other)
+  {
+    if (pending)
+    {
+      dbus_pending_call_cancel(pending);
+      dbus_pending_call_unref(pending);
+    }
+    pending       = other.pending;
+    stats         = other.stats;
+    other.pending = nullptr;
+  }
+  return *this;
+}
+
+bool DBusPendingReply::valid() const
+{
+  return pending != nullptr;
+}
+
+bool DBusPendingReply::ready() const
+{
+  return pending && dbus_pending_call_get_completed(pending);
+}
+
+DBusMessage* DBusPendingReply::wait()
+{
+  if (!pending)
+    return nullptr;
+
+  dbus_pending_call_block(pending);
+  DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+  pending = nullptr;
+
+  if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+  {
+    DBusError error;
+    dbus_error_init(&error);
+    dbus_set_error_from_message(&error, reply);
+    std::cerr << "D-Bus error: " << error.message << std::endl;
+    if (stats)
+      stats->recordError(error.name);
+    dbus_error_free(&error);
+    dbus_message_unref(reply);
+    return nullptr;
+  }
+
+  return reply;
+}
+
+DBusHelper::DBusHelper() : connection(nullptr), privateConnection(false)
 {
   initError();
 }
@@ -26,17 +100,45 @@ void DBusHelper::checkError()
   }
 }
 
-bool DBusHelper::connect()
+bool DBusHelper::connect(const std::string& address)
 {
-  connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+  // The connection is serviced from an event loop thread while other
+  // threads make calls, so libdbus must do its own locking
+  dbus_threads_init_default();
+
+  if (address.empty())
+  {
+    connection = dbus_bus_get(DBUS_BUS_SYSTEM, &error);
+    checkError();
+
+    if (!connection)
+    {
+      std::cerr << "Failed to connect to D-Bus system bus" << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  // Any other bus, typically a private dbus-daemon hosting a mock BlueZ.
+  // dbus_bus_get only knows the well-known buses, so open and register
+  // the connection ourselves.
+  connection = dbus_connection_open_private(address.c_str(), &error);
+  if (connection && !dbus_bus_register(connection, &error))
+  {
+    dbus_connection_close(connection);
+    dbus_connection_unref(connection);
+    connection = nullptr;
+  }
   checkError();
 
   if (!connection)
   {
-    std::cerr << "Failed to connect to D-Bus system bus" << std::endl;
+    std::cerr << "Failed to connect to D-Bus at " << address << std::endl;
     return false;
   }
 
+  privateConnection = true;
   return true;
 }
 
@@ -44,19 +146,40 @@ void DBusHelper::disconnect()
 {
   if (connection)
   {
+    if (privateConnection)
+      dbus_connection_close(connection);
     dbus_connection_unref(connection);
-    connection = nullptr;
+    connection        = nullptr;
+    privateConnection = false;
   }
+
+  std::lock_guard<std::mutex> lock(matchMutex);
+  matchRules.clear();
 }
 
-DBusMessage* DBusHelper::callMethod(const std::string& service,
-                                    const std::string& path,
-                                    const std::string& interface,
-                                    const std::string& method)
+DBusConnection* DBusHelper::getConnection() const
 {
-  if (!connection)
-    return nullptr;
+  return connection;
+}
+
+CallMetrics& DBusHelper::getCallMetrics()
+{
+  return metrics;
+}
+
+MethodStats* DBusHelper::statsFor(DBusMessage* msg)
+{
+  return metrics.find(dbus_message_get_interface(msg),
+                      dbus_message_get_member(msg));
+}
 
+DBusMessage* DBusHelper::newMethodCall(
+  const std::string&                service,
+  const std::string&                path,
+  const std::string&                interface,
+  const std::string&                method,
+  std::function<void(DBusMessage*)> appendArgs)
+{
   DBusMessage* msg = dbus_message_new_method_call(
     service.c_str(), path.c_str(), interface.c_str(), method.c_str());
 
@@ -66,16 +189,117 @@ DBusMessage* DBusHelper::callMethod(const std::string& service,
     return nullptr;
   }
 
+  if (appendArgs)
+  {
+    appendArgs(msg);
+  }
+
+  return msg;
+}
+
+DBusMessage* DBusHelper::callMethod(const std::string& service,
+                                    const std::string& path,
+                                    const std::string& interface,
+                                    const std::string& method)
+{
+  return callMethodWithArgs(service, path, interface, method, nullptr);
+}
+
+DBusMessage* DBusHelper::callMethodWithArgs(
+  const std::string&                service,
+  const std::string&                path,
+  const std::string&                interface,
+  const std::string&                method,
+  std::function<void(DBusMessage*)> appendArgs)
+{
+  if (!connection)
+    return nullptr;
+
+  DBusMessage* msg =
+    newMethodCall(service, path, interface, method, std::move(appendArgs));
+  if (!msg)
+    return nullptr;
+
+  MethodStats* stats = statsFor(msg);
+  auto         start = std::chrono::steady_clock::now();
   DBusMessage* reply = dbus_connection_send_with_reply_and_block(
     connection, msg, DBUS_TIMEOUT_USE_DEFAULT, &error);
 
+  stats->recordLatency(start);
+  if (dbus_error_is_set(&error))
+    stats->recordError(error.name);
+
   dbus_message_unref(msg);
   checkError();
 
   return reply;
 }
 
-DBusMessage* DBusHelper::callMethodWithArgs(
+// Send time of a call collected through DBusPendingReply. The latency is
+// taken when libdbus completes the call, not when the caller gets round to
+// wait(), which may be much later.
+struct ReplyTimer
+{
+  MethodStats*                          stats;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<bool>                     recorded{false};
+};
+
+static void recordReplyLatency(DBusPendingCall*, void* data)
+{
+  auto* timer = static_cast<ReplyTimer*>(data);
+  if (!timer->recorded.exchange(true))
+    timer->stats->recordLatency(timer->start);
+}
+
+static void freeReplyTimer(void* data)
+{
+  delete static_cast<ReplyTimer*>(data);
+}
+
+DBusPendingReply DBusHelper::sendAsync(DBusMessage* msg)
+{
+  DBusPendingCall* pending = nullptr;
+  MethodStats*     stats   = statsFor(msg);
+  auto*            timer   = new ReplyTimer;
+  timer->stats             = stats;
+  timer->start             = std::chrono::steady_clock::now();
+
+  if (!dbus_connection_send_with_reply(
+        connection, msg, &pending, DBUS_TIMEOUT_USE_DEFAULT) ||
+      !pending)
+  {
+    std::cerr << "Failed to send D-Bus message" << std::endl;
+    stats->recordError(nullptr);
+    delete timer;
+    dbus_message_unref(msg);
+    return DBusPendingReply();
+  }
+  dbus_message_unref(msg);
+
+  if (!dbus_pending_call_set_notify(
+        pending, &recordReplyLatency, timer, &freeReplyTimer))
+  {
+    delete timer;
+  }
+  else if (dbus_pending_call_get_completed(pending))
+  {
+    // libdbus skips the notify for calls that completed before it was set
+    recordReplyLatency(pending, timer);
+  }
+
+  return DBusPendingReply(pending, stats);
+}
+
+DBusPendingReply DBusHelper::callMethodAsync(const std::string& service,
+                                             const std::string& path,
+                                             const std::string& interface,
+                                             const std::string& method)
+{
+  return callMethodWithArgsAsync(service, path, interface, method, nullptr);
+}
+
+DBusPendingReply DBusHelper::callMethodWithArgsAsync(
   const std::string&                service,
   const std::string&                path,
   const std::string&                interface,
@@ -83,29 +307,137 @@ DBusMessage* DBusHelper::callMethodWithArgs(
   std::function<void(DBusMessage*)> appendArgs)
 {
   if (!connection)
-    return nullptr;
-
-  DBusMessage* msg = dbus_message_new_method_call(
-    service.c_str(), path.c_str(), interface.c_str(), method.c_str());
+    return DBusPendingReply();
 
+  DBusMessage* msg =
+    newMethodCall(service, path, interface, method, std::move(appendArgs));
   if (!msg)
+    return DBusPendingReply();
+
+  return sendAsync(msg);
+}
+
+// State shared between libdbus' notify callback and the sending thread,
+// which may find the call already completed before the notify is installed
+struct ReplyHandler
+{
+  std::function<void(DBusMessage*)>     onReply;
+  MethodStats*                          stats;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<bool>                     handled{false};
+};
+
+static void handlePendingReply(DBusPendingCall* pending, void* data)
+{
+  auto* handler = static_cast<ReplyHandler*>(data);
+  if (handler->handled.exchange(true))
+    return;
+
+  handler->stats->recordLatency(handler->start);
+
+  DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+  if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
   {
-    std::cerr << "Failed to create D-Bus message" << std::endl;
-    return nullptr;
+    DBusError error;
+    dbus_error_init(&error);
+    dbus_set_error_from_message(&error, reply);
+    std::cerr << "D-Bus error: " << error.message << std::endl;
+    handler->stats->recordError(error.name);
+    dbus_error_free(&error);
+    dbus_message_unref(reply);
+    reply = nullptr;
   }
 
-  if (appendArgs)
+  if (handler->onReply)
   {
-    appendArgs(msg);
+    handler->onReply(reply);
   }
 
-  DBusMessage* reply = dbus_connection_send_with_reply_and_block(
-    connection, msg, DBUS_TIMEOUT_USE_DEFAULT, &error);
+  if (reply)
+  {
+    dbus_message_unref(reply);
+  }
+}
+
+static void freeReplyHandler(void* data)
+{
+  delete static_cast<ReplyHandler*>(data);
+}
+
+bool DBusHelper::callMethodWithReplyHandler(
+  const std::string&                service,
+  const std::string&                path,
+  const std::string&                interface,
+  const std::string&                method,
+  std::function<void(DBusMessage*)> appendArgs,
+  std::function<void(DBusMessage*)> onReply)
+{
+  if (!connection)
+    return false;
 
+  DBusMessage* msg =
+    newMethodCall(service, path, interface, method, std::move(appendArgs));
+  if (!msg)
+    return false;
+
+  MethodStats* stats = statsFor(msg);
+  auto         start = std::chrono::steady_clock::now();
+
+  DBusPendingCall* pending = nullptr;
+  if (!dbus_connection_send_with_reply(
+        connection, msg, &pending, DBUS_TIMEOUT_USE_DEFAULT) ||
+      !pending)
+  {
+    std::cerr << "Failed to send D-Bus message" << std::endl;
+    stats->recordError(nullptr);
+    dbus_message_unref(msg);
+    return false;
+  }
   dbus_message_unref(msg);
-  checkError();
 
-  return reply;
+  auto* handler    = new ReplyHandler;
+  handler->onReply = std::move(onReply);
+  handler->stats   = stats;
+  handler->start   = start;
+  if (!dbus_pending_call_set_notify(
+        pending, &handlePendingReply, handler, &freeReplyHandler))
+  {
+    delete handler;
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+    return false;
+  }
+
+  // libdbus does not run the notify for calls that completed before it was
+  // installed, so pick those up here; the handled flag stops a double call
+  if (dbus_pending_call_get_completed(pending))
+  {
+    handlePendingReply(pending, handler);
+  }
+
+  dbus_pending_call_unref(pending);
+  return true;
+}
+
+DBusPendingReply DBusHelper::getPropertyAsync(const std::string& service,
+                                              const std::string& path,
+                                              const std::string& interface,
+                                              const std::string& property)
+{
+  return callMethodWithArgsAsync(service,
+                                 path,
+                                 "org.freedesktop.DBus.Properties",
+                                 "Get",
+                                 [&](DBusMessage* msg) {
+                                   const char* iface = interface.c_str();
+                                   const char* prop  = property.c_str();
+                                   dbus_message_append_args(msg,
+                                                            DBUS_TYPE_STRING,
+                                                            &iface,
+                                                            DBUS_TYPE_STRING,
+                                                            &prop,
+                                                            DBUS_TYPE_INVALID);
+                                 });
 }
 
 bool DBusHelper::addSignalMatch(const std::string& rule)
@@ -113,10 +445,32 @@ bool DBusHelper::addSignalMatch(const std::string& rule)
   if (!connection)
     return false;
 
-  dbus_bus_add_match(connection, rule.c_str(), &error);
-  checkError();
+  // Held across the round trip so a concurrent add of the same rule does
+  // not return before the daemon has it
+  std::lock_guard<std::mutex> lock(matchMutex);
+
+  int& refs = matchRules[rule];
+  if (refs > 0)
+  {
+    refs++;
+    return true;
+  }
 
-  return !dbus_error_is_set(&error);
+  // Local error: this may run on any thread
+  DBusError matchError;
+  dbus_error_init(&matchError);
+  dbus_bus_add_match(connection, rule.c_str(), &matchError);
+  if (dbus_error_is_set(&matchError))
+  {
+    std::cerr << "Failed to add match rule " << rule << ": "
+              << matchError.message << std::endl;
+    dbus_error_free(&matchError);
+    matchRules.erase(rule);
+    return false;
+  }
+
+  refs = 1;
+  return true;
 }
 
 void DBusHelper::removeSignalMatch(const std::string& rule)
@@ -124,8 +478,41 @@ void DBusHelper::removeSignalMatch(const std::string& rule)
   if (!connection)
     return;
 
-  dbus_bus_remove_match(connection, rule.c_str(), &error);
-  checkError();
+  std::lock_guard<std::mutex> lock(matchMutex);
+
+  auto it = matchRules.find(rule);
+  if (it == matchRules.end())
+    return;
+  if (--it->second > 0)
+    return;
+  matchRules.erase(it);
+
+  // Without an error argument the removal is queued and not waited for
+  dbus_bus_remove_match(connection, rule.c_str(), nullptr);
+}
+
+size_t DBusHelper::getSignalMatchCount()
+{
+  std::lock_guard<std::mutex> lock(matchMutex);
+  return matchRules.size();
+}
+
+bool DBusHelper::addMessageFilter(DBusHandleMessageFunction filter,
+                                  void*                     userData)
+{
+  if (!connection)
+    return false;
+
+  return dbus_connection_add_filter(connection, filter, userData, nullptr);
+}
+
+void DBusHelper::removeMessageFilter(DBusHandleMessageFunction filter,
+                                     void*                     userData)
+{
+  if (!connection)
+    return;
+
+  dbus_connection_remove_filter(connection, filter, userData);
 }
 
 void DBusHelper::processMessages(int timeoutMs)
@@ -136,46 +523,29 @@ void DBusHelper::processMessages(int timeoutMs)
   dbus_connection_read_write_dispatch(connection, timeoutMs);
 }
 
+int DBusHelper::getUnixFd() const
+{
+  int fd = -1;
+  if (!connection || !dbus_connection_get_unix_fd(connection, &fd))
+    return -1;
+
+  return fd;
+}
+
 std::string DBusHelper::getStringProperty(const std::string& service,
                                           const std::string& path,
                                           const std::string& interface,
                                           const std::string& property)
 {
   DBusMessage* reply =
-    callMethodWithArgs(service,
-                       path,
-                       "org.freedesktop.DBus.Properties",
-                       "Get",
-                       [&](DBusMessage* msg) {
-                         const char* iface = interface.c_str();
-                         const char* prop  = property.c_str();
-                         dbus_message_append_args(msg,
-                                                  DBUS_TYPE_STRING,
-                                                  &iface,
-                                                  DBUS_TYPE_STRING,
-                                                  &prop,
-                                                  DBUS_TYPE_INVALID);
-                       });
+    getPropertyAsync(service, path, interface, property).wait();
 
   if (!reply)
     return "";
 
-  DBusMessageIter iter, variant_iter;
-  if (dbus_message_iter_init(reply, &iter) &&
-      dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
-  {
-    dbus_message_iter_recurse(&iter, &variant_iter);
-    if (dbus_message_iter_get_arg_type(&variant_iter) == DBUS_TYPE_STRING)
-    {
-      const char* value;
-      dbus_message_iter_get_basic(&variant_iter, &value);
-      dbus_message_unref(reply);
-      return std::string(value);
-    }
-  }
-
+  std::string value = readStringVariant(reply);
   dbus_message_unref(reply);
-  return "";
+  return value;
 }
 
 bool DBusHelper::getBoolProperty(const std::string& service,
@@ -184,40 +554,114 @@ bool DBusHelper::getBoolProperty(const std::string& service,
                                  const std::string& property)
 {
   DBusMessage* reply =
-    callMethodWithArgs(service,
-                       path,
-                       "org.freedesktop.DBus.Properties",
-                       "Get",
-                       [&](DBusMessage* msg) {
-                         const char* iface = interface.c_str();
-                         const char* prop  = property.c_str();
-                         dbus_message_append_args(msg,
-                                                  DBUS_TYPE_STRING,
-                                                  &iface,
-                                                  DBUS_TYPE_STRING,
-                                                  &prop,
-                                                  DBUS_TYPE_INVALID);
-                       });
+    getPropertyAsync(service, path, interface, property).wait();
 
   if (!reply)
     return false;
 
-  DBusMessageIter iter, variant_iter;
+  bool value = readBoolVariant(reply);
+  dbus_message_unref(reply);
+  return value;
+}
+
+std::string DBusHelper::readStringVariant(DBusMessage* reply)
+{
+  DBusMessageIter  iter;
+  std::string_view value;
   if (dbus_message_iter_init(reply, &iter) &&
-      dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
+      dbus_decode::readVariant(&iter, value))
+    return std::string(value);
+
+  return "";
+}
+
+bool DBusHelper::readBoolVariant(DBusMessage* reply)
+{
+  DBusMessageIter iter;
+  bool            value = false;
+  if (dbus_message_iter_init(reply, &iter))
   {
-    dbus_message_iter_recurse(&iter, &variant_iter);
-    if (dbus_message_iter_get_arg_type(&variant_iter) == DBUS_TYPE_BOOLEAN)
-    {
-      dbus_bool_t value;
-      dbus_message_iter_get_basic(&variant_iter, &value);
-      dbus_message_unref(reply);
-      return value;
-    }
+    dbus_decode::readVariant(&iter, value);
   }
 
-  dbus_message_unref(reply);
-  return false;
+  return value;
+}
+
+bool DBusHelper::appendByteArray(DBusMessageIter* iter,
+                                 const uint8_t*   data,
+                                 size_t           length)
+{
+  DBusMessageIter array_iter;
+  if (!dbus_message_iter_open_container(
+        iter, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE_AS_STRING, &array_iter))
+    return false;
+
+  // libdbus wants a pointer to the element pointer for fixed arrays
+  bool appended = dbus_message_iter_append_fixed_array(
+    &array_iter, DBUS_TYPE_BYTE, &data, static_cast<int>(length));
+
+  return dbus_message_iter_close_container(iter, &array_iter) && appended;
+}
+
+bool DBusHelper::readByteArray(DBusMessageIter* iter,
+                               const uint8_t*&  data,
+                               size_t&          length)
+{
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(iter) != DBUS_TYPE_BYTE)
+    return false;
+
+  DBusMessageIter array_iter;
+  int             count = 0;
+  dbus_message_iter_recurse(iter, &array_iter);
+  dbus_message_iter_get_fixed_array(&array_iter, &data, &count);
+
+  length = static_cast<size_t>(count);
+  return true;
+}
+
+bool DBusHelper::appendDictEntry(DBusMessageIter* dict_iter,
+                                 const char*      key,
+                                 int              type,
+                                 const void*      value)
+{
+  DBusMessageIter entry_iter, variant_iter;
+  char            signature[2] = {static_cast<char>(type), '\0'};
+
+  return dbus_message_iter_open_container(
+           dict_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &entry_iter) &&
+         dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key) &&
+         dbus_message_iter_open_container(
+           &entry_iter, DBUS_TYPE_VARIANT, signature, &variant_iter) &&
+         dbus_message_iter_append_basic(&variant_iter, type, value) &&
+         dbus_message_iter_close_container(&entry_iter, &variant_iter) &&
+         dbus_message_iter_close_container(dict_iter, &entry_iter);
+}
+
+bool DBusHelper::appendDictEntry(DBusMessageIter*                dict_iter,
+                                 const char*                     key,
+                                 const std::vector<std::string>& values)
+{
+  DBusMessageIter entry_iter, variant_iter, array_iter;
+
+  if (!dbus_message_iter_open_container(
+        dict_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &entry_iter) ||
+      !dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &key) ||
+      !dbus_message_iter_open_container(
+        &entry_iter, DBUS_TYPE_VARIANT, "as", &variant_iter) ||
+      !dbus_message_iter_open_container(
+        &variant_iter, DBUS_TYPE_ARRAY, "s", &array_iter))
+    return false;
+
+  for (const auto& value : values)
+  {
+    const char* str = value.c_str();
+    dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_STRING, &str);
+  }
+
+  return dbus_message_iter_close_container(&variant_iter, &array_iter) &&
+         dbus_message_iter_close_container(&entry_iter, &variant_iter) &&
+         dbus_message_iter_close_container(dict_iter, &entry_iter);
 }
 
 void DBusHelper::setProperty(const std::string& service,
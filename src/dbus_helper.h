@@ -1,21 +1,62 @@
 #ifndef DBUS_HELPER_H
 #define DBUS_HELPER_H
 
+#include "call_metrics.h"
 #include <dbus/dbus.h>
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Completion handle for a method call sent with DBusHelper's async API.
+// Many calls can be in flight at once; wait() collects a single reply.
+class DBusPendingReply
+{
+public:
+  DBusPendingReply() = default;
+  explicit DBusPendingReply(DBusPendingCall* call,
+                            MethodStats*     stats = nullptr);
+  ~DBusPendingReply();
+
+  DBusPendingReply(DBusPendingReply&& other) noexcept;
+  DBusPendingReply& operator=(DBusPendingReply&& other) noexcept;
+  DBusPendingReply(const DBusPendingReply&)            = delete;
+  DBusPendingReply& operator=(const DBusPendingReply&) = delete;
+
+  bool valid() const;
+  bool ready() const;
+
+  // Blocks until the reply arrives. Returns nullptr on failure or error
+  // reply, otherwise a message the caller must unref.
+  DBusMessage* wait();
+
+private:
+  DBusPendingCall* pending = nullptr;
+  MethodStats*     stats   = nullptr;  // Counts an error reply on wait()
+};
+
 class DBusHelper
 {
 public:
   DBusHelper();
   ~DBusHelper();
 
-  bool connect();
+  // Connects to the system bus, or to the bus at a D-Bus address such as
+  // "unix:path=/tmp/test-bus" when one is given
+  bool connect(const std::string& address = "");
   void disconnect();
 
+  DBusConnection* getConnection() const;
+
+  // Latency and error counts per (interface, method) of every call made
+  // through this helper, from send to reply
+  CallMetrics& getCallMetrics();
+
   // D-Bus method calling
   DBusMessage* callMethod(const std::string& service,
                           const std::string& path,
@@ -28,12 +69,48 @@ public:
                                   const std::string&                method,
                                   std::function<void(DBusMessage*)> appendArgs);
 
-  // Signal handling
-  bool addSignalMatch(const std::string& rule);
-  void removeSignalMatch(const std::string& rule);
+  // Asynchronous method calling. The message is queued and a handle is
+  // returned immediately so callers can keep many requests in flight.
+  DBusPendingReply callMethodAsync(const std::string& service,
+                                   const std::string& path,
+                                   const std::string& interface,
+                                   const std::string& method);
+
+  DBusPendingReply callMethodWithArgsAsync(
+    const std::string&                service,
+    const std::string&                path,
+    const std::string&                interface,
+    const std::string&                method,
+    std::function<void(DBusMessage*)> appendArgs);
+
+  // Sends a method call and runs onReply on the dispatching thread once the
+  // reply arrives. onReply receives nullptr if the call failed.
+  bool callMethodWithReplyHandler(
+    const std::string&                service,
+    const std::string&                path,
+    const std::string&                interface,
+    const std::string&                method,
+    std::function<void(DBusMessage*)> appendArgs,
+    std::function<void(DBusMessage*)> onReply);
+
+  DBusPendingReply getPropertyAsync(const std::string& service,
+                                    const std::string& path,
+                                    const std::string& interface,
+                                    const std::string& property);
+
+  // Signal handling. Match rules are reference counted, so independent
+  // users of one rule can add and remove it freely; only the first add and
+  // the last remove reach the bus daemon. Removal does not wait for the
+  // daemon and is safe from the dispatching thread.
+  bool   addSignalMatch(const std::string& rule);
+  void   removeSignalMatch(const std::string& rule);
+  size_t getSignalMatchCount();
+  bool addMessageFilter(DBusHandleMessageFunction filter, void* userData);
+  void removeMessageFilter(DBusHandleMessageFunction filter, void* userData);
 
   // Message processing
   void processMessages(int timeoutMs = 1000);
+  int  getUnixFd() const;
 
   // Property getting/setting
   std::string getStringProperty(const std::string& service,
@@ -52,12 +129,280 @@ public:
                    const std::string& property,
                    const std::string& value);
 
+  // Decode the variant returned by Properties.Get. The reply is not unref'd.
+  static std::string readStringVariant(DBusMessage* reply);
+  static bool        readBoolVariant(DBusMessage* reply);
+
+  // Byte arrays ("ay") are marshalled as one block instead of per element.
+  // readByteArray points into the message, so the bytes are only valid
+  // until it is unref'd.
+  static bool appendByteArray(DBusMessageIter* iter,
+                              const uint8_t*   data,
+                              size_t           length);
+  static bool readByteArray(DBusMessageIter* iter,
+                            const uint8_t*&  data,
+                            size_t&          length);
+
+  // Append one entry to an open "a{sv}" container, e.g. a method's options
+  // dict. The first form wraps a basic value of the given D-Bus type.
+  static bool appendDictEntry(DBusMessageIter* dict_iter,
+                              const char*      key,
+                              int              type,
+                              const void*      value);
+  static bool appendDictEntry(DBusMessageIter*                dict_iter,
+                              const char*                     key,
+                              const std::vector<std::string>& values);
+
 private:
   DBusConnection* connection;
+  bool            privateConnection;  // Ours to close, not libdbus' shared one
   DBusError       error;
 
+  std::mutex                 matchMutex;
+  std::map<std::string, int> matchRules;  // Rule -> reference count
+
+  CallMetrics metrics;
+
+  DBusMessage* newMethodCall(const std::string&                service,
+                             const std::string&                path,
+                             const std::string&                interface,
+                             const std::string&                method,
+                             std::function<void(DBusMessage*)> appendArgs);
+  DBusPendingReply sendAsync(DBusMessage* msg);
+  MethodStats*     statsFor(DBusMessage* msg);
+
   void initError();
   void checkError();
 };
 
+// Zero-allocation decoding of received messages. Values are read in place:
+// strings come back as std::string_view and byte arrays as ByteView, both
+// pointing into the message buffer and valid only while the message is
+// referenced, so callers copy just the fields they keep. C++ types map onto
+// D-Bus type codes at compile time, and containers are walked with visitors
+// that may return false to stop early.
+namespace dbus_decode
+{
+// "o", kept apart from std::string_view, which also accepts "s" and "g"
+struct ObjectPath
+{
+  std::string_view value;
+};
+
+// "ay"
+struct ByteView
+{
+  const uint8_t* data = nullptr;
+  size_t         size = 0;
+};
+
+template <typename T>
+struct TypeCode;
+
+#define DBUS_DECODE_TYPE_CODE(CppType, WireType, Code)                         \
+  template <>                                                                  \
+  struct TypeCode<CppType>                                                     \
+  {                                                                            \
+    using Wire                = WireType;                                      \
+    static constexpr int code = Code;                                          \
+  };
+
+DBUS_DECODE_TYPE_CODE(bool, dbus_bool_t, DBUS_TYPE_BOOLEAN)
+DBUS_DECODE_TYPE_CODE(uint8_t, uint8_t, DBUS_TYPE_BYTE)
+DBUS_DECODE_TYPE_CODE(int16_t, dbus_int16_t, DBUS_TYPE_INT16)
+DBUS_DECODE_TYPE_CODE(uint16_t, dbus_uint16_t, DBUS_TYPE_UINT16)
+DBUS_DECODE_TYPE_CODE(int32_t, dbus_int32_t, DBUS_TYPE_INT32)
+DBUS_DECODE_TYPE_CODE(uint32_t, dbus_uint32_t, DBUS_TYPE_UINT32)
+DBUS_DECODE_TYPE_CODE(int64_t, dbus_int64_t, DBUS_TYPE_INT64)
+DBUS_DECODE_TYPE_CODE(uint64_t, dbus_uint64_t, DBUS_TYPE_UINT64)
+DBUS_DECODE_TYPE_CODE(double, double, DBUS_TYPE_DOUBLE)
+
+#undef DBUS_DECODE_TYPE_CODE
+
+// Reads the value at iter if its type matches T. The iterator is not moved.
+template <typename T>
+inline bool read(DBusMessageIter* iter, T& value)
+{
+  if (dbus_message_iter_get_arg_type(iter) != TypeCode<T>::code)
+    return false;
+
+  typename TypeCode<T>::Wire wire;
+  dbus_message_iter_get_basic(iter, &wire);
+  value = static_cast<T>(wire);
+  return true;
+}
+
+inline bool read(DBusMessageIter* iter, std::string_view& value)
+{
+  int type = dbus_message_iter_get_arg_type(iter);
+  if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH &&
+      type != DBUS_TYPE_SIGNATURE)
+    return false;
+
+  const char* str;
+  dbus_message_iter_get_basic(iter, &str);
+  value = str;
+  return true;
+}
+
+inline bool read(DBusMessageIter* iter, ObjectPath& value)
+{
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_OBJECT_PATH)
+    return false;
+
+  const char* str;
+  dbus_message_iter_get_basic(iter, &str);
+  value.value = str;
+  return true;
+}
+
+inline bool read(DBusMessageIter* iter, ByteView& value)
+{
+  return DBusHelper::readByteArray(iter, value.data, value.size);
+}
+
+// Reads consecutive values, e.g. the "oa{sa{sv}}" of InterfacesAdded, and
+// leaves iter on the first one not read
+template <typename... T>
+inline bool readArgs(DBusMessageIter* iter, T&... values)
+{
+  return ((read(iter, values) ? (dbus_message_iter_next(iter), true) : false) &&
+          ...);
+}
+
+// Reads a "(...)" struct member by member
+template <typename... T>
+inline bool readStruct(DBusMessageIter* iter, T&... values)
+{
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRUCT)
+    return false;
+
+  DBusMessageIter struct_iter;
+  dbus_message_iter_recurse(iter, &struct_iter);
+  return readArgs(&struct_iter, values...);
+}
+
+template <typename T>
+inline bool readVariant(DBusMessageIter* iter, T& value)
+{
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+    return false;
+
+  DBusMessageIter variant_iter;
+  dbus_message_iter_recurse(iter, &variant_iter);
+  return read(&variant_iter, value);
+}
+
+namespace detail
+{
+// Visitors may return void, or bool where false stops the walk
+template <typename Visitor, typename... Args>
+inline bool visit(Visitor& visitor, Args&&... args)
+{
+  if constexpr (std::is_void_v<std::invoke_result_t<Visitor&, Args...>>)
+  {
+    visitor(std::forward<Args>(args)...);
+    return true;
+  }
+  else
+  {
+    return visitor(std::forward<Args>(args)...);
+  }
+}
+}  // namespace detail
+
+// Calls visitor(DBusMessageIter*) for each element of the array at iter
+template <typename Visitor>
+inline bool forEachElement(DBusMessageIter* iter, Visitor&& visitor)
+{
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+    return false;
+
+  DBusMessageIter element_iter;
+  dbus_message_iter_recurse(iter, &element_iter);
+  while (dbus_message_iter_get_arg_type(&element_iter) != DBUS_TYPE_INVALID)
+  {
+    if (!detail::visit(visitor, &element_iter))
+      break;
+    dbus_message_iter_next(&element_iter);
+  }
+  return true;
+}
+
+// Calls visitor(T) for each element of an array of basic values such as
+// "as"; elements of another type are skipped
+template <typename T, typename Visitor>
+inline bool forEach(DBusMessageIter* iter, Visitor&& visitor)
+{
+  return forEachElement(iter, [&](DBusMessageIter* element_iter) {
+    T value;
+    if (!read(element_iter, value))
+      return true;
+    return detail::visit(visitor, value);
+  });
+}
+
+// Calls visitor(K key, DBusMessageIter* value) for each entry of a dict
+template <typename K, typename Visitor>
+inline bool forEachDictEntry(DBusMessageIter* iter, Visitor&& visitor)
+{
+  return forEachElement(iter, [&](DBusMessageIter* element_iter) {
+    if (dbus_message_iter_get_arg_type(element_iter) != DBUS_TYPE_DICT_ENTRY)
+      return true;
+
+    DBusMessageIter entry_iter;
+    K               key;
+    dbus_message_iter_recurse(element_iter, &entry_iter);
+    if (!read(&entry_iter, key))
+      return true;
+
+    dbus_message_iter_next(&entry_iter);
+    return detail::visit(visitor, key, &entry_iter);
+  });
+}
+
+// "a{sv}": calls visitor(std::string_view name, DBusMessageIter* value)
+// with value already inside the variant
+template <typename Visitor>
+inline bool forEachProperty(DBusMessageIter* iter, Visitor&& visitor)
+{
+  return forEachDictEntry<std::string_view>(
+    iter, [&](std::string_view name, DBusMessageIter* value_iter) {
+      if (dbus_message_iter_get_arg_type(value_iter) != DBUS_TYPE_VARIANT)
+        return true;
+
+      DBusMessageIter variant_iter;
+      dbus_message_iter_recurse(value_iter, &variant_iter);
+      return detail::visit(visitor, name, &variant_iter);
+    });
+}
+
+// "a{sa{sv}}": calls visitor(std::string_view interface,
+// DBusMessageIter* properties) with properties on the "a{sv}"
+template <typename Visitor>
+inline bool forEachInterface(DBusMessageIter* iter, Visitor&& visitor)
+{
+  return forEachDictEntry<std::string_view>(iter, visitor);
+}
+
+// "a{oa{sa{sv}}}" as returned by GetManagedObjects: calls
+// visitor(std::string_view path, std::string_view interface,
+// DBusMessageIter* properties) once per interface of every object
+template <typename Visitor>
+inline bool forEachManagedObject(DBusMessageIter* iter, Visitor&& visitor)
+{
+  bool more = true;
+  return forEachDictEntry<ObjectPath>(
+    iter, [&](ObjectPath path, DBusMessageIter* interfaces_iter) {
+      forEachInterface(
+        interfaces_iter,
+        [&](std::string_view interface, DBusMessageIter* props_iter) {
+          more = detail::visit(visitor, path.value, interface, props_iter);
+          return more;
+        });
+      return more;
+    });
+}
+}  // namespace dbus_decode
+
 #endif  // DBUS_HELPER_H
\ No newline at end of file
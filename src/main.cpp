@@ -1,3 +1,4 @@
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <iomanip>
@@ -5,6 +6,9 @@
 #include <sstream>
 #include <thread>
 #include "bluetooth_manager.h"
+#include "daemon_server.h"
+#include "notification_recorder.h"
+#include "notification_replay.h"
 
 const uint32_t    SCAN_SECONDS                    = 5;
 const std::string BM_DATA_CTL_SERVICE_UUID_32_BIT = "15451545";
@@ -62,7 +66,7 @@ void printHexData(const std::vector<uint8_t>& data)
     if (i < data.size() - 1)
       std::cout << " ";
   }
-  std::cout << std::dec << std::endl;
+  std::cout << std::dec << "\n";
 }
 
 std::vector<uint8_t> parseHexString(const std::string& hexStr)
@@ -123,23 +127,323 @@ int getUserChoice(int maxChoice)
   return choice;
 }
 
-int main()
+// Characteristics of every connected device
+std::vector<std::string> connectedCharacteristicPaths(BluetoothManager& manager)
 {
+  std::vector<std::string> paths;
+  for (const auto& device : manager.getAllDevices())
+  {
+    if (!device.connected)
+      continue;
+
+    for (const auto& characteristic : manager.getCharacteristics(device.path))
+    {
+      paths.push_back(characteristic.path);
+    }
+  }
+  return paths;
+}
+
+// Receive accounting for those of the given characteristics that notified
+void printNotificationStats(BluetoothManager&               manager,
+                            const std::vector<std::string>& paths)
+{
+  for (const auto& path : paths)
+  {
+    NotificationStats stats = manager.getNotificationStats(path);
+    if (stats.received == 0)
+      continue;
+
+    std::cout << path << ": " << stats.received << " received, interval "
+              << stats.intervalMeanNs / 1000 << " us mean / "
+              << stats.intervalMaxNs / 1000 << " us max, jitter "
+              << stats.jitterNs / 1000 << " us";
+    if (stats.sequenced > 0)
+    {
+      std::cout << ", " << stats.gaps << " gaps (" << stats.missing
+                << " missing), " << stats.reordered << " reordered";
+    }
+    std::cout << std::endl;
+  }
+
+  const LatencyHistogram& latency = manager.getDeliveryLatency();
+  if (latency.count() > 0)
+  {
+    std::cout << "Queue delay: p50 " << latency.percentile(0.5) << " us, p99 "
+              << latency.percentile(0.99) << " us, max " << latency.max()
+              << " us" << std::endl;
+  }
+}
+
+// Plays a recording through the queue and callback path as if it came
+// from BlueZ, with this thread as the consumer, and reports how fast the
+// consumer kept up
+int runReplay(BluetoothManager&    manager,
+              const std::string&   prefix,
+              const ReplayOptions& options)
+{
+  uint64_t consumed = 0;
+  manager.setNotificationRecordCallback(
+    [&consumed](const std::string&, const NotificationHeader&, const uint8_t*) {
+      consumed++;
+    });
+
+  NotificationReplay replay(manager);
+  ReplayStats        stats;
+  bool               replayed = false;
+  std::atomic<bool>  done{false};
+
+  auto        start = std::chrono::steady_clock::now();
+  std::thread producer([&]() {
+    replayed = replay.run(prefix, options, stats);
+    done     = true;
+  });
+
+  while (!done)
+  {
+    manager.processNotifications();
+  }
+  producer.join();
+  manager.processNotifications();
+
+  double seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  if (!replayed)
+    return 1;
+
+  std::cout << "Replayed " << stats.records << " notifications ("
+            << stats.bytes << " bytes) from " << stats.segments
+            << " segments in " << seconds << " s; recorded over "
+            << stats.recordedSeconds << " s" << std::endl;
+  if (stats.skipped > 0)
+  {
+    std::cout << stats.skipped << " records had no characteristic path"
+              << std::endl;
+  }
+  if (stats.timeJumps > 0)
+  {
+    std::cout << "Timestamps went backwards " << stats.timeJumps
+              << " times; the schedule restarted at each" << std::endl;
+  }
+  if (options.speed > 0)
+  {
+    std::cout << "Fell at most " << stats.maxLagUs
+              << " us behind the recorded schedule" << std::endl;
+  }
+  std::cout << "Consumer: " << consumed << " notifications, "
+            << static_cast<uint64_t>(consumed / seconds) << " per second, "
+            << manager.getNotificationQueue()->overflowCount()
+            << " dropped by a full queue" << std::endl;
+
+  printNotificationStats(manager, stats.characteristicPaths);
+  return 0;
+}
+
+// Serves local clients on socketPath until SIGINT or SIGTERM. Notifications
+// are fanned out from the bus thread, so no queue is enabled here.
+int runDaemon(BluetoothManager&  manager,
+              const std::string& busAddress,
+              const std::string& socketPath)
+{
+  // Before initialize() starts the bus thread, which inherits the mask
+  if (!DaemonServer::blockTerminationSignals())
+    return 1;
+
+  DaemonServer server(manager);
+  if (!manager.initialize(busAddress) || !server.listen(socketPath))
+    return 1;
+
+  server.run();
+  return 0;
+}
+
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program
+            << " [--bus ADDRESS] [--record PREFIX] [--sequence OFFSET:WIDTH]"
+            << std::endl
+            << "       " << program
+            << " --replay PREFIX [--speed FACTOR|max] [--sequence OFFSET:WIDTH]"
+            << std::endl
+            << "       " << program << " --daemon SOCKET [--bus ADDRESS]"
+            << std::endl
+            << "  --bus ADDRESS  D-Bus address to use instead of the system "
+               "bus, e.g. unix:path=/tmp/test-bus"
+            << std::endl
+            << "  --record PREFIX  Write notifications to memory-mapped "
+               "segment files PREFIX.NNNNNN.bscmrec instead of printing them"
+            << std::endl
+            << "  --replay PREFIX  Play a recording through the notification "
+               "path without a bus and report consumer throughput"
+            << std::endl
+            << "  --speed FACTOR   Replay speed: 1 keeps the recorded timing "
+               "(default), 10 is ten times faster, max is as fast as possible"
+            << std::endl
+            << "  --daemon SOCKET  Run without the menu, serving connect, "
+               "read, write and subscribe requests on a Unix socket"
+            << std::endl
+            << "  --sequence OFFSET:WIDTH  Payloads carry a little-endian "
+               "counter of WIDTH bytes at OFFSET; count gaps in it"
+            << std::endl;
+}
+
+// Parses a positive factor or "max" for --speed
+bool parseReplaySpeed(const std::string& arg, double& speed)
+{
+  if (arg == "max")
+  {
+    speed = 0;
+    return true;
+  }
+
+  try
+  {
+    speed = std::stod(arg);
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+
+  return speed > 0;
+}
+
+// Parses "OFFSET:WIDTH" for --sequence
+bool parseSequenceField(const std::string& arg, SequenceField& field)
+{
+  size_t colon = arg.find(':');
+  if (colon == std::string::npos)
+    return false;
+
+  try
+  {
+    field.offset = std::stoul(arg.substr(0, colon));
+    field.width  = static_cast<uint8_t>(std::stoul(arg.substr(colon + 1)));
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+
+  return field.width == 1 || field.width == 2 || field.width == 4 ||
+         field.width == 8;
+}
+
+int main(int argc, char* argv[])
+{
+  std::string   busAddress;
+  std::string   recordPrefix;
+  std::string   replayPrefix;
+  std::string   daemonSocket;
+  double        replaySpeed = 1.0;
+  bool          useSequence = false;
+  SequenceField sequenceField;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--bus" && i + 1 < argc)
+    {
+      busAddress = argv[++i];
+    }
+    else if (arg == "--record" && i + 1 < argc)
+    {
+      recordPrefix = argv[++i];
+    }
+    else if (arg == "--replay" && i + 1 < argc)
+    {
+      replayPrefix = argv[++i];
+    }
+    else if (arg == "--daemon" && i + 1 < argc)
+    {
+      daemonSocket = argv[++i];
+    }
+    else if (arg == "--speed" && i + 1 < argc &&
+             parseReplaySpeed(argv[i + 1], replaySpeed))
+    {
+      i++;
+    }
+    else if (arg == "--sequence" && i + 1 < argc &&
+             parseSequenceField(argv[i + 1], sequenceField))
+    {
+      useSequence = true;
+      i++;
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
   std::cout << "=== Bluetooth Device Manager ===" << std::endl;
   std::cout << "C++ app using BlueZ over D-Bus" << std::endl << std::endl;
 
   BluetoothManager manager;
 
-  if (!manager.initialize())
+  if (!daemonSocket.empty())
+    return runDaemon(manager, busAddress, daemonSocket);
+
+  if (!replayPrefix.empty())
+  {
+    manager.enableNotificationQueue();
+    ReplayOptions replayOptions;
+    replayOptions.speed            = replaySpeed;
+    replayOptions.useSequenceField = useSequence;
+    replayOptions.sequenceField    = sequenceField;
+    return runReplay(manager, replayPrefix, replayOptions);
+  }
+
+  // Keep the bus thread free of terminal output; notifications are printed
+  // from this thread when option 8 drains the queue. A recording is written
+  // straight from the bus thread instead, so it covers the whole session
+  // rather than only the time option 8 spends draining.
+  if (recordPrefix.empty())
+    manager.enableNotificationQueue();
+
+  if (!manager.initialize(busAddress))
   {
     std::cerr << "Failed to initialize Bluetooth manager" << std::endl;
     return 1;
   }
 
+  for (const auto& adapter : manager.getAdapters())
+  {
+    std::cout << "Adapter " << adapter.path << " (" << adapter.address << ")"
+              << std::endl;
+  }
+
   // Set up notification callback
-  manager.setNotificationCallback([](const std::string&          charPath,
-                                     const std::vector<uint8_t>& data) {
-    std::cout << "\n*** NOTIFICATION from " << charPath << " ***" << std::endl;
+  // With --record, values go to the segment files instead of the terminal
+  NotificationRecorder recorder;
+  if (!recordPrefix.empty())
+  {
+    RecorderOptions recorderOptions;
+    recorderOptions.prefix = recordPrefix;
+    if (!recorder.open(recorderOptions))
+      return 1;
+    std::cout << "Recording notifications to " << recordPrefix << ".*"
+              << RECORDING_EXTENSION << std::endl;
+  }
+
+  manager.setNotificationRecordCallback([&recorder](
+                                          const std::string&        charPath,
+                                          const NotificationHeader& header,
+                                          const uint8_t*            bytes) {
+    if (recorder.isOpen())
+    {
+      recorder.append(charPath, header, bytes);
+      return;
+    }
+
+    std::vector<uint8_t> data(bytes, bytes + header.length);
+    std::cout << "\n*** NOTIFICATION #" << header.sequence << " from "
+              << charPath;
+    if (header.hasAppSequence)
+    {
+      std::cout << " (sender #" << header.appSequence << ")";
+    }
+    std::cout << " ***\n";
     std::cout << "Data: ";
     printHexData(data);
     std::cout << "ASCII: ";
@@ -154,7 +458,8 @@ int main()
         std::cout << ".";
       }
     }
-    std::cout << std::endl << std::endl;
+    // No flush per notification; a busy stream would be bound by it
+    std::cout << "\n\n";
   });
 
   while (true)
@@ -168,9 +473,10 @@ int main()
               << "6. Disconnect from device" << std::endl
               << "7. Manage characteristics" << std::endl
               << "8. Process notifications" << std::endl
+              << "9. Show D-Bus call statistics" << std::endl
               << "0. Exit" << std::endl;
 
-    int choice = getUserChoice(7);
+    int choice = getUserChoice(9);
 
     switch (choice)
     {
@@ -268,7 +574,22 @@ int main()
 
       case 5:
       {
-        auto devices = manager.getAllDevices();
+        // A device seen by several adapters is listed once; the manager
+        // picks the least-loaded adapter when connecting
+        std::vector<BluetoothDevice> devices;
+        for (const auto& device : manager.getAllDevices())
+        {
+          bool seen = false;
+          for (const auto& listed : devices)
+          {
+            seen = seen || listed.address == device.address;
+          }
+          if (!seen)
+          {
+            devices.push_back(device);
+          }
+        }
+
         if (devices.empty())
         {
           std::cout << "No devices found. Please scan first." << std::endl;
@@ -284,7 +605,7 @@ int main()
         int deviceChoice = getUserChoice(devices.size() - 1);
         if (deviceChoice >= 0)
         {
-          manager.connectToDevice(devices[deviceChoice].path);
+          manager.connectToAddress(devices[deviceChoice].address);
         }
         break;
       }
@@ -374,9 +695,15 @@ int main()
           std::cout << "2. Disable notifications" << std::endl;
           std::cout << "3. Read characteristic" << std::endl;
           std::cout << "4. Write to characteristic" << std::endl;
+          std::cout << "5. Enable notifications (AcquireNotify socket)"
+                    << std::endl;
+          std::cout << "6. Stream write to characteristic (AcquireWrite socket)"
+                    << std::endl;
+          std::cout << "7. Bulk write to characteristic (pipelined)"
+                    << std::endl;
           std::cout << "0. Back to main menu" << std::endl;
 
-          int action = getUserChoice(4);
+          int action = getUserChoice(7);
           if (action == 0)
             break;
 
@@ -390,6 +717,10 @@ int main()
           switch (action)
           {
             case 1:
+              if (useSequence)
+              {
+                manager.setSequenceField(selectedChar.path, sequenceField);
+              }
               manager.enableNotifications(selectedChar.path);
               break;
 
@@ -406,6 +737,7 @@ int main()
             }
 
             case 4:
+            case 6:
             {
               std::cout
                 << "Enter hex data to write (e.g., '01 02 03' or '010203'): ";
@@ -414,7 +746,11 @@ int main()
               std::getline(std::cin, hexInput);
 
               auto data = parseHexString(hexInput);
-              if (!data.empty())
+              if (!data.empty() && action == 6)
+              {
+                manager.writeCharacteristicStream(selectedChar.path, data);
+              }
+              else if (!data.empty())
               {
                 manager.writeCharacteristic(selectedChar.path, data);
               }
@@ -424,6 +760,48 @@ int main()
               }
               break;
             }
+
+            case 5:
+              if (useSequence)
+              {
+                manager.setSequenceField(selectedChar.path, sequenceField);
+              }
+              manager.enableNotifications(selectedChar.path,
+                                          NotificationMode::AcquireNotify);
+              break;
+
+            case 7:
+            {
+              std::cout << "Enter hex data for each write: ";
+              std::cin.ignore();
+              std::string hexInput;
+              std::getline(std::cin, hexInput);
+
+              auto data = parseHexString(hexInput);
+              if (data.empty())
+              {
+                std::cout << "Invalid hex data" << std::endl;
+                break;
+              }
+
+              std::cout << "Number of writes to send" << std::endl;
+              int count = getUserChoice(100000);
+              if (count <= 0)
+                break;
+
+              std::vector<std::vector<uint8_t>> chunks(count, data);
+              auto start = std::chrono::steady_clock::now();
+              bool ok = manager.writeCharacteristicBulk(selectedChar.path,
+                                                        chunks);
+              auto elapsed =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start);
+
+              std::cout << (ok ? "Bulk write complete" : "Bulk write failed")
+                        << " (" << count << " writes in " << elapsed.count()
+                        << " ms)" << std::endl;
+              break;
+            }
           }
         }
         break;
@@ -441,15 +819,55 @@ int main()
         while (std::chrono::steady_clock::now() < endTime)
         {
           manager.processNotifications();
-          std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
 
         std::cout << "Finished processing notifications." << std::endl;
+
+        const NotificationQueue* queue = manager.getNotificationQueue();
+        if (queue && queue->overflowCount() > 0)
+        {
+          std::cout << queue->overflowCount()
+                    << " notifications were dropped because the queue was "
+                       "full."
+                    << std::endl;
+        }
+
+        SignalStats signals = manager.getSignalStats();
+        std::cout << "Signals: " << signals.handled << " handled, "
+                  << signals.ignored << " ignored, " << signals.matchRules
+                  << " match rules installed." << std::endl;
+        printNotificationStats(manager, connectedCharacteristicPaths(manager));
+        if (recorder.isOpen())
+        {
+          std::cout << "Recorded " << recorder.recordCount()
+                    << " notifications in " << recorder.segmentCount()
+                    << " segments, " << recorder.droppedCount()
+                    << " dropped." << std::endl;
+        }
+        break;
+      }
+
+      case 9:
+      {
+        std::cout << "\n1. Text" << std::endl
+                  << "2. JSON" << std::endl
+                  << "0. Back to main menu" << std::endl;
+
+        int format = getUserChoice(2);
+        if (format <= 0)
+          break;
+
+        std::vector<MethodStatsSnapshot> stats = manager.getCallStats();
+        std::cout << std::endl
+                  << (format == 1 ? CallMetrics::formatText(stats)
+                                  : CallMetrics::formatJson(stats));
         break;
       }
 
       case 0:
         std::cout << "Exiting..." << std::endl;
+        // The bus thread may be appending to the recorder
+        manager.setNotificationRecordCallback(nullptr);
         return 0;
 
       default:
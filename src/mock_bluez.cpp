@@ -0,0 +1,1173 @@
+// Stand-in for bluetoothd on a private bus. Exports synthetic adapters,
+// devices and GATT characteristics under org.bluez and streams
+// notifications at a fixed rate, so the manager can be exercised at scale
+// without a radio.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "bluetooth_uuid.h"
+#include "dbus_helper.h"
+
+const std::string BLUEZ_SERVICE          = "org.bluez";
+const std::string ADAPTER_INTERFACE_1    = "org.bluez.Adapter1";
+const std::string DEVICE_INTERFACE_1     = "org.bluez.Device1";
+const std::string GATT_SERVICE_INTERFACE = "org.bluez.GattService1";
+const std::string GATT_CHARACTERISTIC_INTERFACE =
+  "org.bluez.GattCharacteristic1";
+const std::string PROPERTIES_INTERFACE = "org.freedesktop.DBus.Properties";
+const std::string OBJECT_MANAGER_INTERFACE =
+  "org.freedesktop.DBus.ObjectManager";
+
+const char* const CHARACTERISTIC_FLAGS[] = {
+  "read", "write", "write-without-response", "notify"};
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int)
+{
+  stopRequested = 1;
+}
+
+struct MockOptions
+{
+  std::string busAddress;              // Empty for the system bus
+  size_t      adapters        = 1;
+  size_t      devices         = 10;    // Per adapter
+  size_t      characteristics = 2;     // Per device
+  double      notifyRate      = 10.0;  // Hz per notifying characteristic
+  size_t      payloadSize     = 20;
+  uint16_t    mtu             = 247;
+  std::string serviceUuid     = "15451545";
+  bool        discovered      = false;  // Export devices before discovery
+  bool        shared          = false;  // Every adapter sees every device
+};
+
+// Writes properties as the entries of an a{sv} dict, optionally only the
+// one named, or for Properties.Get as that property's bare variant
+class PropertyWriter
+{
+public:
+  PropertyWriter(DBusMessageIter* iter,
+                 const char*      only        = nullptr,
+                 bool             bareVariant = false)
+    : iter_(iter), only_(only), bareVariant_(bareVariant)
+  {
+  }
+
+  void add(const char* name, int type, const void* value)
+  {
+    char signature[2] = {static_cast<char>(type), '\0'};
+
+    DBusMessageIter entry_iter, variant_iter;
+    if (!open(name, signature, entry_iter, variant_iter))
+      return;
+    dbus_message_iter_append_basic(&variant_iter, type, value);
+    close(entry_iter, variant_iter);
+  }
+
+  void add(const char* name, const std::string& value)
+  {
+    const char* text = value.c_str();
+    add(name, DBUS_TYPE_STRING, &text);
+  }
+
+  void addPath(const char* name, const std::string& value)
+  {
+    const char* text = value.c_str();
+    add(name, DBUS_TYPE_OBJECT_PATH, &text);
+  }
+
+  void add(const char* name, bool value)
+  {
+    dbus_bool_t flag = value;
+    add(name, DBUS_TYPE_BOOLEAN, &flag);
+  }
+
+  void add(const char* name, const char* const* values, size_t count)
+  {
+    DBusMessageIter entry_iter, variant_iter, array_iter;
+    if (!open(name, "as", entry_iter, variant_iter))
+      return;
+    dbus_message_iter_open_container(
+      &variant_iter, DBUS_TYPE_ARRAY, "s", &array_iter);
+    for (size_t i = 0; i < count; i++)
+    {
+      dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_STRING, &values[i]);
+    }
+    dbus_message_iter_close_container(&variant_iter, &array_iter);
+    close(entry_iter, variant_iter);
+  }
+
+  void add(const char* name, const std::vector<uint8_t>& value)
+  {
+    DBusMessageIter entry_iter, variant_iter;
+    if (!open(name, "ay", entry_iter, variant_iter))
+      return;
+    DBusHelper::appendByteArray(&variant_iter, value.data(), value.size());
+    close(entry_iter, variant_iter);
+  }
+
+  bool found() const
+  {
+    return found_;
+  }
+
+private:
+  DBusMessageIter* iter_;
+  const char*      only_;
+  bool             bareVariant_;
+  bool             found_ = false;
+
+  bool open(const char*      name,
+            const char*      signature,
+            DBusMessageIter& entry_iter,
+            DBusMessageIter& variant_iter)
+  {
+    if (only_)
+    {
+      if (found_ || std::strcmp(name, only_) != 0)
+        return false;
+      found_ = true;
+    }
+
+    if (bareVariant_)
+    {
+      return dbus_message_iter_open_container(
+        iter_, DBUS_TYPE_VARIANT, signature, &variant_iter);
+    }
+
+    dbus_message_iter_open_container(
+      iter_, DBUS_TYPE_DICT_ENTRY, nullptr, &entry_iter);
+    dbus_message_iter_append_basic(&entry_iter, DBUS_TYPE_STRING, &name);
+    return dbus_message_iter_open_container(
+      &entry_iter, DBUS_TYPE_VARIANT, signature, &variant_iter);
+  }
+
+  void close(DBusMessageIter& entry_iter, DBusMessageIter& variant_iter)
+  {
+    if (bareVariant_)
+    {
+      dbus_message_iter_close_container(iter_, &variant_iter);
+      return;
+    }
+
+    dbus_message_iter_close_container(&entry_iter, &variant_iter);
+    dbus_message_iter_close_container(iter_, &entry_iter);
+  }
+};
+
+class MockBluez
+{
+public:
+  explicit MockBluez(const MockOptions& options);
+  ~MockBluez();
+
+  bool start();
+  void run();
+
+private:
+  enum class ObjectKind
+  {
+    Adapter,
+    Device,
+    Service,
+    Characteristic
+  };
+
+  struct ObjectRef
+  {
+    ObjectKind kind;
+    size_t     index;
+  };
+
+  struct Adapter
+  {
+    std::string path;
+    std::string address;
+    bool        discovering = false;
+  };
+
+  struct Device
+  {
+    std::string         path;
+    std::string         adapter;
+    std::string         address;
+    std::string         name;
+    std::string         servicePath;
+    std::vector<size_t> characteristics;
+    bool                visible   = false;
+    bool                connected = false;
+  };
+
+  struct Characteristic
+  {
+    std::string          path;
+    std::string          uuid;
+    size_t               device;
+    std::vector<uint8_t> value;
+    bool                 notifying = false;
+    int                  notifyFd  = -1;  // Set while AcquireNotify is held
+    int                  writeFd   = -1;  // Set while AcquireWrite is held
+    uint32_t             sequence  = 0;
+    std::chrono::steady_clock::time_point nextNotify;
+  };
+
+  MockOptions options_;
+  DBusHelper  dbus_;
+  std::string serviceUuid_;
+
+  std::vector<Adapter>                       adapters_;
+  std::vector<Device>                        devices_;
+  std::vector<Characteristic>                characteristics_;
+  std::unordered_map<std::string, ObjectRef> objects_;
+  std::vector<size_t>                        notifying_;  // Characteristics
+
+  std::chrono::steady_clock::duration notifyPeriod_;
+  uint64_t                            notificationsSent_ = 0;
+  uint64_t                            writesReceived_    = 0;
+
+  void         buildObjects();
+  DBusMessage* handleMethod(DBusMessage* message, const ObjectRef& object);
+  DBusMessage* handleAdapter(DBusMessage* message, Adapter& adapter);
+  DBusMessage* handleDevice(DBusMessage* message, size_t index);
+  DBusMessage* handleCharacteristic(DBusMessage* message, size_t index);
+  DBusMessage* handleProperties(DBusMessage* message, const ObjectRef& object);
+  DBusMessage* acquireSocket(DBusMessage*    message,
+                             Characteristic& characteristic,
+                             int&            ownFd);
+
+  bool isExported(const ObjectRef& object) const;
+  void appendProperties(PropertyWriter& writer, const ObjectRef& object);
+  void appendInterfaces(DBusMessageIter* iter, const ObjectRef& object);
+  const std::string& objectPath(const ObjectRef& object) const;
+  const std::string& objectInterface(const ObjectRef& object) const;
+
+  void connectDevice(size_t index);
+  void disconnectDevice(size_t index);
+  void showDevices(const Adapter& adapter);
+  void setNotifying(size_t index, bool notifying);
+
+  void emitInterfacesAdded(const ObjectRef& object);
+  void emitInterfacesRemoved(const ObjectRef& object);
+  void emitPropertyChanged(const ObjectRef& object, const char* property);
+
+  int  sendNotifications();
+  void drainWriteSockets();
+
+  static DBusHandlerResult messageHandler(DBusConnection* connection,
+                                          DBusMessage*    message,
+                                          void*           userData);
+};
+
+MockBluez::MockBluez(const MockOptions& options) : options_(options)
+{
+  using Period = std::chrono::steady_clock::duration;
+
+  serviceUuid_  = BluetoothUuid::fromString(options_.serviceUuid).toString();
+  notifyPeriod_ = std::chrono::duration_cast<Period>(
+    std::chrono::duration<double>(1.0 / options_.notifyRate));
+  buildObjects();
+}
+
+MockBluez::~MockBluez()
+{
+  for (auto& characteristic : characteristics_)
+  {
+    if (characteristic.notifyFd >= 0)
+      close(characteristic.notifyFd);
+    if (characteristic.writeFd >= 0)
+      close(characteristic.writeFd);
+  }
+}
+
+void MockBluez::buildObjects()
+{
+  BluetoothUuid service = BluetoothUuid::fromString(serviceUuid_);
+  char          buffer[64];
+
+  for (size_t a = 0; a < options_.adapters; a++)
+  {
+    Adapter adapter;
+    std::snprintf(buffer, sizeof(buffer), "/org/bluez/hci%zu", a);
+    adapter.path = buffer;
+    std::snprintf(buffer, sizeof(buffer), "00:00:00:00:00:%02zX", a & 0xff);
+    adapter.address = buffer;
+    objects_[adapter.path] = {ObjectKind::Adapter, adapters_.size()};
+    adapters_.push_back(adapter);
+
+    for (size_t d = 0; d < options_.devices; d++)
+    {
+      // Shared devices keep their address across adapters, like one
+      // peripheral in range of several controllers
+      size_t id = options_.shared ? d : a * options_.devices + d;
+
+      Device device;
+      std::snprintf(buffer,
+                    sizeof(buffer),
+                    "C0:FF:EE:%02zX:%02zX:%02zX",
+                    (id >> 16) & 0xff,
+                    (id >> 8) & 0xff,
+                    id & 0xff);
+      device.address = buffer;
+      device.adapter = adapters_.back().path;
+      device.path    = device.adapter + "/dev_" + device.address;
+      for (char& c : device.path)
+      {
+        if (c == ':')
+          c = '_';
+      }
+      std::snprintf(buffer, sizeof(buffer), "Mock %zu", id);
+      device.name        = buffer;
+      device.servicePath = device.path + "/service0010";
+      device.visible     = options_.discovered;
+
+      for (size_t c = 0; c < options_.characteristics; c++)
+      {
+        Characteristic characteristic;
+        std::snprintf(buffer, sizeof(buffer), "/char%04zx", 0x11 + 2 * c);
+        characteristic.path = device.servicePath + buffer;
+        characteristic.uuid =
+          BluetoothUuid::fromShort(service.shortValue() + 1 +
+                                   static_cast<uint32_t>(c))
+            .toString();
+        characteristic.device = devices_.size();
+        characteristic.value.assign(options_.payloadSize, 0);
+
+        objects_[characteristic.path] = {ObjectKind::Characteristic,
+                                         characteristics_.size()};
+        device.characteristics.push_back(characteristics_.size());
+        characteristics_.push_back(characteristic);
+      }
+
+      objects_[device.path]        = {ObjectKind::Device, devices_.size()};
+      objects_[device.servicePath] = {ObjectKind::Service, devices_.size()};
+      devices_.push_back(device);
+    }
+  }
+}
+
+bool MockBluez::start()
+{
+  if (!dbus_.connect(options_.busAddress))
+    return false;
+
+  DBusConnection* connection = dbus_.getConnection();
+
+  DBusError error;
+  dbus_error_init(&error);
+  int result = dbus_bus_request_name(
+    connection, BLUEZ_SERVICE.c_str(), DBUS_NAME_FLAG_DO_NOT_QUEUE, &error);
+  if (dbus_error_is_set(&error) ||
+      result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  {
+    std::cerr << "Cannot own " << BLUEZ_SERVICE << ": "
+              << (dbus_error_is_set(&error) ? error.message
+                                            : "name already taken")
+              << std::endl;
+    dbus_error_free(&error);
+    return false;
+  }
+
+  // One fallback handler on "/" sees every call; objects are looked up in
+  // objects_ instead of registering thousands of paths with libdbus
+  DBusObjectPathVTable vtable = {};
+  vtable.message_function     = &MockBluez::messageHandler;
+  if (!dbus_connection_register_fallback(connection, "/", &vtable, this))
+  {
+    std::cerr << "Failed to register object handler" << std::endl;
+    return false;
+  }
+
+  std::cout << "Mock BlueZ serving " << adapters_.size() << " adapter(s), "
+            << devices_.size() << " device(s), " << characteristics_.size()
+            << " characteristic(s)" << std::endl;
+  return true;
+}
+
+void MockBluez::run()
+{
+  DBusConnection* connection = dbus_.getConnection();
+
+  while (!stopRequested)
+  {
+    int timeoutMs = sendNotifications();
+    drainWriteSockets();
+
+    if (!dbus_connection_read_write_dispatch(connection, timeoutMs))
+      break;
+  }
+
+  std::cout << "Sent " << notificationsSent_ << " notifications, received "
+            << writesReceived_ << " writes" << std::endl;
+}
+
+DBusHandlerResult MockBluez::messageHandler(DBusConnection* connection,
+                                            DBusMessage*    message,
+                                            void*           userData)
+{
+  auto* self = static_cast<MockBluez*>(userData);
+
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  const char*  path  = dbus_message_get_path(message);
+  DBusMessage* reply = nullptr;
+
+  if (dbus_message_is_method_call(
+        message, OBJECT_MANAGER_INTERFACE.c_str(), "GetManagedObjects") &&
+      std::strcmp(path, "/") == 0)
+  {
+    reply = dbus_message_new_method_return(message);
+
+    DBusMessageIter iter, objects_iter, object_iter;
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(
+      &iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects_iter);
+    for (const auto& objectPair : self->objects_)
+    {
+      if (!self->isExported(objectPair.second))
+        continue;
+
+      const char* objectPath = objectPair.first.c_str();
+      dbus_message_iter_open_container(
+        &objects_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &object_iter);
+      dbus_message_iter_append_basic(
+        &object_iter, DBUS_TYPE_OBJECT_PATH, &objectPath);
+      self->appendInterfaces(&object_iter, objectPair.second);
+      dbus_message_iter_close_container(&objects_iter, &object_iter);
+    }
+    dbus_message_iter_close_container(&iter, &objects_iter);
+  }
+  else
+  {
+    auto it = self->objects_.find(path);
+    if (it == self->objects_.end() || !self->isExported(it->second))
+    {
+      reply = dbus_message_new_error(
+        message, "org.freedesktop.DBus.Error.UnknownObject", path);
+    }
+    else
+    {
+      reply = self->handleMethod(message, it->second);
+    }
+  }
+
+  if (reply)
+  {
+    dbus_connection_send(connection, reply, nullptr);
+    dbus_message_unref(reply);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+DBusMessage* MockBluez::handleMethod(DBusMessage*     message,
+                                     const ObjectRef& object)
+{
+  const char* interface = dbus_message_get_interface(message);
+  if (interface && PROPERTIES_INTERFACE == interface)
+    return handleProperties(message, object);
+
+  switch (object.kind)
+  {
+    case ObjectKind::Adapter:
+      return handleAdapter(message, adapters_[object.index]);
+    case ObjectKind::Device:
+      return handleDevice(message, object.index);
+    case ObjectKind::Characteristic:
+      return handleCharacteristic(message, object.index);
+    case ObjectKind::Service:
+      break;
+  }
+
+  return dbus_message_new_error(message,
+                                DBUS_ERROR_UNKNOWN_METHOD,
+                                dbus_message_get_member(message));
+}
+
+DBusMessage* MockBluez::handleAdapter(DBusMessage* message, Adapter& adapter)
+{
+  const char* interface = ADAPTER_INTERFACE_1.c_str();
+  ObjectRef   object    = objects_[adapter.path];
+
+  if (dbus_message_is_method_call(message, interface, "StartDiscovery"))
+  {
+    if (!adapter.discovering)
+    {
+      adapter.discovering = true;
+      emitPropertyChanged(object, "Discovering");
+      showDevices(adapter);
+    }
+  }
+  else if (dbus_message_is_method_call(message, interface, "StopDiscovery"))
+  {
+    if (!adapter.discovering)
+    {
+      return dbus_message_new_error(
+        message, "org.bluez.Error.Failed", "No discovery started");
+    }
+    adapter.discovering = false;
+    emitPropertyChanged(object, "Discovering");
+  }
+  else if (!dbus_message_is_method_call(
+             message, interface, "SetDiscoveryFilter"))
+  {
+    // Every mock device is in range, so the filter is accepted and ignored
+    return dbus_message_new_error(message,
+                                  DBUS_ERROR_UNKNOWN_METHOD,
+                                  dbus_message_get_member(message));
+  }
+
+  return dbus_message_new_method_return(message);
+}
+
+DBusMessage* MockBluez::handleDevice(DBusMessage* message, size_t index)
+{
+  const char* interface = DEVICE_INTERFACE_1.c_str();
+
+  if (dbus_message_is_method_call(message, interface, "Connect"))
+  {
+    // Reply once the link is up; services resolve right after
+    DBusMessage* reply = dbus_message_new_method_return(message);
+    connectDevice(index);
+    return reply;
+  }
+  if (dbus_message_is_method_call(message, interface, "Disconnect"))
+  {
+    disconnectDevice(index);
+    return dbus_message_new_method_return(message);
+  }
+
+  return dbus_message_new_error(message,
+                                DBUS_ERROR_UNKNOWN_METHOD,
+                                dbus_message_get_member(message));
+}
+
+DBusMessage* MockBluez::handleCharacteristic(DBusMessage* message,
+                                             size_t       index)
+{
+  const char*     interface      = GATT_CHARACTERISTIC_INTERFACE.c_str();
+  Characteristic& characteristic = characteristics_[index];
+
+  if (dbus_message_is_method_call(message, interface, "ReadValue"))
+  {
+    DBusMessage*    reply = dbus_message_new_method_return(message);
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(reply, &iter);
+    DBusHelper::appendByteArray(
+      &iter, characteristic.value.data(), characteristic.value.size());
+    return reply;
+  }
+  if (dbus_message_is_method_call(message, interface, "WriteValue"))
+  {
+    DBusMessageIter iter;
+    const uint8_t*  data   = nullptr;
+    size_t          length = 0;
+    if (!dbus_message_iter_init(message, &iter) ||
+        !DBusHelper::readByteArray(&iter, data, length))
+    {
+      return dbus_message_new_error(
+        message, DBUS_ERROR_INVALID_ARGS, "Expected a byte array");
+    }
+
+    characteristic.value.assign(data, data + length);
+    writesReceived_++;
+    return dbus_message_new_method_return(message);
+  }
+  if (dbus_message_is_method_call(message, interface, "StartNotify"))
+  {
+    setNotifying(index, true);
+    return dbus_message_new_method_return(message);
+  }
+  if (dbus_message_is_method_call(message, interface, "StopNotify"))
+  {
+    setNotifying(index, false);
+    return dbus_message_new_method_return(message);
+  }
+  if (dbus_message_is_method_call(message, interface, "AcquireNotify"))
+  {
+    DBusMessage* reply =
+      acquireSocket(message, characteristic, characteristic.notifyFd);
+    if (characteristic.notifyFd >= 0)
+      setNotifying(index, true);
+    return reply;
+  }
+  if (dbus_message_is_method_call(message, interface, "AcquireWrite"))
+  {
+    return acquireSocket(message, characteristic, characteristic.writeFd);
+  }
+
+  return dbus_message_new_error(message,
+                                DBUS_ERROR_UNKNOWN_METHOD,
+                                dbus_message_get_member(message));
+}
+
+DBusMessage* MockBluez::acquireSocket(DBusMessage*    message,
+                                      Characteristic& characteristic,
+                                      int&            ownFd)
+{
+  (void)characteristic;
+
+  if (ownFd >= 0)
+  {
+    return dbus_message_new_error(
+      message, "org.bluez.Error.NotPermitted", "Already acquired");
+  }
+
+  // Like bluetoothd, hand out one end of a packet socket pair
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds) < 0)
+  {
+    return dbus_message_new_error(
+      message, "org.bluez.Error.Failed", std::strerror(errno));
+  }
+
+  DBusMessage*  reply = dbus_message_new_method_return(message);
+  dbus_uint16_t mtu   = options_.mtu;
+  dbus_message_append_args(reply,
+                           DBUS_TYPE_UNIX_FD,
+                           &fds[1],
+                           DBUS_TYPE_UINT16,
+                           &mtu,
+                           DBUS_TYPE_INVALID);
+
+  // The message holds its own duplicate of the peer's end
+  close(fds[1]);
+  ownFd = fds[0];
+  return reply;
+}
+
+DBusMessage* MockBluez::handleProperties(DBusMessage*     message,
+                                         const ObjectRef& object)
+{
+  const char* interface = PROPERTIES_INTERFACE.c_str();
+  const char* requested = nullptr;
+  const char* property  = nullptr;
+
+  if (dbus_message_is_method_call(message, interface, "Get") &&
+      dbus_message_get_args(message,
+                            nullptr,
+                            DBUS_TYPE_STRING,
+                            &requested,
+                            DBUS_TYPE_STRING,
+                            &property,
+                            DBUS_TYPE_INVALID))
+  {
+    if (objectInterface(object) == requested)
+    {
+      DBusMessage*    reply = dbus_message_new_method_return(message);
+      DBusMessageIter iter;
+      dbus_message_iter_init_append(reply, &iter);
+
+      PropertyWriter writer(&iter, property, true);
+      appendProperties(writer, object);
+      if (writer.found())
+        return reply;
+      dbus_message_unref(reply);
+    }
+
+    return dbus_message_new_error(
+      message, DBUS_ERROR_INVALID_ARGS, "No such property");
+  }
+
+  if (dbus_message_is_method_call(message, interface, "GetAll") &&
+      dbus_message_get_args(
+        message, nullptr, DBUS_TYPE_STRING, &requested, DBUS_TYPE_INVALID))
+  {
+    DBusMessage*    reply = dbus_message_new_method_return(message);
+    DBusMessageIter iter, dict_iter;
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(
+      &iter, DBUS_TYPE_ARRAY, "{sv}", &dict_iter);
+    if (objectInterface(object) == requested)
+    {
+      PropertyWriter writer(&dict_iter);
+      appendProperties(writer, object);
+    }
+    dbus_message_iter_close_container(&iter, &dict_iter);
+    return reply;
+  }
+
+  return dbus_message_new_error(
+    message, DBUS_ERROR_NOT_SUPPORTED, "Properties are read-only");
+}
+
+bool MockBluez::isExported(const ObjectRef& object) const
+{
+  switch (object.kind)
+  {
+    case ObjectKind::Adapter:
+      return true;
+    case ObjectKind::Device:
+      return devices_[object.index].visible;
+    case ObjectKind::Service:
+      return devices_[object.index].connected;
+    case ObjectKind::Characteristic:
+      return devices_[characteristics_[object.index].device].connected;
+  }
+  return false;
+}
+
+void MockBluez::appendProperties(PropertyWriter& writer,
+                                 const ObjectRef& object)
+{
+  switch (object.kind)
+  {
+    case ObjectKind::Adapter:
+    {
+      const Adapter& adapter = adapters_[object.index];
+      writer.add("Address", adapter.address);
+      writer.add("Name", std::string("mock"));
+      writer.add("Powered", true);
+      writer.add("Discovering", adapter.discovering);
+      break;
+    }
+    case ObjectKind::Device:
+    {
+      const Device& device = devices_[object.index];
+      const char*   uuid   = serviceUuid_.c_str();
+      int16_t       rssi   = -60;
+      writer.add("Address", device.address);
+      writer.add("Name", device.name);
+      writer.addPath("Adapter", device.adapter);
+      writer.add("UUIDs", &uuid, 1);
+      writer.add("RSSI", DBUS_TYPE_INT16, &rssi);
+      writer.add("Connected", device.connected);
+      writer.add("ServicesResolved", device.connected);
+      break;
+    }
+    case ObjectKind::Service:
+    {
+      const Device& device = devices_[object.index];
+      writer.add("UUID", serviceUuid_);
+      writer.addPath("Device", device.path);
+      writer.add("Primary", true);
+      break;
+    }
+    case ObjectKind::Characteristic:
+    {
+      const Characteristic& characteristic = characteristics_[object.index];
+      dbus_uint16_t         mtu            = options_.mtu;
+      writer.add("UUID", characteristic.uuid);
+      writer.addPath("Service",
+                     devices_[characteristic.device].servicePath);
+      writer.add("Flags",
+                 CHARACTERISTIC_FLAGS,
+                 std::size(CHARACTERISTIC_FLAGS));
+      writer.add("Notifying", characteristic.notifying);
+      writer.add("Value", characteristic.value);
+      writer.add("MTU", DBUS_TYPE_UINT16, &mtu);
+      break;
+    }
+  }
+}
+
+void MockBluez::appendInterfaces(DBusMessageIter*  iter,
+                                 const ObjectRef& object)
+{
+  DBusMessageIter interfaces_iter, interface_iter, props_iter;
+  const char*     interface = objectInterface(object).c_str();
+
+  dbus_message_iter_open_container(
+    iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &interfaces_iter);
+  dbus_message_iter_open_container(
+    &interfaces_iter, DBUS_TYPE_DICT_ENTRY, nullptr, &interface_iter);
+  dbus_message_iter_append_basic(&interface_iter, DBUS_TYPE_STRING, &interface);
+  dbus_message_iter_open_container(
+    &interface_iter, DBUS_TYPE_ARRAY, "{sv}", &props_iter);
+
+  PropertyWriter writer(&props_iter);
+  appendProperties(writer, object);
+
+  dbus_message_iter_close_container(&interface_iter, &props_iter);
+  dbus_message_iter_close_container(&interfaces_iter, &interface_iter);
+  dbus_message_iter_close_container(iter, &interfaces_iter);
+}
+
+const std::string& MockBluez::objectPath(const ObjectRef& object) const
+{
+  switch (object.kind)
+  {
+    case ObjectKind::Adapter:
+      return adapters_[object.index].path;
+    case ObjectKind::Device:
+      return devices_[object.index].path;
+    case ObjectKind::Service:
+      return devices_[object.index].servicePath;
+    case ObjectKind::Characteristic:
+      break;
+  }
+  return characteristics_[object.index].path;
+}
+
+const std::string& MockBluez::objectInterface(const ObjectRef& object) const
+{
+  switch (object.kind)
+  {
+    case ObjectKind::Adapter:
+      return ADAPTER_INTERFACE_1;
+    case ObjectKind::Device:
+      return DEVICE_INTERFACE_1;
+    case ObjectKind::Service:
+      return GATT_SERVICE_INTERFACE;
+    case ObjectKind::Characteristic:
+      break;
+  }
+  return GATT_CHARACTERISTIC_INTERFACE;
+}
+
+void MockBluez::showDevices(const Adapter& adapter)
+{
+  for (size_t i = 0; i < devices_.size(); i++)
+  {
+    if (devices_[i].visible || devices_[i].adapter != adapter.path)
+      continue;
+
+    devices_[i].visible = true;
+    emitInterfacesAdded({ObjectKind::Device, i});
+  }
+}
+
+void MockBluez::connectDevice(size_t index)
+{
+  Device& device = devices_[index];
+  if (device.connected)
+    return;
+
+  // Objects are exported while connected, so flip the flag first and
+  // announce the GATT tree before ServicesResolved, as bluetoothd does
+  device.connected = true;
+  emitInterfacesAdded({ObjectKind::Service, index});
+  for (size_t characteristic : device.characteristics)
+  {
+    emitInterfacesAdded({ObjectKind::Characteristic, characteristic});
+  }
+  emitPropertyChanged({ObjectKind::Device, index}, "Connected");
+  emitPropertyChanged({ObjectKind::Device, index}, "ServicesResolved");
+}
+
+void MockBluez::disconnectDevice(size_t index)
+{
+  Device& device = devices_[index];
+  if (!device.connected)
+    return;
+
+  for (size_t characteristic : device.characteristics)
+  {
+    Characteristic& entry = characteristics_[characteristic];
+    setNotifying(characteristic, false);
+    if (entry.writeFd >= 0)
+    {
+      close(entry.writeFd);
+      entry.writeFd = -1;
+    }
+    emitInterfacesRemoved({ObjectKind::Characteristic, characteristic});
+  }
+  emitInterfacesRemoved({ObjectKind::Service, index});
+
+  device.connected = false;
+  emitPropertyChanged({ObjectKind::Device, index}, "ServicesResolved");
+  emitPropertyChanged({ObjectKind::Device, index}, "Connected");
+}
+
+void MockBluez::setNotifying(size_t index, bool notifying)
+{
+  Characteristic& characteristic = characteristics_[index];
+
+  if (!notifying && characteristic.notifyFd >= 0)
+  {
+    close(characteristic.notifyFd);
+    characteristic.notifyFd = -1;
+  }
+  if (characteristic.notifying == notifying)
+    return;
+
+  characteristic.notifying = notifying;
+  if (notifying)
+  {
+    characteristic.nextNotify = std::chrono::steady_clock::now();
+    notifying_.push_back(index);
+  }
+  else
+  {
+    for (size_t i = 0; i < notifying_.size(); i++)
+    {
+      if (notifying_[i] == index)
+      {
+        notifying_[i] = notifying_.back();
+        notifying_.pop_back();
+        break;
+      }
+    }
+  }
+
+  emitPropertyChanged({ObjectKind::Characteristic, index}, "Notifying");
+}
+
+void MockBluez::emitInterfacesAdded(const ObjectRef& object)
+{
+  DBusMessage* signal = dbus_message_new_signal(
+    "/", OBJECT_MANAGER_INTERFACE.c_str(), "InterfacesAdded");
+
+  DBusMessageIter iter;
+  const char*     path = objectPath(object).c_str();
+  dbus_message_iter_init_append(signal, &iter);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+  appendInterfaces(&iter, object);
+
+  dbus_connection_send(dbus_.getConnection(), signal, nullptr);
+  dbus_message_unref(signal);
+}
+
+void MockBluez::emitInterfacesRemoved(const ObjectRef& object)
+{
+  DBusMessage* signal = dbus_message_new_signal(
+    "/", OBJECT_MANAGER_INTERFACE.c_str(), "InterfacesRemoved");
+
+  DBusMessageIter iter, array_iter;
+  const char*     path      = objectPath(object).c_str();
+  const char*     interface = objectInterface(object).c_str();
+  dbus_message_iter_init_append(signal, &iter);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array_iter);
+  dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_STRING, &interface);
+  dbus_message_iter_close_container(&iter, &array_iter);
+
+  dbus_connection_send(dbus_.getConnection(), signal, nullptr);
+  dbus_message_unref(signal);
+}
+
+void MockBluez::emitPropertyChanged(const ObjectRef& object,
+                                    const char*      property)
+{
+  DBusMessage* signal =
+    dbus_message_new_signal(objectPath(object).c_str(),
+                            PROPERTIES_INTERFACE.c_str(),
+                            "PropertiesChanged");
+
+  DBusMessageIter iter, dict_iter, invalidated_iter;
+  const char*     interface = objectInterface(object).c_str();
+  dbus_message_iter_init_append(signal, &iter);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict_iter);
+  PropertyWriter writer(&dict_iter, property);
+  appendProperties(writer, object);
+  dbus_message_iter_close_container(&iter, &dict_iter);
+
+  dbus_message_iter_open_container(
+    &iter, DBUS_TYPE_ARRAY, "s", &invalidated_iter);
+  dbus_message_iter_close_container(&iter, &invalidated_iter);
+
+  dbus_connection_send(dbus_.getConnection(), signal, nullptr);
+  dbus_message_unref(signal);
+}
+
+int MockBluez::sendNotifications()
+{
+  // Nothing due: sleep in dispatch until a call comes in
+  if (notifying_.empty())
+    return 100;
+
+  auto now      = std::chrono::steady_clock::now();
+  auto earliest = now + std::chrono::milliseconds(100);
+
+  for (size_t i = 0; i < notifying_.size(); i++)
+  {
+    Characteristic& characteristic = characteristics_[notifying_[i]];
+
+    // A consumer that falls far behind resumes at the current time rather
+    // than being sent a burst of everything it missed
+    if (now - characteristic.nextNotify > std::chrono::seconds(1))
+      characteristic.nextNotify = now;
+
+    while (characteristic.nextNotify <= now)
+    {
+      characteristic.nextNotify += notifyPeriod_;
+
+      // A notification replaces Value, as in BlueZ, so one after a short
+      // WriteValue is back to --payload bytes with room for the counter
+      std::vector<uint8_t>& value = characteristic.value;
+      if (value.size() != options_.payloadSize)
+        value.assign(options_.payloadSize, 0);
+
+      // Little-endian sequence number up front so receivers can spot gaps
+      uint32_t sequence = characteristic.sequence++;
+      for (size_t byte = 0; byte < value.size() && byte < 4; byte++)
+      {
+        value[byte] = static_cast<uint8_t>(sequence >> (8 * byte));
+      }
+
+      if (characteristic.notifyFd >= 0)
+      {
+        if (send(characteristic.notifyFd,
+                 value.data(),
+                 value.size(),
+                 MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN)
+        {
+          // The client closed its end, which is how it stops notifying
+          setNotifying(notifying_[i], false);
+          i--;
+          break;
+        }
+      }
+      else
+      {
+        emitPropertyChanged({ObjectKind::Characteristic, notifying_[i]},
+                            "Value");
+      }
+      notificationsSent_++;
+    }
+
+    if (characteristic.notifying && characteristic.nextNotify < earliest)
+      earliest = characteristic.nextNotify;
+  }
+
+  auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+    earliest - std::chrono::steady_clock::now());
+  return static_cast<int>(std::max<long long>(wait.count(), 0));
+}
+
+void MockBluez::drainWriteSockets()
+{
+  uint8_t buffer[512];
+
+  for (auto& characteristic : characteristics_)
+  {
+    if (characteristic.writeFd < 0)
+      continue;
+
+    for (;;)
+    {
+      ssize_t length = recv(characteristic.writeFd, buffer, sizeof(buffer), 0);
+      if (length > 0)
+      {
+        writesReceived_++;
+        continue;
+      }
+
+      // Zero means the client released the socket
+      if (length == 0 || (errno != EAGAIN && errno != EINTR))
+      {
+        close(characteristic.writeFd);
+        characteristic.writeFd = -1;
+      }
+      break;
+    }
+  }
+}
+
+static void printUsage(const char* program)
+{
+  std::cerr
+    << "Usage: " << program << " [options]" << std::endl
+    << "  --bus ADDRESS           D-Bus address to serve on (default: "
+       "system bus)"
+    << std::endl
+    << "  --adapters N            Adapters to export (default 1)" << std::endl
+    << "  --devices N             Devices per adapter (default 10)"
+    << std::endl
+    << "  --characteristics N     Notifying characteristics per device "
+       "(default 2)"
+    << std::endl
+    << "  --rate HZ               Notifications per second per "
+       "characteristic (default 10)"
+    << std::endl
+    << "  --payload BYTES         Notification size (default 20)" << std::endl
+    << "  --mtu BYTES             MTU reported by Acquire* (default 247)"
+    << std::endl
+    << "  --service UUID          Advertised GATT service (default 15451545)"
+    << std::endl
+    << "  --discovered            Export devices before discovery starts"
+    << std::endl
+    << "  --shared                Every adapter sees the same devices"
+    << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  MockOptions options;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg     = argv[i];
+    const char* value   = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool        hasNext = value != nullptr;
+
+    if (arg == "--discovered")
+    {
+      options.discovered = true;
+    }
+    else if (arg == "--shared")
+    {
+      options.shared = true;
+    }
+    else if (arg == "--bus" && hasNext)
+    {
+      options.busAddress = argv[++i];
+    }
+    else if (arg == "--adapters" && hasNext)
+    {
+      options.adapters = std::stoul(argv[++i]);
+    }
+    else if (arg == "--devices" && hasNext)
+    {
+      options.devices = std::stoul(argv[++i]);
+    }
+    else if (arg == "--characteristics" && hasNext)
+    {
+      options.characteristics = std::stoul(argv[++i]);
+    }
+    else if (arg == "--rate" && hasNext)
+    {
+      options.notifyRate = std::stod(argv[++i]);
+    }
+    else if (arg == "--payload" && hasNext)
+    {
+      options.payloadSize = std::stoul(argv[++i]);
+    }
+    else if (arg == "--mtu" && hasNext)
+    {
+      options.mtu = static_cast<uint16_t>(std::stoul(argv[++i]));
+    }
+    else if (arg == "--service" && hasNext)
+    {
+      options.serviceUuid = argv[++i];
+    }
+    else
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  BluetoothUuid service;
+  if (options.notifyRate <= 0 ||
+      !BluetoothUuid::parse(options.serviceUuid, service))
+  {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  std::signal(SIGINT, handleStopSignal);
+  std::signal(SIGTERM, handleStopSignal);
+
+  MockBluez mock(options);
+  if (!mock.start())
+    return 1;
+
+  mock.run();
+  return 0;
+}
\ No newline at end of file
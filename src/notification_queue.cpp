@@ -0,0 +1,149 @@
+#include "notification_queue.h"
+#include <algorithm>
+#include <cstring>
+
+NotificationQueue::NotificationQueue(size_t capacity)
+{
+  size_t size = 1;
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  slots_.reset(new Slot[size]);
+  mask_ = size - 1;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool NotificationQueue::push(uint32_t       handle,
+                             uint64_t       timestampNs,
+                             const uint8_t* data,
+                             size_t         length)
+{
+  NotificationHeader header;
+  header.handle      = handle;
+  header.length      = static_cast<uint16_t>(std::min<size_t>(length, 0xFFFF));
+  header.timestampNs = timestampNs;
+  return push(header, data);
+}
+
+bool NotificationQueue::push(const NotificationHeader& header,
+                             const uint8_t*            data)
+{
+  size_t position = head_.load(std::memory_order_relaxed);
+  Slot*  slot;
+
+  // Claim a slot. The slot's sequence equals the claim position when it is
+  // free, and lags behind it when the consumer has not drained it yet.
+  for (;;)
+  {
+    slot            = &slots_[position & mask_];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    auto   diff     = static_cast<intptr_t>(sequence - position);
+
+    if (diff == 0)
+    {
+      if (head_.compare_exchange_weak(
+            position, position + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      overflows_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      position = head_.load(std::memory_order_relaxed);
+    }
+  }
+
+  size_t length = header.length;
+  if (length > NOTIFICATION_MAX_PAYLOAD)
+  {
+    truncated_.fetch_add(1, std::memory_order_relaxed);
+    length = NOTIFICATION_MAX_PAYLOAD;
+  }
+
+  static_cast<NotificationHeader&>(slot->record) = header;
+  slot->record.length = static_cast<uint16_t>(length);
+  std::memcpy(slot->record.data, data, length);
+
+  slot->sequence.store(position + 1, std::memory_order_release);
+  pushed_.fetch_add(1, std::memory_order_relaxed);
+
+  // Pairs with the fence in waitPop so a sleeping consumer is never missed
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (consumerWaiting_.load(std::memory_order_relaxed))
+  {
+    std::lock_guard<std::mutex> lock(waitMutex_);
+    waitCondition_.notify_one();
+  }
+
+  return true;
+}
+
+bool NotificationQueue::tryPop(NotificationRecord& record)
+{
+  Slot&  slot     = slots_[tail_ & mask_];
+  size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+  if (sequence != tail_ + 1)
+    return false;
+
+  static_cast<NotificationHeader&>(record) = slot.record;
+  std::memcpy(record.data, slot.record.data, slot.record.length);
+
+  // Hand the slot back to producers for the next lap around the ring
+  slot.sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+  tail_++;
+  return true;
+}
+
+bool NotificationQueue::waitPop(NotificationRecord&       record,
+                                std::chrono::milliseconds timeout)
+{
+  if (tryPop(record))
+    return true;
+
+  consumerWaiting_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  bool popped = tryPop(record);
+  if (!popped)
+  {
+    std::unique_lock<std::mutex> lock(waitMutex_);
+    waitCondition_.wait_for(lock, timeout, [this]() {
+      const Slot& slot = slots_[tail_ & mask_];
+      return slot.sequence.load(std::memory_order_acquire) == tail_ + 1;
+    });
+    popped = tryPop(record);
+  }
+
+  consumerWaiting_.store(false, std::memory_order_relaxed);
+  return popped;
+}
+
+size_t NotificationQueue::capacity() const
+{
+  return mask_ + 1;
+}
+
+uint64_t NotificationQueue::pushedCount() const
+{
+  return pushed_.load(std::memory_order_relaxed);
+}
+
+uint64_t NotificationQueue::overflowCount() const
+{
+  return overflows_.load(std::memory_order_relaxed);
+}
+
+uint64_t NotificationQueue::truncatedCount() const
+{
+  return truncated_.load(std::memory_order_relaxed);
+}
\ No newline at end of file
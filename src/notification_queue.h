@@ -0,0 +1,82 @@
+#ifndef NOTIFICATION_QUEUE_H
+#define NOTIFICATION_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Largest value an ATT attribute can hold
+const size_t NOTIFICATION_MAX_PAYLOAD = 512;
+
+// Everything about a notification but its payload
+struct NotificationHeader
+{
+  uint32_t handle         = 0;  // Characteristic handle from BluetoothManager
+  uint16_t length         = 0;  // Bytes used in data
+  bool     hasAppSequence = false;
+  uint64_t timestampNs    = 0;  // steady_clock time the value was received
+  uint64_t sequence       = 0;  // Per-characteristic receive count, from 1
+  uint64_t appSequence    = 0;  // Sender's own counter, see SequenceField
+};
+
+struct NotificationRecord : NotificationHeader
+{
+  uint8_t data[NOTIFICATION_MAX_PAYLOAD];
+};
+
+// Bounded lock-free ring of fixed-size notification records. Any number of
+// threads may push; a single consumer thread pops. Producers never block:
+// when the ring is full the record is dropped and counted as an overflow.
+class NotificationQueue
+{
+public:
+  // Capacity is rounded up to a power of two
+  explicit NotificationQueue(size_t capacity = 4096);
+
+  NotificationQueue(const NotificationQueue&)            = delete;
+  NotificationQueue& operator=(const NotificationQueue&) = delete;
+
+  bool push(uint32_t       handle,
+            uint64_t       timestampNs,
+            const uint8_t* data,
+            size_t         length);
+  // Queues header.length bytes of data along with the rest of the header
+  bool push(const NotificationHeader& header, const uint8_t* data);
+
+  // Consumer side
+  bool tryPop(NotificationRecord& record);
+  bool waitPop(NotificationRecord& record, std::chrono::milliseconds timeout);
+
+  size_t   capacity() const;
+  uint64_t pushedCount() const;
+  uint64_t overflowCount() const;
+  uint64_t truncatedCount() const;
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    NotificationRecord  record;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t                  mask_;
+
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) size_t tail_ = 0;
+
+  std::atomic<uint64_t> pushed_{0};
+  std::atomic<uint64_t> overflows_{0};
+  std::atomic<uint64_t> truncated_{0};
+
+  // Only touched when the consumer has to sleep
+  std::atomic<bool>       consumerWaiting_{false};
+  std::mutex              waitMutex_;
+  std::condition_variable waitCondition_;
+};
+
+#endif  // NOTIFICATION_QUEUE_H
\ No newline at end of file
@@ -0,0 +1,417 @@
+#include "notification_recorder.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <glob.h>
+#include <iostream>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The layout is the file format; keep it from drifting by accident
+static_assert(sizeof(RecordingSegmentHeader) == 72, "segment header layout");
+static_assert(sizeof(RecordingRecordHeader) == 40, "record header layout");
+
+static size_t alignRecord(size_t bytes)
+{
+  return (bytes + 7) & ~size_t(7);
+}
+
+static uint64_t clockNs(std::chrono::nanoseconds sinceEpoch)
+{
+  return static_cast<uint64_t>(sinceEpoch.count());
+}
+
+NotificationRecorder::~NotificationRecorder()
+{
+  close();
+}
+
+std::string NotificationRecorder::segmentPath(const std::string& prefix,
+                                              uint64_t           index)
+{
+  char number[24];
+  std::snprintf(number,
+                sizeof(number),
+                ".%06llu",
+                static_cast<unsigned long long>(index));
+  return prefix + number + RECORDING_EXTENSION;
+}
+
+bool NotificationRecorder::open(const RecorderOptions& options)
+{
+  close();
+
+  // An empty segment must hold the largest value with its path definition
+  size_t largestAppend =
+    alignRecord(sizeof(RecordingRecordHeader) + NOTIFICATION_MAX_PAYLOAD) +
+    alignRecord(sizeof(RecordingRecordHeader) + RECORDING_MAX_PATH);
+  if (options.segmentSize <
+      alignRecord(sizeof(RecordingSegmentHeader)) + largestAppend)
+  {
+    std::cerr << "Recording segment size too small" << std::endl;
+    return false;
+  }
+
+  // Left in place, a longer earlier recording's tail would be listed and
+  // replayed as part of this one
+  for (const auto& file : RecordingReader::listSegments(options.prefix))
+  {
+    unlink(file.c_str());
+  }
+
+  std::random_device random;
+  options_  = options;
+  segments_ = 0;
+  records_  = 0;
+  dropped_  = 0;
+  id_       = (static_cast<uint64_t>(random()) << 32) | random();
+  return openSegment(0);
+}
+
+void NotificationRecorder::close()
+{
+  closeSegment();
+}
+
+bool NotificationRecorder::isOpen() const
+{
+  return base_ != nullptr;
+}
+
+RecordingSegmentHeader* NotificationRecorder::header()
+{
+  return reinterpret_cast<RecordingSegmentHeader*>(base_);
+}
+
+bool NotificationRecorder::openSegment(uint64_t index)
+{
+  std::string path = segmentPath(options_.prefix, index);
+
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+  {
+    std::cerr << "Failed to create " << path << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  // Allocate the blocks now rather than on first touch through the mapping,
+  // where running out of disk would be a SIGBUS instead of an error
+  int error = posix_fallocate(fd_, 0, options_.segmentSize);
+  if (error != 0)
+  {
+    std::cerr << "Failed to allocate " << path << ": " << std::strerror(error)
+              << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  // Pre-fault the pages as well, so appends do not stall on page faults
+  void* mapping = mmap(nullptr,
+                       options_.segmentSize,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       fd_,
+                       0);
+  if (mapping == MAP_FAILED)
+  {
+    std::cerr << "Failed to map " << path << ": " << std::strerror(errno)
+              << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  base_    = static_cast<uint8_t*>(mapping);
+  segment_ = index;
+  segments_.fetch_add(1, std::memory_order_relaxed);
+
+  RecordingSegmentHeader* segmentHeader = header();
+  std::memcpy(
+    segmentHeader->magic, RECORDING_MAGIC, sizeof(segmentHeader->magic));
+  segmentHeader->version      = RECORDING_VERSION;
+  segmentHeader->headerSize   = alignRecord(sizeof(RecordingSegmentHeader));
+  segmentHeader->segmentIndex = index;
+  segmentHeader->capacity     = options_.segmentSize;
+  segmentHeader->used         = segmentHeader->headerSize;
+  segmentHeader->recordCount  = 0;
+  segmentHeader->wallClockNs =
+    clockNs(std::chrono::system_clock::now().time_since_epoch());
+  segmentHeader->steadyClockNs =
+    clockNs(std::chrono::steady_clock::now().time_since_epoch());
+  segmentHeader->recordingId = id_;
+
+  defined_.assign(defined_.size(), false);
+
+  if (options_.maxSegments > 0 && index >= options_.maxSegments)
+  {
+    unlink(segmentPath(options_.prefix, index - options_.maxSegments).c_str());
+  }
+
+  return true;
+}
+
+void NotificationRecorder::closeSegment()
+{
+  if (!base_)
+    return;
+
+  // Give back the unused tail; readers stop at the used mark regardless
+  uint64_t used = header()->used;
+  munmap(base_, options_.segmentSize);
+  base_ = nullptr;
+
+  if (ftruncate(fd_, static_cast<off_t>(used)) != 0)
+  {
+    std::cerr << "Failed to trim recording segment: " << std::strerror(errno)
+              << std::endl;
+  }
+  ::close(fd_);
+  fd_ = -1;
+}
+
+bool NotificationRecorder::fits(size_t bytes)
+{
+  return base_ && header()->used + bytes <= options_.segmentSize;
+}
+
+// Makes room for bytes more, rotating to a fresh segment when they do not
+// fit. This is the only place an append can make system calls.
+bool NotificationRecorder::reserve(size_t bytes)
+{
+  if (fits(bytes))
+    return true;
+
+  uint64_t next = segment_ + 1;
+  closeSegment();
+  return openSegment(next) && fits(bytes);
+}
+
+void NotificationRecorder::write(const RecordingRecordHeader& record,
+                                 const void*                  payload)
+{
+  RecordingSegmentHeader* segmentHeader = header();
+  uint8_t*                out           = base_ + segmentHeader->used;
+
+  std::memcpy(out, &record, sizeof(record));
+  std::memcpy(out + sizeof(record), payload, record.length);
+
+  // The used mark moves last, so a reader of the live file never sees a
+  // half-written record
+  std::atomic_thread_fence(std::memory_order_release);
+  segmentHeader->recordCount++;
+  segmentHeader->used += alignRecord(sizeof(record) + record.length);
+}
+
+bool NotificationRecorder::append(const std::string&        characteristicPath,
+                                  const NotificationHeader& header,
+                                  const uint8_t*            data)
+{
+  if (!base_ || characteristicPath.size() > RECORDING_MAX_PATH)
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  size_t length = std::min<size_t>(header.length, NOTIFICATION_MAX_PAYLOAD);
+  size_t bytes  = alignRecord(sizeof(RecordingRecordHeader) + length);
+  size_t pathBytes =
+    alignRecord(sizeof(RecordingRecordHeader) + characteristicPath.size());
+
+  bool needsPath =
+    header.handle >= defined_.size() || !defined_[header.handle];
+  if (needsPath)
+  {
+    bytes += pathBytes;
+  }
+
+  // A fresh segment has to define the path again, which open() made sure
+  // there is room for
+  uint64_t segment = segment_;
+  if (!reserve(bytes))
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  if (segment_ != segment && !needsPath)
+  {
+    needsPath = true;
+    bytes += pathBytes;
+    if (!fits(bytes))
+    {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+
+  RecordingRecordHeader record = {};
+  record.handle                = header.handle;
+  record.timestampNs           = header.timestampNs;
+
+  if (needsPath)
+  {
+    if (header.handle >= defined_.size())
+    {
+      defined_.resize(header.handle + 1);
+    }
+    defined_[header.handle] = true;
+
+    record.type   = RecordType::PathDefinition;
+    record.length = static_cast<uint16_t>(characteristicPath.size());
+    write(record, characteristicPath.data());
+  }
+
+  record.type        = RecordType::Notification;
+  record.length      = static_cast<uint16_t>(length);
+  record.sequence    = header.sequence;
+  record.appSequence = header.appSequence;
+  record.flags       = header.hasAppSequence ? RECORD_HAS_APP_SEQUENCE : 0;
+  write(record, data);
+
+  records_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+uint64_t NotificationRecorder::recordCount() const
+{
+  return records_.load(std::memory_order_relaxed);
+}
+
+uint64_t NotificationRecorder::segmentCount() const
+{
+  return segments_.load(std::memory_order_relaxed);
+}
+
+uint64_t NotificationRecorder::droppedCount() const
+{
+  return dropped_.load(std::memory_order_relaxed);
+}
+
+RecordingReader::~RecordingReader()
+{
+  close();
+}
+
+bool RecordingReader::open(const std::string& file)
+{
+  close();
+
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    std::cerr << "Failed to open " << file << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(RecordingSegmentHeader))
+  {
+    std::cerr << file << " is not a recording segment" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  void* mapping =
+    mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    std::cerr << "Failed to map " << file << ": " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  base_ = static_cast<const uint8_t*>(mapping);
+  size_ = static_cast<size_t>(info.st_size);
+
+  const RecordingSegmentHeader& segmentHeader = header();
+  if (std::memcmp(segmentHeader.magic,
+                  RECORDING_MAGIC,
+                  sizeof(segmentHeader.magic)) != 0 ||
+      segmentHeader.version != RECORDING_VERSION)
+  {
+    std::cerr << file << " is not a recording segment" << std::endl;
+    close();
+    return false;
+  }
+
+  offset_ = segmentHeader.headerSize;
+  return true;
+}
+
+void RecordingReader::close()
+{
+  if (base_)
+  {
+    munmap(const_cast<uint8_t*>(base_), size_);
+    base_ = nullptr;
+  }
+  size_   = 0;
+  offset_ = 0;
+}
+
+const RecordingSegmentHeader& RecordingReader::header() const
+{
+  return *reinterpret_cast<const RecordingSegmentHeader*>(base_);
+}
+
+bool RecordingReader::next(RecordingRecordHeader& record,
+                           const uint8_t*&        payload)
+{
+  if (!base_)
+    return false;
+
+  // Pairs with the fence in NotificationRecorder::write
+  size_t end = std::min<size_t>(header().used, size_);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (offset_ + sizeof(RecordingRecordHeader) > end)
+    return false;
+
+  std::memcpy(&record, base_ + offset_, sizeof(record));
+  if (record.type == RecordType::End ||
+      offset_ + sizeof(record) + record.length > end)
+    return false;
+
+  payload = base_ + offset_ + sizeof(record);
+  offset_ += alignRecord(sizeof(record) + record.length);
+  return true;
+}
+
+std::vector<std::string> RecordingReader::listSegments(
+  const std::string& prefix)
+{
+  std::vector<std::string> files;
+
+  // The prefix matches only itself, so "run*" never picks up, or lets
+  // open() delete, another recording's segments
+  std::string pattern;
+  for (char c : prefix)
+  {
+    if (c == '*' || c == '?' || c == '[' || c == '\\')
+      pattern += '\\';
+    pattern += c;
+  }
+
+  // The zero-padded index makes glob's sorted order the recording order
+  pattern += ".[0-9][0-9][0-9][0-9][0-9][0-9]";
+  pattern += RECORDING_EXTENSION;
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, nullptr, &matches) == 0)
+  {
+    for (size_t i = 0; i < matches.gl_pathc; i++)
+    {
+      files.push_back(matches.gl_pathv[i]);
+    }
+  }
+  globfree(&matches);
+
+  return files;
+}
\ No newline at end of file
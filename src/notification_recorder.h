@@ -0,0 +1,145 @@
+#ifndef NOTIFICATION_RECORDER_H
+#define NOTIFICATION_RECORDER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "notification_queue.h"
+
+// On-disk layout of a recording. A recording is a series of segment files,
+// prefix.000000.bscmrec, prefix.000001.bscmrec, ..., each holding one
+// RecordingSegmentHeader followed by 8-byte aligned records. Segments are
+// pre-allocated at full size and trimmed when closed. All fields are in
+// host byte order.
+const char     RECORDING_MAGIC[]     = "BSCMREC1";
+const uint32_t RECORDING_VERSION     = 2;
+const char     RECORDING_EXTENSION[] = ".bscmrec";
+const size_t   RECORDING_MAX_PATH    = 256;  // Longer paths are not recorded
+
+struct RecordingSegmentHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t headerSize;     // Offset of the first record
+  uint64_t segmentIndex;
+  uint64_t capacity;       // File size
+  uint64_t used;           // Bytes holding records, header included
+  uint64_t recordCount;
+  uint64_t wallClockNs;    // system_clock when the segment was opened...
+  uint64_t steadyClockNs;  // ...and steady_clock at the same moment
+  uint64_t recordingId;    // Random, shared by every segment of a recording
+};
+
+enum class RecordType : uint16_t
+{
+  End            = 0,  // Unwritten space; the segment stops here
+  Notification   = 1,  // Payload is the characteristic value
+  PathDefinition = 2   // Payload is the object path behind handle
+};
+
+const uint32_t RECORD_HAS_APP_SEQUENCE = 1;
+
+struct RecordingRecordHeader
+{
+  RecordType type;
+  uint16_t   length;  // Payload bytes following this header
+  uint32_t   handle;
+  uint64_t   timestampNs;  // steady_clock receive time
+  uint64_t   sequence;
+  uint64_t   appSequence;
+  uint32_t   flags;
+  uint32_t   reserved;
+};
+
+struct RecorderOptions
+{
+  std::string prefix;                        // Segment file name prefix
+  size_t      segmentSize = 64 * 1024 * 1024;
+  size_t      maxSegments = 0;  // Oldest are deleted past this; 0 keeps all
+};
+
+// Appends notifications to memory-mapped segment files. Each segment is
+// allocated and mapped up front, so append() is a copy into memory with no
+// system call; files are only touched when a segment fills up and the
+// recorder rotates to the next. Every segment starts its own handle to path
+// mapping, so any one of them can be read on its own. open() deletes the
+// segments of an earlier recording under the same prefix. Not thread safe:
+// feed it from a single thread, e.g. the notification callback. The counts
+// may be read from any thread.
+class NotificationRecorder
+{
+public:
+  NotificationRecorder() = default;
+  ~NotificationRecorder();
+
+  NotificationRecorder(const NotificationRecorder&)            = delete;
+  NotificationRecorder& operator=(const NotificationRecorder&) = delete;
+
+  bool open(const RecorderOptions& options);
+  void close();
+  bool isOpen() const;
+
+  bool append(const std::string&        characteristicPath,
+              const NotificationHeader& header,
+              const uint8_t*            data);
+
+  uint64_t recordCount() const;
+  uint64_t segmentCount() const;
+  uint64_t droppedCount() const;  // Lost to a failed rotation or long path
+
+  static std::string segmentPath(const std::string& prefix, uint64_t index);
+
+private:
+  RecorderOptions options_;
+  int             fd_       = -1;
+  uint8_t*        base_     = nullptr;
+  uint64_t        segment_  = 0;  // Index of the mapped segment
+  uint64_t        id_       = 0;  // recordingId of this recording
+
+  std::atomic<uint64_t> segments_{0};  // Segments opened so far
+  std::atomic<uint64_t> records_{0};
+  std::atomic<uint64_t> dropped_{0};
+
+  // Handles with a PathDefinition in the current segment
+  std::vector<bool> defined_;
+
+  RecordingSegmentHeader* header();
+  bool                    openSegment(uint64_t index);
+  void                    closeSegment();
+  bool                    fits(size_t bytes);
+  bool                    reserve(size_t bytes);
+  void                    write(const RecordingRecordHeader& record,
+                                const void*                  payload);
+};
+
+// Walks the records of one segment file, including one still being written
+class RecordingReader
+{
+public:
+  RecordingReader() = default;
+  ~RecordingReader();
+
+  RecordingReader(const RecordingReader&)            = delete;
+  RecordingReader& operator=(const RecordingReader&) = delete;
+
+  bool open(const std::string& file);
+  void close();
+
+  const RecordingSegmentHeader& header() const;
+
+  // Moves to the next record. payload points into the mapping and is valid
+  // until close().
+  bool next(RecordingRecordHeader& record, const uint8_t*& payload);
+
+  // Segment files of a recording, in order
+  static std::vector<std::string> listSegments(const std::string& prefix);
+
+private:
+  const uint8_t* base_   = nullptr;
+  size_t         size_   = 0;
+  size_t         offset_ = 0;
+};
+
+#endif  // NOTIFICATION_RECORDER_H
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include "notification_replay.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include "notification_recorder.h"
+
+NotificationReplay::NotificationReplay(BluetoothManager& manager)
+  : manager_(manager)
+{
+}
+
+void NotificationReplay::stop()
+{
+  stopping_ = true;
+}
+
+bool NotificationReplay::run(const std::string&   prefix,
+                             const ReplayOptions& options,
+                             ReplayStats&         stats)
+{
+  std::vector<std::string> segments = RecordingReader::listSegments(prefix);
+  if (segments.empty())
+  {
+    std::cerr << "No recording segments found for " << prefix << std::endl;
+    return false;
+  }
+
+  stats     = ReplayStats();
+  stopping_ = false;
+
+  // Recorded handle -> handle in this manager
+  std::unordered_map<uint32_t, uint32_t> handles;
+
+  // Segments are only played if they belong to the same recording as the
+  // first one
+  uint64_t recordingId = 0;
+
+  // Each record is due at base plus its distance from baseNs, scaled
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start     = Clock::now();
+  Clock::time_point base      = start;
+  uint64_t          baseNs    = 0;
+  uint64_t          lastNs    = 0;
+  uint64_t          spanNs    = 0;
+  bool              haveFirst = false;
+
+  for (const auto& segment : segments)
+  {
+    RecordingReader reader;
+    if (!reader.open(segment))
+      return false;
+    if (stats.segments == 0)
+    {
+      recordingId = reader.header().recordingId;
+    }
+    else if (reader.header().recordingId != recordingId)
+    {
+      std::cerr << "Skipping " << segment << ", it is from another recording"
+                << std::endl;
+      continue;
+    }
+    stats.segments++;
+
+    RecordingRecordHeader record;
+    const uint8_t*        payload;
+    while (!stopping_ && reader.next(record, payload))
+    {
+      if (record.type == RecordType::PathDefinition)
+      {
+        std::string path(reinterpret_cast<const char*>(payload), record.length);
+        uint32_t    handle = manager_.internCharacteristicPath(path);
+        if (handles.emplace(record.handle, handle).second)
+        {
+          stats.characteristicPaths.push_back(path);
+          if (options.useSequenceField)
+            manager_.setSequenceField(path, options.sequenceField);
+        }
+        continue;
+      }
+      if (record.type != RecordType::Notification)
+        continue;
+
+      auto handleIt = handles.find(record.handle);
+      if (handleIt == handles.end())
+      {
+        stats.skipped++;
+        continue;
+      }
+
+      // Timestamps can run backwards, e.g. across a reboot or between
+      // producers. Restart the schedule from the current value then rather
+      // than wait for a negative offset.
+      if (!haveFirst || record.timestampNs < lastNs)
+      {
+        if (haveFirst)
+        {
+          stats.timeJumps++;
+          base = Clock::now();
+        }
+        baseNs    = record.timestampNs;
+        haveFirst = true;
+      }
+      else
+      {
+        spanNs += record.timestampNs - lastNs;
+      }
+      lastNs = record.timestampNs;
+
+      // Hold each value until its recorded offset, scaled, has passed
+      if (options.speed > 0)
+      {
+        auto offset = std::chrono::nanoseconds(static_cast<int64_t>(
+          static_cast<double>(record.timestampNs - baseNs) / options.speed));
+        Clock::time_point due = base + offset;
+        Clock::time_point now = Clock::now();
+        if (due > now)
+        {
+          std::this_thread::sleep_until(due);
+        }
+        else
+        {
+          int64_t lagUs =
+            std::chrono::duration_cast<std::chrono::microseconds>(now - due)
+              .count();
+          stats.maxLagUs =
+            std::max(stats.maxLagUs, static_cast<uint64_t>(lagUs));
+        }
+      }
+
+      manager_.injectNotification(handleIt->second, payload, record.length);
+      stats.records++;
+      stats.bytes += record.length;
+    }
+  }
+
+  stats.seconds =
+    std::chrono::duration<double>(Clock::now() - start).count();
+  stats.recordedSeconds = static_cast<double>(spanNs) / 1e9;
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef NOTIFICATION_REPLAY_H
+#define NOTIFICATION_REPLAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "bluetooth_manager.h"
+
+struct ReplayOptions
+{
+  // 1 keeps the recorded timing, 10 plays ten times faster, 0 plays as fast
+  // as the manager takes the values
+  double speed = 1.0;
+
+  // Applied to every replayed characteristic before its first value
+  bool          useSequenceField = false;
+  SequenceField sequenceField;
+};
+
+struct ReplayStats
+{
+  uint64_t records         = 0;  // Notifications fed to the manager
+  uint64_t bytes           = 0;  // Their payload
+  uint64_t skipped         = 0;  // Records whose handle had no path
+  uint64_t segments        = 0;
+  double   seconds         = 0;  // Wall time the replay took
+  double   recordedSeconds = 0;  // Recorded time covered, jumps excluded
+  uint64_t maxLagUs        = 0;  // Furthest a value fell behind schedule
+  uint64_t timeJumps       = 0;  // Times timestamps went backwards
+
+  std::vector<std::string> characteristicPaths;  // In order of appearance
+};
+
+// Plays a recording made by NotificationRecorder back into a
+// BluetoothManager. Values go through injectNotification(), so consumers
+// see them exactly as live data: with sequence numbers and stats, through
+// the queue when one is enabled, and otherwise through the callbacks.
+class NotificationReplay
+{
+public:
+  explicit NotificationReplay(BluetoothManager& manager);
+
+  // Blocks until every segment of the recording at prefix has been played
+  // or stop() is called
+  bool run(const std::string&   prefix,
+           const ReplayOptions& options,
+           ReplayStats&         stats);
+  void stop();
+
+private:
+  BluetoothManager& manager_;
+  std::atomic<bool> stopping_{false};
+};
+
+#endif  // NOTIFICATION_REPLAY_H
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "object_path_table.h"
+
+uint32_t ObjectPathTable::intern(std::string_view path)
+{
+  auto it = handles_.find(path);
+  if (it != handles_.end())
+    return it->second;
+
+  uint32_t handle;
+  if (free_.empty())
+  {
+    handle = static_cast<uint32_t>(paths_.size());
+    paths_.emplace_back(path);
+  }
+  else
+  {
+    handle = free_.back();
+    free_.pop_back();
+    paths_[handle].assign(path);
+  }
+
+  std::string_view stored = paths_[handle];
+  handles_.emplace(stored, handle);
+  ordered_.emplace(stored, handle);
+  return handle;
+}
+
+uint32_t ObjectPathTable::find(std::string_view path) const
+{
+  auto it = handles_.find(path);
+  if (it == handles_.end())
+    return INVALID_HANDLE;
+
+  return it->second;
+}
+
+const std::string& ObjectPathTable::path(uint32_t handle) const
+{
+  return paths_.at(handle);
+}
+
+size_t ObjectPathTable::size() const
+{
+  return paths_.size();
+}
+
+void ObjectPathTable::release(uint32_t handle)
+{
+  // Object paths are never empty, so an empty slot is already free
+  if (handle >= paths_.size() || paths_[handle].empty())
+    return;
+
+  handles_.erase(paths_[handle]);
+  ordered_.erase(paths_[handle]);
+  paths_[handle].clear();
+  paths_[handle].shrink_to_fit();
+  free_.push_back(handle);
+}
+
+std::vector<uint32_t> ObjectPathTable::findPrefix(std::string_view prefix) const
+{
+  std::vector<uint32_t> handles;
+
+  // Paths below an object sort directly after it
+  for (auto it = ordered_.lower_bound(prefix);
+       it != ordered_.end() && it->first.substr(0, prefix.size()) == prefix;
+       ++it)
+  {
+    handles.push_back(it->second);
+  }
+
+  return handles;
+}
\ No newline at end of file
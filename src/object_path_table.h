@@ -0,0 +1,42 @@
+#ifndef OBJECT_PATH_TABLE_H
+#define OBJECT_PATH_TABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Interns D-Bus object paths into dense integer handles so per-object state
+// can live in flat tables indexed by handle. A handle stays bound to its
+// path until release(), after which intern() hands it out again for another
+// path, so the tables stay as large as the set of live objects rather than
+// every path ever seen. Lookups hash a std::string_view, so resolving the
+// path of an incoming message allocates nothing.
+class ObjectPathTable
+{
+public:
+  static const uint32_t INVALID_HANDLE = UINT32_MAX;
+
+  uint32_t           intern(std::string_view path);
+  uint32_t           find(std::string_view path) const;
+  const std::string& path(uint32_t handle) const;  // Empty once released
+  size_t             size() const;
+
+  // Forgets the path behind handle; nothing may refer to the handle after
+  void release(uint32_t handle);
+
+  // Handles of every path that starts with prefix, in path order
+  std::vector<uint32_t> findPrefix(std::string_view prefix) const;
+
+private:
+  // deque so the strings the views below point at never move
+  std::deque<std::string>                        paths_;
+  std::unordered_map<std::string_view, uint32_t> handles_;
+  std::map<std::string_view, uint32_t>           ordered_;
+  std::vector<uint32_t>                          free_;  // Released handles
+};
+
+#endif  // OBJECT_PATH_TABLE_H
\ No newline at end of file
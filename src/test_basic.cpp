@@ -1,5 +1,390 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <unistd.h>
 #include "bluetooth_manager.h"
+#include "daemon_server.h"
+#include "notification_recorder.h"
+
+static bool testRecorder()
+{
+  std::string prefix = "/tmp/bscm-test-recording-" + std::to_string(getpid());
+  const std::string path = "/org/bluez/hci0/dev_00/service0010/char0011";
+
+  RecorderOptions options;
+  options.prefix      = prefix;
+  options.segmentSize = 4096;
+
+  NotificationRecorder recorder;
+  if (!recorder.open(options))
+    return false;
+
+  std::vector<uint8_t> payload(100, 0x5a);
+  NotificationHeader   header;
+  header.handle = 7;
+  header.length = static_cast<uint16_t>(payload.size());
+  for (uint64_t i = 1; i <= 100; i++)
+  {
+    header.sequence = i;
+    if (!recorder.append(path, header, payload.data()))
+      return false;
+  }
+  recorder.close();
+
+  uint64_t expected = 1;
+  bool     ok       = recorder.segmentCount() > 1;
+  for (const auto& file : RecordingReader::listSegments(prefix))
+  {
+    RecordingReader       reader;
+    RecordingRecordHeader record;
+    const uint8_t*        data;
+    ok = ok && reader.open(file) && reader.next(record, data) &&
+         record.type == RecordType::PathDefinition &&
+         std::string(reinterpret_cast<const char*>(data), record.length) ==
+           path;
+    while (ok && reader.next(record, data))
+    {
+      ok = record.type == RecordType::Notification && record.handle == 7 &&
+           record.sequence == expected++ && data[99] == 0x5a;
+    }
+    unlink(file.c_str());
+  }
+
+  return ok && expected == 101;
+}
+
+static bool testDaemonFraming()
+{
+  DaemonFrameWriter writer(DaemonMessage::Write);
+  writer.u32(0x01020304);
+  writer.string("/org/bluez/hci0/dev_00/service0010/char0011");
+  writer.u8(static_cast<uint8_t>(WriteType::Command));
+  const uint8_t value[] = {0x15, 0x45};
+  writer.bytes(value, sizeof(value));
+  writer.u64(0x1122334455667788);
+  const std::vector<uint8_t>& frame = writer.finish();
+
+  // Length prefix counts everything after itself
+  if (frame.size() != 4 + 1 + 4 + 2 + 43 + 1 + 2 + 2 + 8 || frame[0] != 63 ||
+      frame[4] != static_cast<uint8_t>(DaemonMessage::Write))
+    return false;
+
+  DaemonFrameReader reader(frame.data() + 5, frame.size() - 5);
+  uint32_t          requestId;
+  std::string       path;
+  uint8_t           type;
+  const uint8_t*    data;
+  size_t            length;
+  uint64_t          tail;
+  uint8_t           past;
+  return reader.u32(requestId) && requestId == 0x01020304 &&
+         reader.string(path) && path.size() == 43 && reader.u8(type) &&
+         type == 2 && reader.bytes(data, length) && length == 2 &&
+         data[1] == 0x45 && reader.u64(tail) && tail == 0x1122334455667788 &&
+         !reader.u8(past);
+}
+
+// Drives a full scan/connect/notify/write cycle against mock-bluez
+static bool testAgainstMock(const std::string& busAddress)
+{
+  BluetoothManager manager;
+  if (!manager.initialize(busAddress))
+    return false;
+
+  manager.setDesiredServices({"15451545"});
+  if (!manager.startDiscovery())
+    return false;
+  manager.scanForDevices(1);
+  manager.stopDiscovery();
+
+  std::vector<BluetoothDevice> devices =
+    manager.getDevicesWithDesiredServices();
+  if (devices.empty() || !manager.connectToDevice(devices[0].path))
+    return false;
+
+  std::vector<BluetoothCharacteristic> characteristics =
+    manager.getCharacteristics(devices[0].path);
+  if (characteristics.empty())
+    return false;
+  const std::string& path = characteristics[0].path;
+
+  std::atomic<int> received{0};
+  manager.setNotificationCallback(
+    [&received](const std::string&, const std::vector<uint8_t>&) {
+      received++;
+    });
+  // mock-bluez prefixes every value with a little-endian 32-bit counter
+  if (!manager.setSequenceField(path, SequenceField{0, 4, false}) ||
+      !manager.enableNotifications(path))
+    return false;
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  manager.disableNotifications(path);
+  if (received == 0)
+    return false;
+
+  NotificationStats notificationStats = manager.getNotificationStats(path);
+  if (notificationStats.sequenced != notificationStats.received ||
+      notificationStats.gaps != 0 || notificationStats.reordered != 0)
+  {
+    std::cerr << "Notification stream lost values" << std::endl;
+    return false;
+  }
+
+  std::vector<uint8_t> value = {0x15, 0x45};
+  if (!manager.writeCharacteristic(path, value, WriteType::Request) ||
+      manager.readCharacteristic(path) != value)
+    return false;
+
+  bool readTimed = false;
+  for (const auto& stats : manager.getCallStats())
+  {
+    readTimed |= stats.method == "ReadValue" && stats.calls > 0;
+  }
+  if (!readTimed)
+    return false;
+
+  return manager.disconnectFromDevice(devices[0].path);
+}
+
+// A daemon client socket whose reads give up after 200 ms
+static int connectDaemonClient(const std::string& socketPath)
+{
+  sockaddr_un address = {};
+  address.sun_family  = AF_UNIX;
+  std::strncpy(address.sun_path, socketPath.c_str(),
+               sizeof(address.sun_path) - 1);
+
+  int     fd      = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  timeval timeout = {0, 200000};
+  if (fd < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) !=
+        0 ||
+      connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+        0)
+  {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool readExactly(int fd, uint8_t* data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t count = read(fd, data, length);
+    if (count <= 0)
+      return false;
+    data += count;
+    length -= static_cast<size_t>(count);
+  }
+  return true;
+}
+
+// Reads one frame into body, type byte first
+static bool readDaemonFrame(int fd, std::vector<uint8_t>& body)
+{
+  uint32_t length;
+  if (!readExactly(fd, reinterpret_cast<uint8_t*>(&length), sizeof(length)) ||
+      length == 0 || length > DAEMON_MAX_FRAME)
+    return false;
+  body.resize(length);
+  return readExactly(fd, body.data(), length);
+}
+
+// Sends a request and waits for its response, counting the notifications
+// that arrive first. body is left at what follows the status.
+static bool callDaemon(int                   fd,
+                       DaemonFrameWriter&    request,
+                       DaemonMessage         type,
+                       uint32_t              requestId,
+                       std::vector<uint8_t>& body,
+                       int&                  notifications)
+{
+  const std::vector<uint8_t>& frame = request.finish();
+  if (write(fd, frame.data(), frame.size()) !=
+      static_cast<ssize_t>(frame.size()))
+    return false;
+
+  uint8_t responseType = static_cast<uint8_t>(type) |
+                         static_cast<uint8_t>(DaemonMessage::Response);
+  for (int waits = 0; waits < 50;)
+  {
+    if (!readDaemonFrame(fd, body))
+    {
+      waits++;
+      continue;
+    }
+    if (body[0] == static_cast<uint8_t>(DaemonMessage::Notification))
+    {
+      notifications++;
+      continue;
+    }
+
+    DaemonFrameReader reader(body.data() + 1, body.size() - 1);
+    uint32_t          echoed;
+    uint8_t           status;
+    if (body[0] != responseType || !reader.u32(echoed) ||
+        echoed != requestId || !reader.u8(status))
+      return false;
+    body.erase(body.begin(), body.begin() + 6);
+    return status == static_cast<uint8_t>(DaemonStatus::Ok);
+  }
+  return false;
+}
+
+// Counts the notifications for handle that arrive within about 300 ms
+static int countDaemonNotifications(int fd, uint32_t handle)
+{
+  auto deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+  std::vector<uint8_t> body;
+  int                  count = 0;
+  while (std::chrono::steady_clock::now() < deadline)
+  {
+    uint32_t received;
+    if (!readDaemonFrame(fd, body))
+      continue;
+    DaemonFrameReader reader(body.data() + 1, body.size() - 1);
+    if (body[0] == static_cast<uint8_t>(DaemonMessage::Notification) &&
+        reader.u32(received) && received == handle)
+      count++;
+  }
+  return count;
+}
+
+// Two daemon clients share one subscription; the survivor keeps receiving
+// after the other hangs up, and across a disconnect and reconnect. Leaves
+// devicePath set once it is connected.
+static bool exerciseDaemon(BluetoothManager& manager,
+                           DaemonServer&     server,
+                           int               (&clients)[2],
+                           std::string&      devicePath)
+{
+  std::vector<uint8_t> body;
+  int                  early = 0;
+
+  DaemonFrameWriter request(DaemonMessage::Scan);
+  request.u32(1);
+  request.u16(1);
+  if (!callDaemon(clients[0], request, DaemonMessage::Scan, 1, body, early))
+    return false;
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  request.reset(DaemonMessage::ListDevices);
+  request.u32(2);
+  if (!callDaemon(
+        clients[0], request, DaemonMessage::ListDevices, 2, body, early))
+    return false;
+  DaemonFrameReader devices(body.data(), body.size());
+  uint16_t          count;
+  if (!devices.u16(count) || count == 0 || !devices.string(devicePath))
+    return false;
+
+  request.reset(DaemonMessage::Connect);
+  request.u32(3);
+  request.string(devicePath);
+  if (!callDaemon(clients[0], request, DaemonMessage::Connect, 3, body, early))
+    return false;
+  std::vector<BluetoothCharacteristic> characteristics =
+    manager.getCharacteristics(devicePath);
+  if (characteristics.empty())
+    return false;
+
+  uint32_t handles[2];
+  for (int i = 0; i < 2; i++)
+  {
+    request.reset(DaemonMessage::Subscribe);
+    request.u32(4);
+    request.string(characteristics[0].path);
+    request.u8(static_cast<uint8_t>(NotificationMode::StartNotify));
+    if (!callDaemon(
+          clients[i], request, DaemonMessage::Subscribe, 4, body, early))
+      return false;
+    DaemonFrameReader reader(body.data(), body.size());
+    if (!reader.u32(handles[i]))
+      return false;
+  }
+
+  // Nothing may arrive ahead of the handle that tags it
+  if (early != 0 || handles[0] != handles[1] ||
+      countDaemonNotifications(clients[0], handles[0]) == 0 ||
+      countDaemonNotifications(clients[1], handles[1]) == 0)
+    return false;
+
+  close(clients[1]);
+  clients[1] = -1;
+  countDaemonNotifications(clients[0], handles[0]);
+  if (server.clientCount() != 1 ||
+      countDaemonNotifications(clients[0], handles[0]) == 0)
+    return false;
+
+  // Reconnecting brings back the values the disconnect stopped, and
+  // subscribing again still hands out a handle that delivers
+  request.reset(DaemonMessage::Disconnect);
+  request.u32(5);
+  request.string(devicePath);
+  if (!callDaemon(
+        clients[0], request, DaemonMessage::Disconnect, 5, body, early))
+    return false;
+  request.reset(DaemonMessage::Connect);
+  request.u32(6);
+  request.string(devicePath);
+  if (!callDaemon(clients[0], request, DaemonMessage::Connect, 6, body, early))
+    return false;
+  countDaemonNotifications(clients[0], handles[0]);
+  if (countDaemonNotifications(clients[0], handles[0]) == 0)
+    return false;
+
+  request.reset(DaemonMessage::Subscribe);
+  request.u32(7);
+  request.string(characteristics[0].path);
+  request.u8(static_cast<uint8_t>(NotificationMode::StartNotify));
+  if (!callDaemon(
+        clients[0], request, DaemonMessage::Subscribe, 7, body, early))
+    return false;
+  DaemonFrameReader reader(body.data(), body.size());
+  uint32_t          handle;
+  return reader.u32(handle) && handle == handles[0] &&
+         countDaemonNotifications(clients[0], handle) > 0;
+}
+
+static bool testDaemonAgainstMock(const std::string& busAddress)
+{
+  BluetoothManager manager;
+  if (!manager.initialize(busAddress))
+    return false;
+
+  std::string socketPath =
+    "/tmp/bscm-test-daemon-" + std::to_string(getpid()) + ".sock";
+  DaemonServer server(manager);
+  if (!server.listen(socketPath))
+    return false;
+  std::thread runner([&server]() { server.run(); });
+
+  int         clients[2] = {connectDaemonClient(socketPath),
+                            connectDaemonClient(socketPath)};
+  std::string devicePath;
+  bool        passed = clients[0] >= 0 && clients[1] >= 0 &&
+                       exerciseDaemon(manager, server, clients, devicePath);
+
+  for (int fd : clients)
+  {
+    if (fd >= 0)
+      close(fd);
+  }
+  server.stop();
+  runner.join();
+  if (!devicePath.empty())
+    manager.disconnectFromDevice(devicePath);
+  return passed;
+}
 
 int main()
 {
@@ -24,6 +409,81 @@ int main()
   }
   std::cout << std::dec << std::endl;
 
+  // Test that short form UUIDs expand onto the Bluetooth base UUID
+  BluetoothUuid shortUuid = BluetoothUuid::fromString("180F");
+  if (shortUuid != BluetoothUuid::fromString(testServices[0]) ||
+      BluetoothUuid::fromString("15451545").toString() !=
+        "15451545-0000-1000-8000-00805f9b34fb" ||
+      !BluetoothUuid::fromString("not-a-uuid").isNil())
+  {
+    std::cerr << "UUID parsing failed" << std::endl;
+    return 1;
+  }
+  std::cout << "UUID parsing working" << std::endl;
+
+  // Test the notification queue hands records back in order and counts
+  // what it has to drop once full
+  NotificationQueue queue(4);
+  for (uint32_t i = 0; i < 6; i++)
+  {
+    queue.push(i, i * 1000, testData.data(), testData.size());
+  }
+
+  NotificationRecord record;
+  uint32_t           expectedHandle = 0;
+  while (queue.tryPop(record))
+  {
+    if (record.handle != expectedHandle++ ||
+        record.length != testData.size() ||
+        record.data[3] != 0xFF)
+    {
+      std::cerr << "Notification queue returned a bad record" << std::endl;
+      return 1;
+    }
+  }
+  if (expectedHandle != 4 || queue.overflowCount() != 2)
+  {
+    std::cerr << "Notification queue overflow not detected" << std::endl;
+    return 1;
+  }
+  std::cout << "Notification queue working" << std::endl;
+
+  // Test the recorder rotates segments and each one reads back on its own,
+  // starting with the path of the handle it records
+  if (!testRecorder())
+  {
+    std::cerr << "Notification recorder failed" << std::endl;
+    return 1;
+  }
+  std::cout << "Notification recorder working" << std::endl;
+
+  // Test daemon frames read back field by field and stop at their end
+  if (!testDaemonFraming())
+  {
+    std::cerr << "Daemon framing failed" << std::endl;
+    return 1;
+  }
+  std::cout << "Daemon framing working" << std::endl;
+
+  // Needs mock-bluez serving on the given bus, see README
+  const char* testBus = std::getenv("BSCM_TEST_BUS");
+  if (testBus)
+  {
+    if (!testAgainstMock(testBus))
+    {
+      std::cerr << "Mock BlueZ session failed" << std::endl;
+      return 1;
+    }
+    std::cout << "Mock BlueZ session working" << std::endl;
+
+    if (!testDaemonAgainstMock(testBus))
+    {
+      std::cerr << "Daemon against mock BlueZ failed" << std::endl;
+      return 1;
+    }
+    std::cout << "Daemon against mock BlueZ working" << std::endl;
+  }
+
   std::cout << "All basic functionality tests passed!" << std::endl;
   return 0;
 }
\ No newline at end of file